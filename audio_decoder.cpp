@@ -33,8 +33,13 @@
 
 #include "tracy_import.h"
 
+#include <chrono>
+
 #ifdef GDEXTENSION
 #include "gdextension_build/gdex_print.h"
+#include <godot_cpp/classes/audio_server.hpp>
+#else
+#include "servers/audio_server.h"
 #endif
 
 extern "C" {
@@ -42,7 +47,11 @@ extern "C" {
 #include "libavformat/avio.h"
 }
 
-const int MAX_PENDING_FRAMES = 5;
+const int DEFAULT_BUFFER_LENGTH_MS = 100;
+const int MIN_BUFFER_LENGTH_MS = 20;
+const int MAX_BUFFER_LENGTH_MS = 2000;
+// Seeks not yet seen by the consumer, the decoder waits for it to catch up beyond that.
+const int MAX_PCM_SEGMENTS = 16;
 
 String ffmpeg_audio_get_error_message(int p_error_code) {
 	const uint64_t buffer_size = 256;
@@ -139,7 +148,8 @@ void AudioDecoder::recreate_codec_context() {
 		return;
 	}
 	AVCodecParameters codec_params = *audio_stream->codecpar;
-	const AVCodec *codec = avcodec_find_decoder(codec_params.codec_id);
+	Ref<FFmpegCodec> default_codec = FFmpegCodecRegistry::get_singleton()->get_default_decoder(codec_params.codec_id);
+	const AVCodec *codec = default_codec.is_valid() ? default_codec->get_codec_ptr() : nullptr;
 	if (codec) {
 		if (audio_codec_context != nullptr) {
 			avcodec_free_context(&audio_codec_context);
@@ -185,64 +195,128 @@ AudioDecoder::HardwareAudioDecoder AudioDecoder::from_av_hw_device_type(AVHWDevi
 	return AudioDecoder::NONE;
 }
 
-void AudioDecoder::_seek_command(double p_target_timestamp) {
+void AudioDecoder::_seek_command(double p_target_timestamp, uint32_t p_serial) {
+	_perform_seek(p_target_timestamp, p_serial);
+	pending_commands.decrement();
+}
+
+void AudioDecoder::_perform_seek(double p_target_timestamp, uint32_t p_serial) {
 	av_seek_frame(format_context, audio_stream->index, (long)(p_target_timestamp / audio_time_base_in_seconds / 1000.0), AVSEEK_FLAG_BACKWARD);
 	// No need to seek the audio stream separately since it is seeked automatically with the audio stream
 	// due to being in the same file
 	avcodec_flush_buffers(audio_codec_context);
+	resampler.reset();
 	skip_output_until_time = p_target_timestamp;
 	decoder_state = DecoderState::READY;
-	skip_current_outputs.clear();
+	decode_serial = p_serial;
+	// Loops keep the serial but still start a new segment, the media time jumps back.
+	pending_frames = 0;
+	segment_started = false;
+}
+
+bool AudioDecoder::_is_output_stale() const {
+	// A seek was requested but hasn't been processed by the decoder thread yet.
+	return decode_serial != seek_serial.get();
+}
+
+bool AudioDecoder::_has_work() const {
+	if (thread_abort.is_set() || pending_commands.get() > 0) {
+		return true;
+	}
+	return decoder_state != DecoderState::END_OF_STREAM;
+}
+
+void AudioDecoder::_wait_for_work() {
+	ZoneScopedN("Audio decoder idle");
+	std::unique_lock<std::mutex> lock(wakeup_mutex);
+	wakeup_condition.wait(lock, [this]() { return _has_work(); });
+}
+
+void AudioDecoder::_wait_for_refill() {
+	ZoneScopedN("Audio decoder wait for refill");
+	std::unique_lock<std::mutex> lock(wakeup_mutex);
+	// Seeks and shutdown cut the wait short, the mixer freeing space doesn't.
+	wakeup_condition.wait_for(lock, std::chrono::microseconds(refill_interval_usec), [this]() {
+		return thread_abort.is_set() || pending_commands.get() > 0;
+	});
+}
+
+void AudioDecoder::_wake_decoder() {
+	if (task != nullptr) {
+		FFmpegDecodeScheduler::get_singleton()->signal(task);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(wakeup_mutex);
+	wakeup_condition.notify_one();
 }
 
 void AudioDecoder::_thread_func(void *userdata) {
 	AudioDecoder *decoder = (AudioDecoder *)userdata;
-	AVPacket *packet = av_packet_alloc();
-	AVFrame *receive_frame = av_frame_alloc();
 
-#ifdef GDEXTENSION
-	String audio_decoding_str = vformat("Audio decoding %d", OS::get_singleton()->get_thread_caller_id());
-#else
-	String audio_decoding_str = vformat("Audio decoding %d", Thread::get_caller_id());
-#endif
-	CharString str = audio_decoding_str.utf8();
 	while (!decoder->thread_abort.is_set()) {
-		switch (decoder->decoder_state) {
-			case READY:
-			case RUNNING: {
-				decoder->audio_buffer_mutex.lock();
-				bool needs_frame = decoder->decoded_audio_frames.size() < MAX_PENDING_FRAMES;
-				decoder->audio_buffer_mutex.unlock();
-				if (needs_frame) {
-					FrameMarkStart(audio_decoding);
-					decoder->_decode_next_frame(packet, receive_frame);
-					FrameMarkEnd(audio_decoding);
-				} else {
-					decoder->decoder_state = DecoderState::READY;
-					OS::get_singleton()->delay_usec(1000);
-				}
+		switch (decoder->_decode_step()) {
+			case FFmpegDecodeTask::STEP_IDLE: {
+				decoder->_wait_for_work();
 			} break;
-			case END_OF_STREAM: {
-				// While at the end of the stream, avoid attempting to read further as this comes with a non-negligible overhead.
-				// A Seek() operation will trigger a state change, allowing decoding to potentially start again.
-				OS::get_singleton()->delay_usec(50000);
+			case FFmpegDecodeTask::STEP_RETRY_LATER: {
+				decoder->_wait_for_refill();
 			} break;
 			default: {
-				ERR_PRINT("Invalid decoder state");
 			} break;
 		}
-		decoder->decoder_commands.flush_if_pending();
 	}
 
-	av_packet_free(&packet);
-	av_frame_free(&receive_frame);
-
 	if (decoder->decoder_state != DecoderState::FAULTED) {
 		decoder->decoder_state = DecoderState::STOPPED;
 	}
 }
 
-void AudioDecoder::_decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_frame) {
+FFmpegDecodeTask::StepResult AudioDecoder::_task_func(void *p_userdata) {
+	return ((AudioDecoder *)p_userdata)->_decode_step();
+}
+
+FFmpegDecodeTask::StepResult AudioDecoder::_decode_step() {
+	decoder_commands.flush_if_pending();
+	if (thread_abort.is_set()) {
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+	if (pending_commands.get() > 0) {
+		// A seek is on its way into the command queue, keep going until it lands.
+		return FFmpegDecodeTask::STEP_CONTINUE;
+	}
+	if (!_flush_pending_samples()) {
+		// The ring is full. The mixing thread must not lock, so rather than being signaled
+		// the decoder checks back once it has had time to play some of it.
+		return FFmpegDecodeTask::STEP_RETRY_LATER;
+	}
+	switch (decoder_state) {
+		case READY:
+		case RUNNING: {
+			FrameMarkStart(audio_decoding);
+			bool decoded = _decode_next_frame(packet, receive_frame);
+			FrameMarkEnd(audio_decoding);
+			return decoded ? FFmpegDecodeTask::STEP_CONTINUE : FFmpegDecodeTask::STEP_RETRY_LATER;
+		} break;
+		case END_OF_STREAM: {
+			// While at the end of the stream, avoid attempting to read further as this comes with a non-negligible overhead.
+			// A Seek() operation will trigger a state change, allowing decoding to potentially start again.
+			// The codec may still hold frames that didn't fit in the ring while it was being drained.
+			_read_decoded_audio_frames(receive_frame);
+			if (pending_frames > 0) {
+				return FFmpegDecodeTask::STEP_RETRY_LATER;
+			}
+			if (!_is_output_stale()) {
+				ended_serial.set(decode_serial + 1);
+			}
+		} break;
+		default: {
+			ERR_PRINT("Invalid decoder state");
+		} break;
+	}
+	return FFmpegDecodeTask::STEP_IDLE;
+}
+
+bool AudioDecoder::_decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_frame) {
 	ZoneScopedN("Audio decoder decode next frame");
 	int read_frame_result = 0;
 
@@ -270,16 +344,18 @@ void AudioDecoder::_decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_fra
 	} else if (read_frame_result == AVERROR_EOF) {
 		_send_packet(audio_codec_context, p_receive_frame, nullptr);
 		if (looping) {
-			seek(0);
+			// Keep the serial, frames from the previous loop are still valid for the consumer.
+			_perform_seek(0, decode_serial);
 		} else {
 			decoder_state = DecoderState::END_OF_STREAM;
 		}
 	} else if (read_frame_result == -EAGAIN) {
 		decoder_state = DecoderState::READY;
-		OS::get_singleton()->delay_usec(1000);
+		return false;
 	} else {
 		print_line(vformat("Failed to read data into avcodec packet: %s", ffmpeg_audio_get_error_message(read_frame_result)));
 	}
+	return true;
 }
 
 int AudioDecoder::_send_packet(AVCodecContext *p_codec_context, AVFrame *p_receive_frame, AVPacket *p_packet) {
@@ -321,8 +397,8 @@ void AudioDecoder::_try_disable_hw_decoding(int p_error_code) {
 }
 
 void AudioDecoder::_read_decoded_audio_frames(AVFrame *p_received_frame) {
-	Vector<uint8_t> unwrapped_frame;
-	while (true) {
+	// Whatever the codec still holds is read once the ring has room again.
+	while (pending_frames == 0) {
 		ZoneScopedN("Audio decoder read decoded frame");
 		int receive_frame_result = avcodec_receive_frame(audio_codec_context, p_received_frame);
 
@@ -340,116 +416,153 @@ void AudioDecoder::_read_decoded_audio_frames(AVFrame *p_received_frame) {
 		int64_t frame_timestamp = p_received_frame->best_effort_timestamp != AV_NOPTS_VALUE ? p_received_frame->best_effort_timestamp : p_received_frame->pts;
 		double frame_time = (frame_timestamp - audio_stream->start_time) * audio_time_base_in_seconds * 1000.0;
 
-		if (skip_output_until_time > frame_time || skip_current_outputs.is_set()) {
+		if (skip_output_until_time > frame_time || _is_output_stale()) {
 			continue;
 		}
 		last_decoded_frame_time.set(frame_time);
-		AVFrame *frame = _ensure_frame_audio_format(p_received_frame, AV_SAMPLE_FMT_FLT);
+		AVFrame *frame = resampler.convert(p_received_frame);
+		av_frame_unref(p_received_frame);
 
 		if (!frame) {
-			av_frame_unref(p_received_frame);
 			return;
 		}
-		
-		ERR_FAIL_COND_MSG(av_sample_fmt_is_planar((AVSampleFormat)frame->format), "Audio format should never be planar, bug?");
-
-		int data_size = av_samples_get_buffer_size(nullptr, frame->ch_layout.nb_channels, frame->nb_samples, (AVSampleFormat)frame->format, 0);
-		Ref<DecodedAudioFrame> audio_frame = memnew(DecodedAudioFrame(frame_time));
-
-		audio_frame->set_time(frame_time);
-		audio_frame->sample_data.resize(data_size / sizeof(float));
-		memset(audio_frame->sample_data.ptrw(), 0, data_size);
-		memcpy(audio_frame->sample_data.ptrw(), frame->data[0], data_size);
-		audio_buffer_mutex.lock();
-		if (!skip_current_outputs.is_set()) {
-			decoded_audio_frames.push_back(audio_frame);
-		}
-		audio_buffer_mutex.unlock();
 
-		av_frame_unref(p_received_frame);
-		if (frame != p_received_frame) {
-			av_frame_free(&frame);
+		const float *samples = (const float *)frame->data[0];
+		uint32_t written = _write_samples(samples, frame->nb_samples, frame_time);
+		if (written < (uint32_t)frame->nb_samples) {
+			// Kept for the next step, the buffer only grows so this stops allocating after the first frames.
+			uint32_t channel_count = pcm_buffer.get_channel_count();
+			pending_frames = frame->nb_samples - written;
+			pending_offset = 0;
+			pending_time = frame_time;
+			if (pending_samples.size() < pending_frames * channel_count) {
+				pending_samples.resize(pending_frames * channel_count);
+			}
+			memcpy(pending_samples.ptr(), samples + written * channel_count, pending_frames * channel_count * sizeof(float));
 		}
 	}
 }
 
-AVFrame *AudioDecoder::_ensure_frame_audio_format(AVFrame *p_frame, AVSampleFormat p_target_audio_format) {
-	ZoneScopedN("Audio decoder rescale");
-	if (p_frame->format == p_target_audio_format) {
-		return p_frame;
-	}
-
-	// This initialization and AV_CHANNEL_LAYOUT_STEREO is equivalent, only because if is used AV_CHANNEL_LAYOUT_STEREO, then we need std20
-	AVChannelLayout outChannelLayout;
-	outChannelLayout.order = AV_CHANNEL_ORDER_NATIVE;
-	outChannelLayout.nb_channels= (2);
-	outChannelLayout.u.mask = { AV_CH_LAYOUT_STEREO };
-	outChannelLayout.opaque = NULL; 
-	int obtain_swr_ctx_result = swr_alloc_set_opts2(
-			&swr_context,
-			&outChannelLayout, p_target_audio_format, audio_codec_context->sample_rate,
-			&audio_codec_context->ch_layout, audio_codec_context->sample_fmt, audio_codec_context->sample_rate,
-			0, nullptr);
-
-	if (obtain_swr_ctx_result < 0) {
-		print_line("Failed to obtain SWR context");
-		return nullptr;
-	}
-	AVFrame *out_frame;
-
-	out_frame = av_frame_alloc();
-	out_frame->format = p_target_audio_format;
-	out_frame->ch_layout = outChannelLayout;
-	out_frame->sample_rate = audio_codec_context->sample_rate;
-	out_frame->nb_samples = p_frame->nb_samples;
-
-	int get_buffer_result = av_frame_get_buffer(out_frame, 0);
-
-	if (get_buffer_result < 0) {
-		print_line("Failed to allocate SWR frame buffer:", ffmpeg_audio_get_error_message(get_buffer_result));
-		av_frame_unref(out_frame);
-		return nullptr;
+uint32_t AudioDecoder::_write_samples(const float *p_samples, uint32_t p_frames, double p_time) {
+	if (capture_samples != nullptr) {
+		uint32_t channel_count = get_audio_channel_count();
+		uint32_t captured_frames = capture_samples->size() / channel_count;
+		if (captured_frames + p_frames > capture_max_frames) {
+			capture_overflow = true;
+			return p_frames;
+		}
+		capture_samples->resize((captured_frames + p_frames) * channel_count);
+		memcpy(capture_samples->ptr() + captured_frames * channel_count, p_samples, p_frames * channel_count * sizeof(float));
+		return p_frames;
+	}
+	if (_is_output_stale()) {
+		// Nobody will ever read these.
+		return p_frames;
+	}
+	if (!segment_started) {
+		PCMSegment segment;
+		segment.start_position = pcm_buffer.get_write_position();
+		segment.start_time = p_time;
+		segment.serial = decode_serial;
+		// Pushed before any of its samples are written, see _update_read_segment().
+		if (!pcm_segments.push(segment)) {
+			return 0;
+		}
+		segment_started = true;
 	}
+	return pcm_buffer.write(p_samples, p_frames);
+}
 
-	int converter_result = swr_convert_frame(swr_context, out_frame, p_frame);
-
-	if (converter_result < 0) {
-		print_line("Failed to convert audio frame:", ffmpeg_audio_get_error_message(converter_result));
-		av_frame_unref(out_frame);
-		return nullptr;
+bool AudioDecoder::_flush_pending_samples() {
+	if (pending_frames == 0) {
+		return true;
 	}
-
-	return out_frame;
+	uint32_t written = _write_samples(pending_samples.ptr() + pending_offset * pcm_buffer.get_channel_count(), pending_frames, pending_time);
+	pending_offset += written;
+	pending_frames -= written;
+	return pending_frames == 0;
 }
 
 void AudioDecoder::seek(double p_time, bool p_wait) {
-	audio_buffer_mutex.lock();
-
-	decoded_audio_frames.clear();
-
+	// Queued frames are left alone, the consumer drops them once it sees the new serial.
+	uint32_t serial = seek_serial.increment();
 	last_decoded_frame_time.set(p_time);
-	skip_current_outputs.set();
-	audio_buffer_mutex.unlock();
+	consumed_position.store(p_time);
+	// Counted before pushing so the decoder thread stays awake until the command has run.
+	pending_commands.increment();
+	_wake_decoder();
 	if (p_wait) {
-		decoder_commands.push_and_sync(this, &AudioDecoder::_seek_command, p_time);
+		decoder_commands.push_and_sync(this, &AudioDecoder::_seek_command, p_time, serial);
 	} else {
-		decoder_commands.push(this, &AudioDecoder::_seek_command, p_time);
+		decoder_commands.push(this, &AudioDecoder::_seek_command, p_time, serial);
 	}
 }
 
-void AudioDecoder::start_decoding() {
-	ERR_FAIL_COND_MSG(thread != nullptr, "Cannot start decoding once already started");
+bool AudioDecoder::open_input() {
 	if (format_context == nullptr) {
 		prepare_decoding();
 		recreate_codec_context();
+	}
+	if (audio_stream == nullptr || audio_codec_context == nullptr) {
+		decoder_state = DecoderState::FAULTED;
+		return false;
+	}
+	return true;
+}
 
-		if (audio_stream == nullptr) {
-			decoder_state = DecoderState::FAULTED;
-			return;
-		}
+void AudioDecoder::_prepare_output() {
+	packet = av_packet_alloc();
+	receive_frame = av_frame_alloc();
+	// Decoded straight to the rate the engine mixes at, the playback doesn't need to resample.
+	// AudioStreamPlayback only outputs stereo frames, so surround is never kept.
+	AVChannelLayout output_layout;
+	FFmpegAudioResampler::get_output_layout(audio_codec_context->ch_layout, channel_mode, false, output_layout);
+	resampler.set_output((int)AudioServer::get_singleton()->get_mix_rate(), output_layout);
+	av_channel_layout_uninit(&output_layout);
+	pcm_sample_rate = get_audio_mix_rate();
+}
+
+void AudioDecoder::start_decoding() {
+	ERR_FAIL_COND_MSG(thread != nullptr || task != nullptr, "Cannot start decoding once already started");
+	ERR_FAIL_COND_MSG(packet != nullptr, "Cannot start decoding a decoder that was already used.");
+	if (!open_input()) {
+		return;
 	}
 
-	thread = memnew(std::thread(_thread_func, this));
+	_prepare_output();
+	// Everything the mixing thread touches is allocated here, up front.
+	pcm_buffer.resize(MAX(1, pcm_sample_rate * buffer_length_ms / 1000), get_audio_channel_count());
+	refill_interval_usec = buffer_length_ms * 1000 / 4;
+	if (audio_file.is_valid()) {
+		FFmpegDecodeScheduler *scheduler = FFmpegDecodeScheduler::get_singleton();
+		ERR_FAIL_NULL_MSG(scheduler, "The decode scheduler must be running before decoding can start.");
+		task = memnew(FFmpegDecodeTask(_task_func, this, FFmpegDecodeScheduler::PRIORITY_AUDIO));
+		task->set_retry_delay_usec(refill_interval_usec);
+		scheduler->signal(task);
+	} else {
+		thread = memnew(std::thread(_thread_func, this));
+	}
+}
+
+bool AudioDecoder::decode_all(LocalVector<float> &r_samples, double p_max_length_ms) {
+	ZoneScopedN("Audio decoder decode all");
+	ERR_FAIL_COND_V_MSG(thread != nullptr || task != nullptr || packet != nullptr, false, "Cannot decode a decoder that was already used.");
+	if (!open_input()) {
+		return false;
+	}
+
+	_prepare_output();
+	capture_samples = &r_samples;
+	capture_max_frames = (uint32_t)(p_max_length_ms * pcm_sample_rate / 1000.0);
+	capture_overflow = false;
+	while (decoder_state != DecoderState::END_OF_STREAM && !capture_overflow) {
+		if (!_decode_next_frame(packet, receive_frame)) {
+			// Only network streams run dry before the end.
+			break;
+		}
+	}
+	capture_samples = nullptr;
+	return decoder_state == DecoderState::END_OF_STREAM && !capture_overflow && !r_samples.is_empty();
 }
 
 int get_hw_audio_decoder_score(AVHWDeviceType p_device_type) {
@@ -489,19 +602,7 @@ Vector<AudioDecoder::AvailableDecoderInfo> AudioDecoder::get_available_decoders(
 
 	Ref<FFmpegCodec> first_codec;
 
-	void *iterator = NULL;
-	while (true) {
-		const AVCodec *av_codec = av_codec_iterate(&iterator);
-
-		if (av_codec == NULL) {
-			break;
-		}
-
-		if (av_codec->id != p_codec_id || !av_codec_is_decoder(av_codec)) {
-			continue;
-		}
-
-		Ref<FFmpegCodec> codec = memnew(FFmpegCodec(av_codec));
+	for (const Ref<FFmpegCodec> &codec : FFmpegCodecRegistry::get_singleton()->get_decoders(p_codec_id)) {
 		if (!first_codec.is_valid()) {
 			first_codec = codec;
 		}
@@ -533,11 +634,105 @@ Vector<AudioDecoder::AvailableDecoderInfo> AudioDecoder::get_available_decoders(
 	return codecs;
 }
 
-Vector<Ref<DecodedAudioFrame>> AudioDecoder::get_decoded_audio_frames() {
-	MutexLock lock(audio_buffer_mutex);
-	Vector<Ref<DecodedAudioFrame>> frames = decoded_audio_frames.duplicate();
-	decoded_audio_frames.clear();
-	return frames;
+void AudioDecoder::set_buffer_length_ms(int p_length_ms) {
+	ERR_FAIL_COND_MSG(thread != nullptr || task != nullptr, "The buffer length can't be changed once decoding started.");
+	buffer_length_ms = CLAMP(p_length_ms, MIN_BUFFER_LENGTH_MS, MAX_BUFFER_LENGTH_MS);
+}
+
+int AudioDecoder::get_buffer_length_ms() const {
+	return buffer_length_ms;
+}
+
+void AudioDecoder::set_channel_mode(FFmpegAudioResampler::ChannelMode p_mode) {
+	ERR_FAIL_INDEX(p_mode, FFmpegAudioResampler::CHANNEL_MODE_MAX);
+	ERR_FAIL_COND_MSG(thread != nullptr || task != nullptr, "The channel mode can't be changed once decoding started.");
+	channel_mode = p_mode;
+}
+
+bool AudioDecoder::_update_read_segment() {
+	uint32_t serial = seek_serial.get();
+	while (true) {
+		// Read before peeking, the decoder pushes a segment before writing any of its samples so
+		// everything up to here belongs to the current one or to one already in the queue.
+		uint64_t write_position = pcm_buffer.get_write_position();
+		PCMSegment *next = pcm_segments.peek();
+		bool stale = !has_read_segment || read_segment.serial != serial;
+		if (next == nullptr) {
+			if (stale) {
+				pcm_buffer.skip_to(write_position);
+			}
+			return !stale;
+		}
+		if (!stale && pcm_buffer.get_read_position() < next->start_position) {
+			return true;
+		}
+		if (stale) {
+			// Decoded before the latest seek.
+			pcm_buffer.skip_to(next->start_position);
+		}
+		pcm_segments.pop(read_segment);
+		has_read_segment = true;
+		if (read_segment.serial == serial) {
+			consumed_position.store(read_segment.start_time);
+		}
+	}
+}
+
+uint32_t AudioDecoder::peek_audio(uint32_t p_max_frames, const float *&r_samples) {
+	if (!_update_read_segment()) {
+		return 0;
+	}
+	// Same order as in _update_read_segment(), the samples of a loop must not be mistaken for the current segment's.
+	uint64_t limit = pcm_buffer.get_write_position();
+	PCMSegment *next = pcm_segments.peek();
+	if (next != nullptr) {
+		limit = next->start_position;
+	}
+	uint64_t readable = limit - pcm_buffer.get_read_position();
+	return pcm_buffer.peek((uint32_t)MIN((uint64_t)p_max_frames, readable), r_samples);
+}
+
+void AudioDecoder::consume_audio(uint32_t p_frames) {
+	pcm_buffer.consume(p_frames);
+	uint64_t frames_into_segment = pcm_buffer.get_read_position() - read_segment.start_position;
+	consumed_position.store(read_segment.start_time + frames_into_segment * 1000.0 / pcm_sample_rate);
+}
+
+bool AudioDecoder::is_audio_finished() {
+	if (ended_serial.get() != seek_serial.get() + 1) {
+		return false;
+	}
+	const float *samples;
+	return peek_audio(1, samples) == 0;
+}
+
+void AudioDecoder::set_consumer(uint64_t p_id) {
+	consumer_id.store(p_id);
+}
+
+bool AudioDecoder::is_consumer(uint64_t p_id) const {
+	return consumer_id.load() == p_id;
+}
+
+bool AudioDecoder::begin_consume(uint64_t p_id) {
+	uint64_t expected = 0;
+	if (!active_consumer_id.compare_exchange_strong(expected, p_id)) {
+		return false;
+	}
+	if (consumer_id.load() != p_id) {
+		active_consumer_id.store(0);
+		return false;
+	}
+	return true;
+}
+
+void AudioDecoder::end_consume(uint64_t p_id) {
+	uint64_t expected = p_id;
+	active_consumer_id.compare_exchange_strong(expected, 0);
+}
+
+double AudioDecoder::get_audio_position() const {
+	return consumed_position.load();
 }
 
 AudioDecoder::DecoderState AudioDecoder::get_decoder_state() const {
@@ -558,47 +753,50 @@ double AudioDecoder::get_duration() const {
 
 int AudioDecoder::get_audio_mix_rate() const {
 	if (audio_stream) {
-		return audio_codec_context->sample_rate;
+		return resampler.get_output_sample_rate();
 	}
 	return 0;
 }
 
 int AudioDecoder::get_audio_channel_count() const {
 	if (audio_stream) {
-		// return audio_codec_context->ch_layout.nb_channels;
-		return 2;
+		return resampler.get_output_channel_count();
 	}
 	return 0;
 }
 
-void AudioDecoder::return_audio_frames(Vector<Ref<DecodedAudioFrame>> p_frames) {
-	for (Ref<DecodedAudioFrame> frame : p_frames) {
-		return_audio_frame(frame);
-	}
-}
-
-void AudioDecoder::return_audio_frame(Ref<DecodedAudioFrame> p_frame) {
-	MutexLock lock(audio_buffer_mutex);
-	decoded_audio_frames.push_back(p_frame);
-}
-
 AudioDecoder::AudioDecoder(Ref<FileAccess> p_file) :
+		pcm_segments(MAX_PCM_SEGMENTS),
+		buffer_length_ms(DEFAULT_BUFFER_LENGTH_MS),
 		decoder_commands(true) {
 	audio_file = p_file;
 }
 
 AudioDecoder::AudioDecoder(const String &p_path) :
+		pcm_segments(MAX_PCM_SEGMENTS),
+		buffer_length_ms(DEFAULT_BUFFER_LENGTH_MS),
 		decoder_commands(true) {
 	audio_path = p_path;
 }
 
 
 AudioDecoder::~AudioDecoder() {
+	thread_abort.set_to(true);
 	if (thread != nullptr) {
-		thread_abort.set_to(true);
+		_wake_decoder();
 		thread->join();
 		memdelete(thread);
 	}
+	if (task != nullptr) {
+		FFmpegDecodeScheduler::get_singleton()->cancel(task);
+		memdelete(task);
+	}
+	if (packet != nullptr) {
+		av_packet_free(&packet);
+	}
+	if (receive_frame != nullptr) {
+		av_frame_free(&receive_frame);
+	}
 
 	if (format_context != nullptr && input_opened) {
 		avformat_close_input(&format_context);
@@ -612,10 +810,6 @@ AudioDecoder::~AudioDecoder() {
 		sws_freeContext(sws_context);
 	}
 
-	if (swr_context != nullptr) {
-		swr_free(&swr_context);
-	}
-
 	if (io_context != nullptr) {
 		av_free(io_context->buffer);
 		avio_context_free(&io_context);
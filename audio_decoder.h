@@ -53,8 +53,13 @@ using namespace godot;
 
 #endif
 
+#include "ffmpeg_audio_resampler.h"
 #include "ffmpeg_codec.h"
+#include "ffmpeg_codec_registry.h"
+#include "ffmpeg_decode_scheduler.h"
 #include "ffmpeg_frame.h"
+#include "ffmpeg_pcm_ring_buffer.h"
+#include "ffmpeg_spsc_queue.h"
 extern "C" {
 #include "libavutil/channel_layout.h"
 #include "libavformat/avformat.h"
@@ -62,6 +67,9 @@ extern "C" {
 #include "libswscale/swscale.h"
 }
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
 class DecodedAudioFrame : public RefCounted {
@@ -69,6 +77,8 @@ class DecodedAudioFrame : public RefCounted {
 
 public:
 	PackedFloat32Array sample_data;
+	// Seek serial the frame was decoded under, frames from before the latest seek are discarded.
+	uint32_t serial = 0;
 	double get_time() const;
 	void set_time(double p_time);
 	PackedFloat32Array get_sample_data() const;
@@ -97,13 +107,44 @@ public:
 	};
 
 private:
-	Vector<Ref<DecodedAudioFrame>> decoded_audio_frames;
+	// Where the samples decoded after a seek (or a loop) start in the ring, and their media time.
+	struct PCMSegment {
+		uint64_t start_position = 0;
+		double start_time = 0.0;
+		uint32_t serial = 0;
+	};
 
-	Mutex audio_buffer_mutex;
+	FFmpegPCMRingBuffer pcm_buffer;
+	FFmpegSPSCQueue<PCMSegment> pcm_segments;
+	int pcm_sample_rate = 0;
+	FFmpegAudioResampler::ChannelMode channel_mode = FFmpegAudioResampler::CHANNEL_MODE_AUTO;
+	int buffer_length_ms;
+	// The mixing thread never signals the decoder, it polls for free space this often instead.
+	uint64_t refill_interval_usec = 0;
+	// Decoder side, the part of the last decoded frame that didn't fit in the ring yet.
+	LocalVector<float> pending_samples;
+	uint32_t pending_offset = 0;
+	uint32_t pending_frames = 0;
+	double pending_time = 0.0;
+	bool segment_started = false;
+	// Serial + 1 of the seek whose audio has been written up to the end of the stream, 0 if none.
+	SafeNumeric<uint32_t> ended_serial;
+	// Consumer side, only touched by the mixing thread.
+	PCMSegment read_segment;
+	bool has_read_segment = false;
+	std::atomic<double> consumed_position = { 0.0 };
+	// Pooled decoders are handed from playback to playback. consumer_id may read the ring, active_consumer_id
+	// is the one inside its mix callback right now, a new consumer only starts reading once that one left.
+	std::atomic<uint64_t> consumer_id = { 0 };
+	std::atomic<uint64_t> active_consumer_id = { 0 };
+	// Set while decode_all() runs, samples are appended here instead of going through the ring.
+	LocalVector<float> *capture_samples = nullptr;
+	uint32_t capture_max_frames = 0;
+	bool capture_overflow = false;
 
 	SwsContext *sws_context = nullptr;
-	SwrContext *swr_context = nullptr;
-	DecoderState decoder_state = DecoderState::READY;
+	FFmpegAudioResampler resampler;
+	std::atomic<DecoderState> decoder_state = { DecoderState::READY };
 	mutable CommandQueueMT decoder_commands;
 	AVStream *audio_stream = nullptr;
 	AVIOContext *io_context = nullptr;
@@ -114,13 +155,24 @@ private:
 	double audio_time_base_in_seconds;
 	double duration;
 	double skip_output_until_time = -1.0;
-	SafeFlag skip_current_outputs;
+	// Bumped by every seek request, decode_serial is the one the decoder thread has caught up with.
+	SafeNumeric<uint32_t> seek_serial;
+	uint32_t decode_serial = 0;
 	SafeNumeric<float> last_decoded_frame_time;
 	Ref<FileAccess> audio_file;
 	String audio_path;
 	BitField<HardwareAudioDecoder> target_hw_audio_decoders = HardwareAudioDecoder::ANY;
+	// Files are decoded by a scheduler task, network streams get their own thread since their reads block.
+	FFmpegDecodeTask *task = nullptr;
 	std::thread *thread = nullptr;
 	SafeFlag thread_abort;
+	AVPacket *packet = nullptr;
+	AVFrame *receive_frame = nullptr;
+	// The network decoder thread sleeps on this whenever it has nothing to do, consumers, seeks and
+	// shutdown wake it up.
+	std::mutex wakeup_mutex;
+	std::condition_variable wakeup_condition;
+	SafeNumeric<uint32_t> pending_commands;
 
 	bool looping = false;
 
@@ -128,16 +180,26 @@ private:
 	static int64_t _stream_seek_callback(void *p_opaque, int64_t p_offset, int p_whence);
 	void prepare_decoding();
 	void recreate_codec_context();
+	void _prepare_output();
 	static HardwareAudioDecoder from_av_hw_device_type(AVHWDeviceType p_device_type);
 
-	void _seek_command(double p_target_timestamp);
+	void _seek_command(double p_target_timestamp, uint32_t p_serial);
+	void _perform_seek(double p_target_timestamp, uint32_t p_serial);
+	bool _is_output_stale() const;
+	bool _has_work() const;
+	void _wait_for_work();
+	void _wait_for_refill();
+	void _wake_decoder();
 	static void _thread_func(void *userdata);
-	void _decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_frame);
+	static FFmpegDecodeTask::StepResult _task_func(void *p_userdata);
+	FFmpegDecodeTask::StepResult _decode_step();
+	bool _decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_frame);
 	int _send_packet(AVCodecContext *p_codec_context, AVFrame *p_receive_frame, AVPacket *p_packet);
 	void _try_disable_hw_decoding(int p_error_code);
 	void _read_decoded_audio_frames(AVFrame *p_received_frame);
-
-	AVFrame *_ensure_frame_audio_format(AVFrame *p_frame, AVSampleFormat p_target_audio_format);
+	uint32_t _write_samples(const float *p_samples, uint32_t p_frames, double p_time);
+	bool _flush_pending_samples();
+	bool _update_read_segment();
 
 public:
 	struct AvailableDecoderInfo {
@@ -145,16 +207,37 @@ public:
 		AVHWDeviceType device_type;
 	};
 	void seek(double p_time, bool p_wait = false);
+	// Opens the input and the codec without decoding anything yet, so the duration can be checked first.
+	bool open_input();
 	void start_decoding();
+	// Decodes the whole stream on the calling thread into interleaved samples at the mix rate, instead of
+	// starting decoding. Gives up once the output gets longer than p_max_length_ms.
+	bool decode_all(LocalVector<float> &r_samples, double p_max_length_ms);
 	Vector<AvailableDecoderInfo> get_available_decoders(const AVInputFormat *p_format, AVCodecID p_codec_id, BitField<HardwareAudioDecoder> p_target_decoders);
-	
-	void return_audio_frames(Vector<Ref<DecodedAudioFrame>> p_frames);
-	void return_audio_frame(Ref<DecodedAudioFrame> p_frame);
-	Vector<Ref<DecodedAudioFrame>> get_decoded_audio_frames();
+	// How much decoded audio is buffered ahead of the mixer, must be set before decoding starts.
+	void set_buffer_length_ms(int p_length_ms);
+	int get_buffer_length_ms() const;
+	// Must be set before decoding starts, surround sources are always mixed down to stereo or mono here.
+	void set_channel_mode(FFmpegAudioResampler::ChannelMode p_mode);
+	// Consumer side of the PCM ring, never blocks nor allocates. Must always be called from the same thread.
+	// Points r_samples at up to p_max_frames interleaved frames decoded since the latest seek, returns how many.
+	uint32_t peek_audio(uint32_t p_max_frames, const float *&r_samples);
+	void consume_audio(uint32_t p_frames);
+	// Everything up to the end of the stream has been consumed.
+	bool is_audio_finished();
+	// Hands the ring to another consumer, 0 parks it. The previous one stops reading on its own.
+	void set_consumer(uint64_t p_id);
+	bool is_consumer(uint64_t p_id) const;
+	// Brackets a mix callback of p_id, fails while the previous consumer is still in its last one.
+	bool begin_consume(uint64_t p_id);
+	void end_consume(uint64_t p_id);
+	// Media time of the next frame the consumer reads, in ms.
+	double get_audio_position() const;
 	DecoderState get_decoder_state() const;
 	double get_last_decoded_frame_time() const;
 	bool is_running() const;
 	double get_duration() const;
+	// The AudioServer's mix rate once decoding started, whatever the source's rate.
 	int get_audio_mix_rate() const;
 	int get_audio_channel_count() const;
 
@@ -29,30 +29,11 @@
 /**************************************************************************/
 
 #include "audio_stream_ffmpeg_loader.h"
-extern "C" {
-#include "libavformat/avformat.h"
-}
+#include "ffmpeg_codec_registry.h"
 #include "ffmpeg_audio_stream.h"
 
-void AudioStreamFFMpegLoader::_update_recognized_extension_cache() const {
-	if (recognized_extension_cache.size() > 0) {
-		return;
-	}
-	void *iteration_state = nullptr;
-	const AVInputFormat *current_fmt = nullptr;
-
-	while ((current_fmt = av_demuxer_iterate(&iteration_state)) != nullptr) {
-		if (current_fmt->extensions == nullptr) {
-			continue;
-		}
-		PackedStringArray demuxer_exts = String(current_fmt->extensions).split(",", false);
-		const_cast<AudioStreamFFMpegLoader *>(this)->recognized_extension_cache.append_array(demuxer_exts);
-	}
-}
-
 String AudioStreamFFMpegLoader::get_resource_type_internal(const String &p_path) const {
-	_update_recognized_extension_cache();
-	if (recognized_extension_cache.has(p_path.get_extension())) {
+	if (FFmpegCodecRegistry::get_singleton()->is_extension_supported(p_path.get_extension())) {
 		return "AudioStreamFFMpegLoader";
 	}
 	return "";
@@ -91,8 +72,7 @@ bool AudioStreamFFMpegLoader::handles_type_internal(const String &p_type) const
 
 #ifdef GDEXTENSION
 PackedStringArray AudioStreamFFMpegLoader::_get_recognized_extensions() const {
-	_update_recognized_extension_cache();
-	return recognized_extension_cache;
+	return FFmpegCodecRegistry::get_singleton()->get_supported_extensions();
 }
 
 bool AudioStreamFFMpegLoader::_handles_type(const StringName &p_type) const {
@@ -105,8 +85,7 @@ Variant AudioStreamFFMpegLoader::_load(const String &p_path, const String &p_ori
 
 #else
 void AudioStreamFFMpegLoader::get_recognized_extensions(List<String> *p_extensions) const {
-	_update_recognized_extension_cache();
-	for (String ext : recognized_extension_cache) {
+	for (const String &ext : FFmpegCodecRegistry::get_singleton()->get_supported_extensions()) {
 		p_extensions->push_back(ext);
 	}
 }
@@ -49,10 +49,8 @@ using namespace godot;
 
 class AudioStreamFFMpegLoader : public ResourceFormatLoader {
 	GDCLASS(AudioStreamFFMpegLoader, ResourceFormatLoader);
-	PackedStringArray recognized_extension_cache;
 
 private:
-	void _update_recognized_extension_cache() const;
 	String get_resource_type_internal(const String &p_path) const;
 	PackedStringArray get_recognized_extensions_internal() const;
 	Ref<Resource> load_internal(const String &p_path, const String &p_original_path = "", Error *r_error = nullptr, bool p_use_sub_threads = false, float *r_progress = nullptr, CacheMode p_cache_mode = CACHE_MODE_REUSE) const;
@@ -0,0 +1,95 @@
+/**************************************************************************/
+/*  ffmpeg_audio_mix.h                                                    */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_AUDIO_MIX_H
+#define FFMPEG_AUDIO_MIX_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/classes/audio_frame.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/math/audio_frame.h"
+
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FFMPEG_AUDIO_MIX_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define FFMPEG_AUDIO_MIX_NEON
+#include <arm_neon.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+
+// The copies below write AudioFrames as plain float pairs.
+static_assert(sizeof(AudioFrame) == sizeof(float) * 2, "AudioFrame is expected to be two packed floats.");
+
+// Interleaved stereo samples already have AudioFrame's layout, memcpy is as fast as it gets.
+inline void ffmpeg_audio_mix_stereo(AudioFrame *p_dst, const float *p_src, uint32_t p_frames) {
+	memcpy(p_dst, p_src, p_frames * sizeof(AudioFrame));
+}
+
+// Mono samples go to both channels.
+inline void ffmpeg_audio_mix_mono(AudioFrame *p_dst, const float *p_src, uint32_t p_frames) {
+	float *dst = (float *)p_dst;
+	uint32_t i = 0;
+#if defined(FFMPEG_AUDIO_MIX_SSE2)
+	for (; i + 4 <= p_frames; i += 4) {
+		__m128 mono = _mm_loadu_ps(p_src + i);
+		_mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(mono, mono));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(mono, mono));
+	}
+#elif defined(FFMPEG_AUDIO_MIX_NEON)
+	for (; i + 4 <= p_frames; i += 4) {
+		float32x4_t mono = vld1q_f32(p_src + i);
+		float32x4x2_t stereo = { { mono, mono } };
+		// Interleaving a vector with itself duplicates every sample.
+		vst2q_f32(dst + i * 2, stereo);
+	}
+#endif
+	for (; i < p_frames; i++) {
+		dst[i * 2] = p_src[i];
+		dst[i * 2 + 1] = p_src[i];
+	}
+}
+
+// Only the part of the callback the decoder couldn't fill, the rest was overwritten anyway.
+inline void ffmpeg_audio_mix_silence(AudioFrame *p_dst, uint32_t p_frames) {
+	memset((void *)p_dst, 0, p_frames * sizeof(AudioFrame));
+}
+
+#endif // FFMPEG_AUDIO_MIX_H
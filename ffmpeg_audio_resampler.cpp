@@ -0,0 +1,165 @@
+/**************************************************************************/
+/*  ffmpeg_audio_resampler.cpp                                            */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#include "ffmpeg_audio_resampler.h"
+
+#ifdef GDEXTENSION
+#include "gdextension_build/gdex_print.h"
+#endif
+
+#include "tracy_import.h"
+
+extern "C" {
+#include "libavutil/error.h"
+}
+
+static String ffmpeg_resampler_get_error_message(int p_error_code) {
+	char buffer[AV_ERROR_MAX_STRING_SIZE];
+	if (av_strerror(p_error_code, buffer, sizeof(buffer)) < 0) {
+		return vformat("%d", p_error_code);
+	}
+	return String::utf8(buffer);
+}
+
+void FFmpegAudioResampler::get_output_layout(const AVChannelLayout &p_source, ChannelMode p_mode, bool p_allow_surround, AVChannelLayout &r_layout) {
+	int channel_count = 2;
+	if (p_mode == CHANNEL_MODE_MONO || (p_mode == CHANNEL_MODE_AUTO && p_source.nb_channels <= 1)) {
+		channel_count = 1;
+	} else if (p_mode == CHANNEL_MODE_AUTO && p_source.nb_channels > 2 && p_allow_surround) {
+		channel_count = 6;
+	}
+	// 5.1's native order pairs up as front, center/LFE and sides, the same as the engine's surround buses.
+	av_channel_layout_default(&r_layout, channel_count);
+}
+
+bool FFmpegAudioResampler::_configure(const AVFrame *p_frame) {
+	ZoneScopedN("Audio resampler configure");
+	ERR_FAIL_COND_V_MSG(output_sample_rate <= 0, false, "The resampler's output has to be set before converting.");
+	// Without channel positions there's nothing to build a downmix matrix from, assume the usual ones.
+	AVChannelLayout source_layout;
+	if (p_frame->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+		av_channel_layout_default(&source_layout, p_frame->ch_layout.nb_channels);
+	} else {
+		av_channel_layout_copy(&source_layout, &p_frame->ch_layout);
+	}
+	// The rematrixing matrix is computed once here and applied with swresample's SIMD mixing code.
+	int result = swr_alloc_set_opts2(&swr_context,
+			&output_layout, AV_SAMPLE_FMT_FLT, output_sample_rate,
+			&source_layout, (AVSampleFormat)p_frame->format, p_frame->sample_rate,
+			0, nullptr);
+	av_channel_layout_uninit(&source_layout);
+	if (result >= 0) {
+		result = swr_init(swr_context);
+	}
+	if (result < 0) {
+		print_line(vformat("Failed to configure the audio resampler: %s", ffmpeg_resampler_get_error_message(result)));
+		swr_free(&swr_context);
+		return false;
+	}
+	input_sample_rate = p_frame->sample_rate;
+	input_format = p_frame->format;
+	av_channel_layout_uninit(&input_layout);
+	av_channel_layout_copy(&input_layout, &p_frame->ch_layout);
+	return true;
+}
+
+void FFmpegAudioResampler::set_output(int p_sample_rate, const AVChannelLayout &p_layout) {
+	ERR_FAIL_COND(p_sample_rate <= 0);
+	output_sample_rate = p_sample_rate;
+	av_channel_layout_uninit(&output_layout);
+	av_channel_layout_copy(&output_layout, &p_layout);
+	// Both are rebuilt for the new output by the next convert().
+	swr_free(&swr_context);
+	output_capacity = 0;
+}
+
+int FFmpegAudioResampler::get_output_sample_rate() const {
+	return output_sample_rate;
+}
+
+int FFmpegAudioResampler::get_output_channel_count() const {
+	return output_layout.nb_channels;
+}
+
+AVFrame *FFmpegAudioResampler::convert(const AVFrame *p_frame) {
+	ZoneScopedN("Audio resample");
+	if (swr_context == nullptr || p_frame->sample_rate != input_sample_rate || p_frame->format != input_format || av_channel_layout_compare(&p_frame->ch_layout, &input_layout) != 0) {
+		if (!_configure(p_frame)) {
+			return nullptr;
+		}
+	}
+
+	if (output_frame == nullptr) {
+		output_frame = av_frame_alloc();
+		ERR_FAIL_NULL_V(output_frame, nullptr);
+	}
+	int needed_samples = swr_get_out_samples(swr_context, p_frame->nb_samples);
+	// A filter graph may still hold a reference to the last output, only write into buffers we own alone.
+	if (needed_samples > output_capacity || !av_frame_is_writable(output_frame)) {
+		av_frame_unref(output_frame);
+		output_frame->format = AV_SAMPLE_FMT_FLT;
+		output_frame->sample_rate = output_sample_rate;
+		av_channel_layout_copy(&output_frame->ch_layout, &output_layout);
+		// Some headroom so slightly larger frames don't reallocate again.
+		output_frame->nb_samples = needed_samples + needed_samples / 4;
+		int get_buffer_result = av_frame_get_buffer(output_frame, 0);
+		if (get_buffer_result < 0) {
+			print_line(vformat("Failed to allocate the audio resampler's buffer: %s", ffmpeg_resampler_get_error_message(get_buffer_result)));
+			output_capacity = 0;
+			return nullptr;
+		}
+		output_capacity = output_frame->nb_samples;
+	}
+
+	int converted = swr_convert(swr_context, output_frame->data, output_capacity, (const uint8_t **)p_frame->extended_data, p_frame->nb_samples);
+	if (converted < 0) {
+		print_line(vformat("Failed to convert audio frame: %s", ffmpeg_resampler_get_error_message(converted)));
+		return nullptr;
+	}
+	output_frame->nb_samples = converted;
+	output_frame->pts = AV_NOPTS_VALUE;
+	return output_frame;
+}
+
+void FFmpegAudioResampler::reset() {
+	if (swr_context != nullptr) {
+		// Reinitializing clears the delay line but keeps the configuration.
+		swr_init(swr_context);
+	}
+}
+
+FFmpegAudioResampler::~FFmpegAudioResampler() {
+	swr_free(&swr_context);
+	if (output_frame != nullptr) {
+		av_frame_free(&output_frame);
+	}
+	av_channel_layout_uninit(&input_layout);
+	av_channel_layout_uninit(&output_layout);
+}
@@ -0,0 +1,97 @@
+/**************************************************************************/
+/*  ffmpeg_audio_resampler.h                                              */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_AUDIO_RESAMPLER_H
+#define FFMPEG_AUDIO_RESAMPLER_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/godot.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/typedefs.h"
+
+#endif
+
+extern "C" {
+#include "libavutil/channel_layout.h"
+#include "libavutil/frame.h"
+#include "libswresample/swresample.h"
+}
+
+// Converts decoded audio to interleaved float at the engine's mix rate in one pass, so nothing has
+// to resample it again on the audio thread. The SwrContext and the output frame live as long as the
+// decoder, they are only rebuilt if the input format changes mid stream.
+class FFmpegAudioResampler {
+public:
+	enum ChannelMode {
+		// Mono stays mono, anything else is mixed down to stereo, or to 5.1 where surround is allowed.
+		CHANNEL_MODE_AUTO,
+		CHANNEL_MODE_STEREO,
+		// Half the memory and mixing work of stereo, for positional sources.
+		CHANNEL_MODE_MONO,
+		CHANNEL_MODE_MAX,
+	};
+
+private:
+	SwrContext *swr_context = nullptr;
+	AVFrame *output_frame = nullptr;
+	int output_capacity = 0;
+	int output_sample_rate = 0;
+	AVChannelLayout output_layout = {};
+	// What the context was configured for.
+	int input_sample_rate = 0;
+	int input_format = -1;
+	AVChannelLayout input_layout = {};
+
+	bool _configure(const AVFrame *p_frame);
+
+public:
+	// Picks what p_source is converted to. Surround is only kept when p_allow_surround, layouts bigger
+	// than 5.1 are mixed down to it since that's the most the engine's players take.
+	static void get_output_layout(const AVChannelLayout &p_source, ChannelMode p_mode, bool p_allow_surround, AVChannelLayout &r_layout);
+	// Must be called before the first convert().
+	void set_output(int p_sample_rate, const AVChannelLayout &p_layout);
+	int get_output_sample_rate() const;
+	int get_output_channel_count() const;
+	// The returned frame belongs to the resampler and is overwritten by the next call, nullptr on failure.
+	AVFrame *convert(const AVFrame *p_frame);
+	// Drops the samples held back for the filter's delay line, for seeks.
+	void reset();
+
+	FFmpegAudioResampler() {}
+	~FFmpegAudioResampler();
+};
+
+#endif // FFMPEG_AUDIO_RESAMPLER_H
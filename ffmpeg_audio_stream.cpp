@@ -34,163 +34,242 @@
 #include "gdextension_build/gdex_print.h"
 #endif
 
+#include "ffmpeg_audio_mix.h"
 #include "tracy_import.h"
 
-float FFmpegAudioStreamPlayback::_get_stream_sampling_rate() {
-	return decoder->get_audio_mix_rate();
-}
-
-int FFmpegAudioStreamPlayback::_mix_resampled(AudioFrame *p_buffer, int p_frames) {
+int FFmpegAudioStreamPlayback::mix_internal(AudioFrame *p_buffer, float p_rate_scale, int p_frames) {
 	ZoneScopedN("update_internal");
-
-	if (!playing) {
-		return 0;
+	// Runs on the audio thread, nothing in here may lock or allocate.
+	// in_mix is raised before playing is checked, start_internal() relies on that order to swap the decoder.
+	in_mix.store(true);
+	int mixed = 0;
+	if (playing) {
+		if (!pooled) {
+			mixed = _mix_playing(p_buffer, p_rate_scale, p_frames);
+		} else if (!decoder->is_consumer(voice_id)) {
+			// Cut off by a newer voice, the decoder now plays for it.
+			playing = false;
+		} else if (decoder->begin_consume(voice_id)) {
+			mixed = _mix_playing(p_buffer, p_rate_scale, p_frames);
+			decoder->end_consume(voice_id);
+		} else {
+			// The voice the decoder was taken from is still in its last callback, it's ours from the next one on.
+			ffmpeg_audio_mix_silence(p_buffer, p_frames);
+			mixed = p_frames;
+		}
 	}
+	in_mix.store(false);
+	return mixed;
+}
 
+int FFmpegAudioStreamPlayback::_mix_playing(AudioFrame *p_buffer, float p_rate_scale, int p_frames) {
 	if(stream->length==0.0f){
 		stream->length=get_length_internal();
 	}
-	int pos = 0;
-	while(pos!=p_frames){
-		p_buffer[pos++] = AudioFrame{0.0f, 0.0f};
-	}
-	playback_position += 0.1 * 1000.0f;
 
-	if (decoder->get_decoder_state() == AudioDecoder::DecoderState::END_OF_STREAM && available_audio_frames.size() == 0) {
-		// if at the end of the stream but our playback enters a valid time region again, a seek operation is required to get the decoder back on track.
-		if (playback_position < decoder->get_last_decoded_frame_time()) {
-			seek_into_sync();
-		} else {
-			playing = false;
+	if (pcm_cache.is_valid()) {
+		int64_t seek_position = cache_seek_position.exchange(-1);
+		if (seek_position >= 0) {
+			cache_position.store((uint32_t)seek_position);
+			pitch_active = false;
 		}
 	}
 
-	double frame_time = get_current_frame_time();
-
-	Ref<DecodedAudioFrame> peek_audio_frame;
-	if (available_audio_frames.size() > 0) {
-		peek_audio_frame = available_audio_frames[0];
+	int pos;
+	if (Math::is_equal_approx(p_rate_scale, 1.0f)) {
+		pitch_active = false;
+		pos = _mix_direct(p_buffer, p_frames);
+	} else {
+		pos = _mix_pitched(p_buffer, p_rate_scale, p_frames);
 	}
 
-	bool audio_out_of_sync = false;
-
-	if (peek_audio_frame.is_valid()) {
-		audio_out_of_sync = Math::abs(playback_position - peek_audio_frame->get_time()) > LENIENCE_BEFORE_SEEK;
-
-		if (looping) {
-			audio_out_of_sync &= Math::abs(playback_position - decoder->get_duration() - peek_audio_frame->get_time()) > LENIENCE_BEFORE_SEEK &&
-					Math::abs(playback_position + decoder->get_duration() - peek_audio_frame->get_time()) > LENIENCE_BEFORE_SEEK;
-		}
+	if (pos < p_frames && _is_audio_finished()) {
+		playing = false;
+		return pos;
 	}
-	if (audio_out_of_sync) {
-		// TODO: seek audio stream individually if it desyncs
-		// seek_into_sync();
-		playback_position = peek_audio_frame->get_time();
-		last_playback_position = playback_position;
+
+	buffering = pos < p_frames;
+	if (buffering) {
+		ffmpeg_audio_mix_silence(p_buffer + pos, p_frames - pos);
 	}
+	return p_frames;
+}
 
-	pos = 0;
-	bool update_playback_position = false;
-	while (available_audio_frames.size() > 0 && check_next_audio_frame_valid(available_audio_frames[0])) {
+int FFmpegAudioStreamPlayback::_mix_direct(AudioFrame *p_buffer, int p_frames) {
+	int pos = 0;
+	while (pos < p_frames) {
 		ZoneNamedN(__audio_mix, "Audio mix", true);
-		Ref<DecodedAudioFrame> audio_frame = available_audio_frames[0];
-		last_frame = available_audio_frames[0];
-		int sample_count = audio_frame->get_sample_data().size() / decoder->get_audio_channel_count();
-#ifdef GDEXTENSION
-
-		while(frame_read_pos<sample_count){
-			float frame_read_buffer_left = audio_frame->get_sample_data()[frame_read_pos*2];
-			float frame_read_buffer_right = audio_frame->get_sample_data()[frame_read_pos*2+1];
-			p_buffer[pos++] = AudioFrame{frame_read_buffer_left, frame_read_buffer_right};
-			frame_read_pos++;
-			if(pos==p_frames){
-				break;
-			}
-		}
-		// playback_position = audio_frame->get_time();
-		last_playback_position = audio_frame->get_time();
-		update_playback_position = true;
-		if(Math::abs(frame_read_pos - sample_count) < 0.1){
-			available_audio_frames.pop_front();
-			frame_read_pos = 0;
-		}
-		if(pos==p_frames){
+		const float *samples;
+		uint32_t frame_count = _peek_audio(p_frames - pos, samples);
+		if (frame_count == 0) {
 			break;
 		}
-		
-#else
-		mix_callback(mix_udata, audio_frame->get_sample_data().ptr(), sample_count);
-#endif
-	}
-	if (available_audio_frames.size() == 0) {
-		for (Ref<DecodedAudioFrame> frame : decoder->get_decoded_audio_frames()) {
-			available_audio_frames.push_back(frame);
+		// At most two runs per callback, one more where the ring wraps around.
+		if (_get_audio_channel_count() == 1) {
+			ffmpeg_audio_mix_mono(p_buffer + pos, samples, frame_count);
+		} else {
+			ffmpeg_audio_mix_stereo(p_buffer + pos, samples, frame_count);
 		}
+		pos += frame_count;
+		_consume_audio(frame_count);
 	}
+	return pos;
+}
 
-	buffering = decoder->is_running() && available_audio_frames.size() == 0;
-	if (frame_time != get_current_frame_time()) {
-		frames_processed++;
+int FFmpegAudioStreamPlayback::_mix_pitched(AudioFrame *p_buffer, float p_rate_scale, int p_frames) {
+	ZoneScopedN("Audio mix pitched");
+	if (!pitch_active) {
+		pitch_active = true;
+		pitch_offset = 1.0;
+		pitch_next = AudioFrame{ 0.0f, 0.0f };
 	}
-	while(pos!=p_frames){
-		p_buffer[pos++] = AudioFrame{0.0f, 0.0f};
-	}
-	if(update_playback_position && last_playback_position!=0.0){
-		playback_position = last_playback_position;
+	int channel_count = _get_audio_channel_count();
+	const float *samples = nullptr;
+	uint32_t run_length = 0;
+	uint32_t run_used = 0;
+	int pos = 0;
+	while (pos < p_frames) {
+		if (pitch_offset >= 1.0) {
+			if (run_used == run_length) {
+				_consume_audio(run_used);
+				run_used = 0;
+				run_length = _peek_audio(p_frames, samples);
+				if (run_length == 0) {
+					break;
+				}
+			}
+			const float *frame = samples + run_used * channel_count;
+			pitch_previous = pitch_next;
+			pitch_next = AudioFrame{ frame[0], frame[channel_count > 1 ? 1 : 0] };
+			run_used++;
+			pitch_offset -= 1.0;
+			continue;
+		}
+		float weight = (float)pitch_offset;
+		p_buffer[pos++] = AudioFrame{ pitch_previous.left + (pitch_next.left - pitch_previous.left) * weight,
+			pitch_previous.right + (pitch_next.right - pitch_previous.right) * weight };
+		pitch_offset += p_rate_scale;
 	}
-	return p_frames;
+	_consume_audio(run_used);
+	return pos;
 }
 
-
-void FFmpegAudioStreamPlayback::seek_into_sync() {
-	decoder->seek(playback_position);
-	available_audio_frames.clear();
+uint32_t FFmpegAudioStreamPlayback::_peek_audio(uint32_t p_max_frames, const float *&r_samples) {
+	if (pcm_cache.is_valid()) {
+		return pcm_cache->read(cache_position.load(std::memory_order_relaxed), p_max_frames, cache_scratch.ptr(), r_samples);
+	}
+	if (pooled && !decoder->is_consumer(voice_id)) {
+		// Taken over mid-callback, what's in the ring belongs to the new voice.
+		return 0;
+	}
+	return decoder->peek_audio(p_max_frames, r_samples);
 }
 
-double FFmpegAudioStreamPlayback::get_current_frame_time() {
-	if (last_frame.is_valid()) {
-		return last_frame->get_time();
+void FFmpegAudioStreamPlayback::_consume_audio(uint32_t p_frames) {
+	if (pcm_cache.is_valid()) {
+		cache_position.store(cache_position.load(std::memory_order_relaxed) + p_frames);
+		return;
 	}
-	return 0.0f;
+	decoder->consume_audio(p_frames);
 }
 
-bool FFmpegAudioStreamPlayback::check_next_audio_frame_valid(Ref<DecodedAudioFrame> p_decoded_frame) {
-	// in the case of looping, we may start a seek back to the beginning but still receive some lingering frames from the end of the last loop. these should be allowed to continue playing.
-	if (looping && Math::abs((p_decoded_frame->get_time() - decoder->get_duration()) - playback_position) < LENIENCE_BEFORE_SEEK)
+bool FFmpegAudioStreamPlayback::_is_audio_finished() {
+	if (pcm_cache.is_valid()) {
+		return cache_position.load() >= pcm_cache->get_frame_count();
+	}
+	if (pooled && !decoder->is_consumer(voice_id)) {
 		return true;
+	}
+	return decoder->is_audio_finished();
+}
 
-	return p_decoded_frame->get_time() <= playback_position && Math::abs(p_decoded_frame->get_time() - playback_position) < LENIENCE_BEFORE_SEEK;
+int FFmpegAudioStreamPlayback::_get_audio_channel_count() const {
+	if (pcm_cache.is_valid()) {
+		return pcm_cache->get_channel_count();
+	}
+	return decoder->get_audio_channel_count();
 }
 
-void FFmpegAudioStreamPlayback::load(Ref<FileAccess> p_file_access) {
+void FFmpegAudioStreamPlayback::load(Ref<FileAccess> p_file_access, int p_buffer_length_ms, FFmpegAudioResampler::ChannelMode p_channel_mode) {
 	decoder = Ref<AudioDecoder>(memnew(AudioDecoder(p_file_access)));
+	decoder->set_buffer_length_ms(p_buffer_length_ms);
+	decoder->set_channel_mode(p_channel_mode);
 
 	decoder->start_decoding();
 }
 
-void FFmpegAudioStreamPlayback::load_from_url(const String &p_path) {
+void FFmpegAudioStreamPlayback::load_from_url(const String &p_path, int p_buffer_length_ms, FFmpegAudioResampler::ChannelMode p_channel_mode) {
 	decoder = Ref<AudioDecoder>(memnew(AudioDecoder(p_path)));
+	decoder->set_buffer_length_ms(p_buffer_length_ms);
+	decoder->set_channel_mode(p_channel_mode);
 
 	decoder->start_decoding();
 }
 
+void FFmpegAudioStreamPlayback::load_cached(const Ref<FFmpegPCMCache> &p_cache) {
+	ERR_FAIL_COND(p_cache.is_null());
+	pcm_cache = p_cache;
+	if (pcm_cache->is_stored_16_bit()) {
+		cache_scratch.resize(FFmpegPCMCache::MAX_CONVERTED_FRAMES * pcm_cache->get_channel_count());
+	}
+}
+
+void FFmpegAudioStreamPlayback::load_pooled(const Ref<AudioDecoder> &p_decoder, bool p_at_start, uint64_t p_voice_id) {
+	ERR_FAIL_COND(p_decoder.is_null());
+	decoder = p_decoder;
+	pooled = true;
+	decoder_at_start = p_at_start;
+	voice_id = p_voice_id;
+}
 
 void FFmpegAudioStreamPlayback::start_internal(double p_time = 0.0) {
+	if (pcm_cache.is_valid()) {
+		clear();
+		seek_internal(p_time);
+		playing = true;
+		return;
+	}
+	if (pooled && !decoder->is_consumer(voice_id)) {
+		clear();
+		// The mixing thread may have seen playing just before it was cleared, it reads the Ref until it
+		// leaves mix_internal(). That's one callback at most, and only on restarting a stolen voice.
+		while (in_mix.load()) {
+			std::this_thread::yield();
+		}
+		Ref<AudioDecoder> new_decoder = stream->_acquire_decoder(this, decoder_at_start, voice_id);
+		if (new_decoder.is_null()) {
+			return;
+		}
+		decoder = new_decoder;
+	}
 	if (decoder->get_decoder_state() == AudioDecoder::FAULTED) {
 		playing = false;
 		return;
 	}
 	clear();
-	playback_position = p_time * 1000.0f;
-	decoder->seek(playback_position, true);
+	if (pooled) {
+		// Stale samples are dropped by the mixing thread, there's no need to wait for the seek.
+		if (!decoder_at_start || p_time != 0.0) {
+			decoder->seek(p_time * 1000.0f);
+		}
+		decoder_at_start = false;
+	} else {
+		decoder->seek(p_time * 1000.0f, true);
+	}
 	playing = true;
 }
 
 void FFmpegAudioStreamPlayback::stop_internal() {
 	if (playing) {
 		clear();
-		playback_position = 0.0f;
-		decoder->seek(playback_position, true);
+		if (pcm_cache.is_valid()) {
+			seek_internal(0.0);
+		} else if (pooled) {
+			// Parked again for the next voice.
+			stream->_release_decoder(this);
+		} else {
+			decoder->seek(0.0, true);
+		}
 	}
 	playing = false;
 }
@@ -206,14 +285,28 @@ int FFmpegAudioStreamPlayback::get_loop_count_internal() const {
 
 
 double FFmpegAudioStreamPlayback::get_playback_position_internal() const {
-	return last_playback_position / 1000.0;
+	if (pcm_cache.is_valid()) {
+		int64_t seek_position = cache_seek_position.load();
+		return (seek_position >= 0 ? seek_position : cache_position.load()) / (double)pcm_cache->get_sample_rate();
+	}
+	if (pooled && !decoder->is_consumer(voice_id)) {
+		return 0.0;
+	}
+	// Follows the samples the mixer actually consumed, not the decoder's progress.
+	return decoder->get_audio_position() / 1000.0;
 }
 
 void FFmpegAudioStreamPlayback::seek_internal(double p_time) {
+	if (pcm_cache.is_valid()) {
+		// Picked up by the mixing thread, it owns cache_position.
+		int64_t frame = (int64_t)(MAX(p_time, 0.0) * pcm_cache->get_sample_rate());
+		cache_seek_position.store(MIN(frame, (int64_t)pcm_cache->get_frame_count()));
+		return;
+	}
+	if (pooled && !decoder->is_consumer(voice_id)) {
+		return;
+	}
 	decoder->seek(p_time * 1000.0f);
-	available_audio_frames.clear();
-	playback_position = p_time * 1000.0f;
-	frame_read_pos = 0;
 }
 
 
@@ -222,24 +315,204 @@ void FFmpegAudioStreamPlayback::tag_used_streams_internal() {
 
 
 double FFmpegAudioStreamPlayback::get_length_internal() const {
+	if (pcm_cache.is_valid()) {
+		return pcm_cache->get_length();
+	}
 	return decoder->get_duration() / 1000.0f;
 }
 
 
 int FFmpegAudioStreamPlayback::get_mix_rate_internal() const {
+	if (pcm_cache.is_valid()) {
+		return pcm_cache->get_sample_rate();
+	}
 	return decoder->get_audio_mix_rate();
 }
 
 int FFmpegAudioStreamPlayback::get_channels_internal() const {
-	return decoder->get_audio_channel_count();
+	return _get_audio_channel_count();
 }
 
 FFmpegAudioStreamPlayback::FFmpegAudioStreamPlayback() {
 }
 
+FFmpegAudioStreamPlayback::~FFmpegAudioStreamPlayback() {
+	if (pooled) {
+		stream->_release_decoder(this);
+	}
+}
+
 void FFmpegAudioStreamPlayback::clear() {
-	last_frame.unref();
-	available_audio_frames.clear();
-	frames_processed = 0;
+	buffering = false;
+	pitch_active = false;
 	playing = false;
 }
+
+Ref<FFmpegPCMCache> FFmpegAudioStream::_get_pcm_cache() {
+	MutexLock lock(pcm_cache_mutex);
+	if (pcm_cache_checked) {
+		return pcm_cache;
+	}
+	pcm_cache_checked = true;
+	// Network streams are never cached, their reads block.
+	String lower_file = file.to_lower();
+	if (pcm_cache_max_length_ms == 0 || lower_file.begins_with("http://") || lower_file.begins_with("https://")) {
+		return pcm_cache;
+	}
+
+	ZoneScopedN("PCM cache decode");
+	Ref<FileAccess> fa = FileAccess::open(file, FileAccess::READ);
+	if (!fa.is_valid()) {
+		return pcm_cache;
+	}
+	Ref<AudioDecoder> decoder = Ref<AudioDecoder>(memnew(AudioDecoder(fa)));
+	decoder->set_channel_mode(channel_mode);
+	// The container's duration rules out long clips before anything is decoded, decode_all() catches the ones lying about it.
+	if (!decoder->open_input() || decoder->get_duration() > pcm_cache_max_length_ms) {
+		return pcm_cache;
+	}
+	LocalVector<float> samples;
+	if (!decoder->decode_all(samples, pcm_cache_max_length_ms)) {
+		return pcm_cache;
+	}
+	uint64_t size = (uint64_t)samples.size() * (pcm_cache_16_bit ? sizeof(int16_t) : sizeof(float));
+	if (size > (uint64_t)pcm_cache_max_size_kb * 1024) {
+		return pcm_cache;
+	}
+	pcm_cache = Ref<FFmpegPCMCache>(memnew(FFmpegPCMCache(samples, decoder->get_audio_channel_count(), decoder->get_audio_mix_rate(), pcm_cache_16_bit)));
+	length = pcm_cache->get_length();
+	return pcm_cache;
+}
+
+void FFmpegAudioStream::_invalidate_pcm_cache() {
+	MutexLock lock(pcm_cache_mutex);
+	// Playbacks already reading it keep their reference.
+	pcm_cache.unref();
+	pcm_cache_checked = false;
+}
+
+Ref<AudioDecoder> FFmpegAudioStream::_open_decoder() {
+	ZoneScopedN("Audio decoder open");
+	Ref<AudioDecoder> decoder;
+	String lower_file = file.to_lower();
+	if (lower_file.begins_with("http://") || lower_file.begins_with("https://")) {
+		decoder = Ref<AudioDecoder>(memnew(AudioDecoder(file)));
+	} else {
+		Ref<FileAccess> fa = FileAccess::open(file, FileAccess::READ);
+		if (!fa.is_valid()) {
+			return Ref<AudioDecoder>();
+		}
+		decoder = Ref<AudioDecoder>(memnew(AudioDecoder(fa)));
+	}
+	decoder->set_buffer_length_ms(buffer_length_ms);
+	decoder->set_channel_mode(channel_mode);
+	decoder->start_decoding();
+	if (decoder->get_decoder_state() == AudioDecoder::FAULTED) {
+		return Ref<AudioDecoder>();
+	}
+	return decoder;
+}
+
+Ref<AudioDecoder> FFmpegAudioStream::_acquire_decoder(FFmpegAudioStreamPlayback *p_voice, bool &r_at_start, uint64_t &r_voice_id) {
+	uint64_t generation;
+	{
+		MutexLock lock(decoder_pool_mutex);
+		for (PooledDecoder &pooled : decoder_pool) {
+			if (pooled.voice == nullptr) {
+				pooled.voice = p_voice;
+				pooled.voice_serial = ++last_voice_serial;
+				pooled.decoder->set_consumer(pooled.voice_serial);
+				r_voice_id = pooled.voice_serial;
+				r_at_start = true;
+				return pooled.decoder;
+			}
+		}
+
+		// Every slot may still be opening, then there's nothing to steal either.
+		if ((int)decoder_pool.size() + opening_decoders >= max_polyphony && !decoder_pool.is_empty()) {
+			// Voices that already finished go first, otherwise the one started longest ago is cut off.
+			PooledDecoder *victim = nullptr;
+			for (PooledDecoder &pooled : decoder_pool) {
+				bool finished = !pooled.voice->is_playing_internal();
+				bool victim_finished = victim != nullptr && !victim->voice->is_playing_internal();
+				if (victim == nullptr || (finished && !victim_finished) || (finished == victim_finished && pooled.voice_serial < victim->voice_serial)) {
+					victim = &pooled;
+				}
+			}
+			// The old voice notices on its next callback, we only read once it's out of the current one.
+			victim->voice = p_voice;
+			victim->voice_serial = ++last_voice_serial;
+			victim->decoder->set_consumer(victim->voice_serial);
+			r_voice_id = victim->voice_serial;
+			r_at_start = false;
+			return victim->decoder;
+		}
+		opening_decoders++;
+		generation = decoder_pool_generation;
+	}
+
+	// Opening reads the file, other voices shouldn't wait on it.
+	Ref<AudioDecoder> decoder = _open_decoder();
+
+	MutexLock lock(decoder_pool_mutex);
+	opening_decoders--;
+	if (decoder.is_null()) {
+		return decoder;
+	}
+	r_voice_id = ++last_voice_serial;
+	decoder->set_consumer(r_voice_id);
+	r_at_start = true;
+	if (generation == decoder_pool_generation) {
+		PooledDecoder pooled;
+		pooled.decoder = decoder;
+		pooled.voice = p_voice;
+		pooled.voice_serial = r_voice_id;
+		decoder_pool.push_back(pooled);
+	}
+	return decoder;
+}
+
+void FFmpegAudioStream::_release_decoder(FFmpegAudioStreamPlayback *p_voice) {
+	MutexLock lock(decoder_pool_mutex);
+	for (PooledDecoder &pooled : decoder_pool) {
+		if (pooled.voice == p_voice) {
+			pooled.voice = nullptr;
+			pooled.decoder->set_consumer(0);
+			// Refills with the start of the clip while parked, so the next voice starts right away.
+			pooled.decoder->seek(0.0);
+			return;
+		}
+	}
+}
+
+void FFmpegAudioStream::_invalidate_decoder_pool() {
+	MutexLock lock(decoder_pool_mutex);
+	// Voices still playing keep their decoder, it's just not handed out again once they let go of it.
+	decoder_pool.clear();
+	decoder_pool_generation++;
+}
+
+void FFmpegAudioStream::prewarm_decoders(int p_count) {
+	while (true) {
+		uint64_t generation;
+		{
+			MutexLock lock(decoder_pool_mutex);
+			if ((int)decoder_pool.size() + opening_decoders >= MIN(p_count, max_polyphony)) {
+				return;
+			}
+			opening_decoders++;
+			generation = decoder_pool_generation;
+		}
+
+		Ref<AudioDecoder> decoder = _open_decoder();
+
+		MutexLock lock(decoder_pool_mutex);
+		opening_decoders--;
+		if (decoder.is_null() || generation != decoder_pool_generation) {
+			return;
+		}
+		PooledDecoder pooled;
+		pooled.decoder = decoder;
+		decoder_pool.push_back(pooled);
+	}
+}
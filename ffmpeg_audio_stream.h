@@ -37,7 +37,8 @@
 #include <godot_cpp/classes/audio_stream.hpp>
 #include <godot_cpp/classes/audio_frame.hpp>
 #include <godot_cpp/classes/audio_stream_playback.hpp>
-#include <godot_cpp/classes/audio_stream_playback_resampled.hpp>
+#include <godot_cpp/classes/mutex.hpp>
+#include <godot_cpp/core/mutex_lock.hpp>
 #include <godot_cpp/godot.hpp>
 #include <godot_cpp/templates/list.hpp>
 #include <godot_cpp/templates/vector.hpp>
@@ -47,34 +48,48 @@ using namespace godot;
 #else
 
 #include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
 #include "servers/audio/audio_stream.h"
 
 #endif
 
 #include "audio_decoder.h"
+#include "ffmpeg_pcm_cache.h"
 
 // We have to use this function redirection system for GDExtension because the naming conventions
 // for the functions we are supposed to override are different there
 
 #include "gdextension_build/func_redirect.h"
-class FFmpegAudioStreamPlayback : public AudioStreamPlaybackResampled {
-	GDCLASS(FFmpegAudioStreamPlayback, AudioStreamPlaybackResampled);
-	const int LENIENCE_BEFORE_SEEK = 2500;
-	double playback_position = 0.0f;
-	double last_playback_position = 0.0f;
+// Not an AudioStreamPlaybackResampled, the decoder already outputs at the mix rate so the engine's
+// resampler would only cost time. Pitch scaling is done here with a linear interpolator instead.
+class FFmpegAudioStreamPlayback : public AudioStreamPlayback {
+	GDCLASS(FFmpegAudioStreamPlayback, AudioStreamPlayback);
 
 	Ref<AudioDecoder> decoder;
-	List<Ref<DecodedAudioFrame>> available_audio_frames;
-	Ref<DecodedAudioFrame> last_frame;
-	int frame_read_pos = 0;
-	int frame_read_len = 0;
-	bool looping = false;
+	// Set instead of the decoder for clips the stream decoded up front, nothing is decoded per playback then.
+	Ref<FFmpegPCMCache> pcm_cache;
+	std::atomic<uint32_t> cache_position = { 0 };
+	// Seek target in frames for the mixing thread to pick up, -1 if there is none.
+	std::atomic<int64_t> cache_seek_position = { -1 };
+	// 16 bit caches are converted into this, allocated when loading.
+	LocalVector<float> cache_scratch;
+	// The decoder is borrowed from the stream's pool.
+	bool pooled = false;
+	// Parked decoders already hold the start of the clip, starting there needs no seek.
+	bool decoder_at_start = false;
+	// Consumer id the pooled decoder was handed to us with. Once the decoder's consumer differs it went back
+	// to the stream, because we were stopped or a newer voice took it over, starting again borrows one anew.
+	uint64_t voice_id = 0;
+	// The decoder ran dry before the end of the stream, the rest of the callback was silence.
 	bool buffering = false;
-	int frames_processed = 0;
-	void seek_into_sync();
-	double get_current_frame_time();
-	bool check_next_audio_frame_valid(Ref<DecodedAudioFrame> p_decoded_frame);
-	bool playing = false;
+	// Both are read by the mixing thread, the decoder Ref is only swapped while it's outside of mix_internal().
+	std::atomic<bool> playing = { false };
+	std::atomic<bool> in_mix = { false };
+	// Interpolation state while pitch scaled, the output sits between these two source frames.
+	bool pitch_active = false;
+	double pitch_offset = 1.0;
+	AudioFrame pitch_previous = { 0.0f, 0.0f };
+	AudioFrame pitch_next = { 0.0f, 0.0f };
 	int loop_count = 0;
 
 	friend class FFmpegAudioStream;
@@ -93,7 +108,15 @@ private:
 	int get_mix_rate_internal() const;
 	int get_channels_internal() const;
 
-	void update_internal(double p_delta);
+	int mix_internal(AudioFrame *p_buffer, float p_rate_scale, int p_frames);
+	int _mix_playing(AudioFrame *p_buffer, float p_rate_scale, int p_frames);
+	// Read from the cache or the decoder's ring, whichever this playback uses.
+	uint32_t _peek_audio(uint32_t p_max_frames, const float *&r_samples);
+	void _consume_audio(uint32_t p_frames);
+	bool _is_audio_finished();
+	int _get_audio_channel_count() const;
+	int _mix_direct(AudioFrame *p_buffer, int p_frames);
+	int _mix_pitched(AudioFrame *p_buffer, float p_rate_scale, int p_frames);
 
 protected:
 	void clear();
@@ -105,8 +128,10 @@ protected:
 	}; // Required by GDExtension, do not remove
 
 public:
-	void load(Ref<FileAccess> p_file_access);
-	void load_from_url(const String &p_path);
+	void load(Ref<FileAccess> p_file_access, int p_buffer_length_ms, FFmpegAudioResampler::ChannelMode p_channel_mode);
+	void load_from_url(const String &p_path, int p_buffer_length_ms, FFmpegAudioResampler::ChannelMode p_channel_mode);
+	void load_cached(const Ref<FFmpegPCMCache> &p_cache);
+	void load_pooled(const Ref<AudioDecoder> &p_decoder, bool p_at_start, uint64_t p_voice_id);
 	
 	STREAM_FUNC_REDIRECT_1(void, start, double, p_time);
 	STREAM_FUNC_REDIRECT_0(void, stop);
@@ -116,24 +141,93 @@ public:
 	STREAM_FUNC_REDIRECT_1(void, seek, double, p_time);
 	STREAM_FUNC_REDIRECT_0(void, tag_used_streams);
 
-	// int _mix(AudioFrame *p_buffer, float p_rate_scale, int p_frames);
+#ifdef GDEXTENSION
+	virtual int32_t _mix(AudioFrame *p_buffer, double p_rate_scale, int32_t p_frames) override { return mix_internal(p_buffer, p_rate_scale, p_frames); };
+#else
+	virtual int mix(AudioFrame *p_buffer, float p_rate_scale, int p_frames) override { return mix_internal(p_buffer, p_rate_scale, p_frames); };
+#endif
 	FFmpegAudioStreamPlayback();
-	int _mix_resampled(AudioFrame *p_buffer, int p_frames);
-	float _get_stream_sampling_rate();
-	
+	~FFmpegAudioStreamPlayback();
 };
 
 class FFmpegAudioStream : public AudioStream {
 	GDCLASS(FFmpegAudioStream, AudioStream);
+	friend class FFmpegAudioStreamPlayback;
+
+	// An opened decoder of the pool, parked while voice is null.
+	struct PooledDecoder {
+		Ref<AudioDecoder> decoder;
+		FFmpegAudioStreamPlayback *voice = nullptr;
+		// Order in which voices took their decoder, the oldest one is stolen first.
+		uint64_t voice_serial = 0;
+	};
 
 protected:
 	String file;
-	
+	int buffer_length_ms = 100;
+	FFmpegAudioResampler::ChannelMode channel_mode = FFmpegAudioResampler::CHANNEL_MODE_AUTO;
+	int pcm_cache_max_length_ms = 2000;
+	int pcm_cache_max_size_kb = 2048;
+	bool pcm_cache_16_bit = false;
+	// Decoded on first use if the clip qualifies. pcm_cache_checked stops clips that don't from being
+	// opened a second time to find out again.
+	Ref<FFmpegPCMCache> pcm_cache;
+	bool pcm_cache_checked = false;
+	Mutex pcm_cache_mutex;
+
+	int max_polyphony = 0;
+	LocalVector<PooledDecoder> decoder_pool;
+	uint64_t last_voice_serial = 0;
+	// Decoders are opened outside of the lock, these count against max_polyphony until they're pooled.
+	int opening_decoders = 0;
+	// Bumped when the pool is invalidated, decoders opened for the old settings aren't pooled.
+	uint64_t decoder_pool_generation = 0;
+	Mutex decoder_pool_mutex;
+
+	Ref<FFmpegPCMCache> _get_pcm_cache();
+	void _invalidate_pcm_cache();
+	Ref<AudioDecoder> _open_decoder();
+	// Hands p_voice a parked decoder, opens a new one or steals one from another voice once the pool is full.
+	// r_voice_id is the consumer id the decoder was handed over with.
+	Ref<AudioDecoder> _acquire_decoder(FFmpegAudioStreamPlayback *p_voice, bool &r_at_start, uint64_t &r_voice_id);
+	void _release_decoder(FFmpegAudioStreamPlayback *p_voice);
+	void _invalidate_decoder_pool();
+
 	static void _bind_methods(){
 		ClassDB::bind_method(D_METHOD("set_file", "file"), &FFmpegAudioStream::set_file);
 		ClassDB::bind_method(D_METHOD("get_file"), &FFmpegAudioStream::get_file);
+		ClassDB::bind_method(D_METHOD("set_buffer_length_ms", "length_ms"), &FFmpegAudioStream::set_buffer_length_ms);
+		ClassDB::bind_method(D_METHOD("get_buffer_length_ms"), &FFmpegAudioStream::get_buffer_length_ms);
+		ClassDB::bind_method(D_METHOD("set_channel_mode", "mode"), &FFmpegAudioStream::set_channel_mode);
+		ClassDB::bind_method(D_METHOD("get_channel_mode"), &FFmpegAudioStream::get_channel_mode);
+		ClassDB::bind_method(D_METHOD("set_pcm_cache_max_length_ms", "length_ms"), &FFmpegAudioStream::set_pcm_cache_max_length_ms);
+		ClassDB::bind_method(D_METHOD("get_pcm_cache_max_length_ms"), &FFmpegAudioStream::get_pcm_cache_max_length_ms);
+		ClassDB::bind_method(D_METHOD("set_pcm_cache_max_size_kb", "size_kb"), &FFmpegAudioStream::set_pcm_cache_max_size_kb);
+		ClassDB::bind_method(D_METHOD("get_pcm_cache_max_size_kb"), &FFmpegAudioStream::get_pcm_cache_max_size_kb);
+		ClassDB::bind_method(D_METHOD("set_pcm_cache_16_bit", "enabled"), &FFmpegAudioStream::set_pcm_cache_16_bit);
+		ClassDB::bind_method(D_METHOD("is_pcm_cache_16_bit"), &FFmpegAudioStream::is_pcm_cache_16_bit);
+		ClassDB::bind_method(D_METHOD("is_pcm_cached"), &FFmpegAudioStream::is_pcm_cached);
+		ClassDB::bind_method(D_METHOD("set_max_polyphony", "max_polyphony"), &FFmpegAudioStream::set_max_polyphony);
+		ClassDB::bind_method(D_METHOD("get_max_polyphony"), &FFmpegAudioStream::get_max_polyphony);
+		ClassDB::bind_method(D_METHOD("prewarm_decoders", "count"), &FFmpegAudioStream::prewarm_decoders);
 
 		ADD_PROPERTY(PropertyInfo(Variant::STRING, "file"), "set_file", "get_file");
+		// Decoded audio kept ahead of the mixer. Shorter reacts faster to seeks, longer survives decoder stalls.
+		// Applies to playbacks instantiated after the change.
+		ADD_PROPERTY(PropertyInfo(Variant::INT, "buffer_length_ms", PROPERTY_HINT_RANGE, "20,2000,1,suffix:ms"), "set_buffer_length_ms", "get_buffer_length_ms");
+		// Surround sources are mixed down on the decoder thread. Mono halves the memory and mixing work of
+		// positional sources. Applies to playbacks instantiated after the change.
+		ADD_PROPERTY(PropertyInfo(Variant::INT, "channel_mode", PROPERTY_HINT_ENUM, "Auto,Stereo,Mono"), "set_channel_mode", "get_channel_mode");
+		// Clips up to this long are decoded once into memory shared by all their playbacks, which then cost
+		// no decoding nor threads. 0 streams every clip. Local files only.
+		ADD_PROPERTY(PropertyInfo(Variant::INT, "pcm_cache_max_length_ms", PROPERTY_HINT_RANGE, "0,60000,1,suffix:ms"), "set_pcm_cache_max_length_ms", "get_pcm_cache_max_length_ms");
+		// Clips whose decoded audio takes more memory than this are streamed instead.
+		ADD_PROPERTY(PropertyInfo(Variant::INT, "pcm_cache_max_size_kb", PROPERTY_HINT_RANGE, "0,65536,1,suffix:KiB"), "set_pcm_cache_max_size_kb", "get_pcm_cache_max_size_kb");
+		// Stores cached clips at 16 bit, half the memory for a little conversion work while mixing.
+		ADD_PROPERTY(PropertyInfo(Variant::BOOL, "pcm_cache_16_bit"), "set_pcm_cache_16_bit", "is_pcm_cache_16_bit");
+		// Streamed playbacks share up to this many decoders kept open between them, so starting one skips
+		// opening the file. Past that the oldest voice is cut off. 0 opens a decoder per playback.
+		ADD_PROPERTY(PropertyInfo(Variant::INT, "max_polyphony", PROPERTY_HINT_RANGE, "0,64,1"), "set_max_polyphony", "get_max_polyphony");
 
 	}; // Required by GDExtension, do not remove
 
@@ -141,6 +235,8 @@ public:
 	double length=0.0f;
 	void set_file(const String &p_file) {
 		file = p_file;
+		_invalidate_pcm_cache();
+		_invalidate_decoder_pool();
 		emit_changed();
 	}
 
@@ -148,18 +244,103 @@ public:
 		return file;
 	}
 
+	void set_buffer_length_ms(int p_length_ms) {
+		buffer_length_ms = CLAMP(p_length_ms, 20, 2000);
+		_invalidate_decoder_pool();
+	}
+
+	int get_buffer_length_ms() const {
+		return buffer_length_ms;
+	}
+
+	void set_channel_mode(int p_mode) {
+		ERR_FAIL_INDEX(p_mode, FFmpegAudioResampler::CHANNEL_MODE_MAX);
+		channel_mode = (FFmpegAudioResampler::ChannelMode)p_mode;
+		_invalidate_pcm_cache();
+		_invalidate_decoder_pool();
+	}
+
+	int get_channel_mode() const {
+		return channel_mode;
+	}
+
+	void set_pcm_cache_max_length_ms(int p_length_ms) {
+		pcm_cache_max_length_ms = MAX(p_length_ms, 0);
+		_invalidate_pcm_cache();
+	}
+
+	int get_pcm_cache_max_length_ms() const {
+		return pcm_cache_max_length_ms;
+	}
+
+	void set_pcm_cache_max_size_kb(int p_size_kb) {
+		pcm_cache_max_size_kb = MAX(p_size_kb, 0);
+		_invalidate_pcm_cache();
+	}
+
+	int get_pcm_cache_max_size_kb() const {
+		return pcm_cache_max_size_kb;
+	}
+
+	void set_pcm_cache_16_bit(bool p_enabled) {
+		pcm_cache_16_bit = p_enabled;
+		_invalidate_pcm_cache();
+	}
+
+	bool is_pcm_cache_16_bit() const {
+		return pcm_cache_16_bit;
+	}
+
+	// Whether playbacks are served from memory, only known once the first one was instantiated.
+	bool is_pcm_cached() const {
+		return pcm_cache.is_valid();
+	}
+
+	void set_max_polyphony(int p_max_polyphony) {
+		max_polyphony = CLAMP(p_max_polyphony, 0, 64);
+		_invalidate_decoder_pool();
+	}
+
+	int get_max_polyphony() const {
+		return max_polyphony;
+	}
+
+	// Opens up to p_count pooled decoders now, so the first voices don't pay for it either.
+	void prewarm_decoders(int p_count);
+
 	double _get_length(){
 		return length;
 	}
 
 	Ref<AudioStreamPlayback> _instantiate_playback() {
 		String file_path = get_file();
+		Ref<FFmpegPCMCache> cache = _get_pcm_cache();
+		if (cache.is_valid()) {
+			Ref<FFmpegAudioStreamPlayback> pb;
+			pb.instantiate();
+			pb->stream = Ref<FFmpegAudioStream>(this);
+			pb->load_cached(cache);
+			return pb;
+		}
+		if (max_polyphony > 0) {
+			Ref<FFmpegAudioStreamPlayback> pb;
+			pb.instantiate();
+			pb->stream = Ref<FFmpegAudioStream>(this);
+			bool at_start = false;
+			uint64_t voice_id = 0;
+			Ref<AudioDecoder> decoder = _acquire_decoder(pb.ptr(), at_start, voice_id);
+			if (decoder.is_null()) {
+				return Ref<AudioStreamPlayback>();
+			}
+			pb->load_pooled(decoder, at_start, voice_id);
+			return pb;
+		}
 		if(file_path.to_lower().begins_with("http://") || file_path.to_lower().begins_with("https://")){
 			Ref<FFmpegAudioStreamPlayback> pb;
 			
 			pb.instantiate();
 			pb->stream = Ref<FFmpegAudioStream>(this);
-			pb->load_from_url(file_path);
+			pb->load_from_url(file_path, buffer_length_ms, channel_mode);
 			return pb;
 		}else{
 			Ref<FileAccess> fa = FileAccess::open(file_path, FileAccess::READ);
@@ -169,7 +350,7 @@ public:
 			Ref<FFmpegAudioStreamPlayback> pb;
 			pb.instantiate();
 			pb->stream = Ref<FFmpegAudioStream>(this);
-			pb->load(fa);
+			pb->load(fa, buffer_length_ms, channel_mode);
 			return pb;
 		}
 	}
@@ -0,0 +1,161 @@
+/**************************************************************************/
+/*  ffmpeg_codec_registry.cpp                                             */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#include "ffmpeg_codec_registry.h"
+
+#ifdef GDEXTENSION
+#include "gdextension_build/gdex_print.h"
+#else
+#include "core/string/print_string.h"
+#endif
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+#include "tracy_import.h"
+
+FFmpegCodecRegistry *FFmpegCodecRegistry::singleton = nullptr;
+
+void FFmpegCodecRegistry::_ensure_extensions_built() {
+	if (extensions_built.load(std::memory_order_acquire)) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(extensions_mutex);
+	if (extensions_built.load(std::memory_order_relaxed)) {
+		return;
+	}
+	ZoneScopedN("FFmpeg extension list build");
+
+	void *iterator = nullptr;
+	const AVInputFormat *input_format = nullptr;
+	while ((input_format = av_demuxer_iterate(&iterator)) != nullptr) {
+		if (input_format->extensions == nullptr) {
+			continue;
+		}
+		for (const String &extension : String(input_format->extensions).split(",", false)) {
+			String lower_extension = extension.strip_edges().to_lower();
+			if (!extensions.has(lower_extension)) {
+				extensions.insert(lower_extension);
+				extension_list.push_back(lower_extension);
+			}
+		}
+	}
+
+	extensions_built.store(true, std::memory_order_release);
+}
+
+void FFmpegCodecRegistry::_ensure_decoders_built() {
+	// Called with decoders_mutex held.
+	if (decoders_built) {
+		return;
+	}
+	decoders_built = true;
+	ZoneScopedN("FFmpeg codec registry build");
+
+	void *iterator = nullptr;
+	const AVCodec *av_codec = nullptr;
+	while ((av_codec = av_codec_iterate(&iterator)) != nullptr) {
+		if (!av_codec_is_decoder(av_codec)) {
+			continue;
+		}
+		if (!decoders.has(av_codec->id)) {
+			decoders.insert(av_codec->id, Vector<Ref<FFmpegCodec>>());
+		}
+		decoders[av_codec->id].push_back(memnew(FFmpegCodec(av_codec)));
+	}
+}
+
+FFmpegCodecRegistry *FFmpegCodecRegistry::get_singleton() {
+	return singleton;
+}
+
+Vector<Ref<FFmpegCodec>> FFmpegCodecRegistry::get_decoders(AVCodecID p_codec_id) {
+	std::lock_guard<std::mutex> lock(decoders_mutex);
+	_ensure_decoders_built();
+	HashMap<int, Vector<Ref<FFmpegCodec>>>::Iterator it = decoders.find(p_codec_id);
+	if (it == decoders.end()) {
+		return Vector<Ref<FFmpegCodec>>();
+	}
+	if (!probed_codec_ids.has(p_codec_id)) {
+		// Only the codecs of streams actually opened are probed.
+		ZoneScopedN("FFmpeg codec HW config probe");
+		for (const Ref<FFmpegCodec> &codec : it->value) {
+			codec->get_supported_hw_device_types();
+		}
+		probed_codec_ids.insert(p_codec_id);
+	}
+	return it->value;
+}
+
+Ref<FFmpegCodec> FFmpegCodecRegistry::get_default_decoder(AVCodecID p_codec_id) {
+	Vector<Ref<FFmpegCodec>> codecs = get_decoders(p_codec_id);
+	if (codecs.is_empty()) {
+		return Ref<FFmpegCodec>();
+	}
+	return codecs[0];
+}
+
+bool FFmpegCodecRegistry::is_extension_supported(const String &p_extension) {
+	_ensure_extensions_built();
+	return extensions.has(p_extension.to_lower());
+}
+
+PackedStringArray FFmpegCodecRegistry::get_supported_extensions() {
+	_ensure_extensions_built();
+	return extension_list;
+}
+
+void FFmpegCodecRegistry::print_codecs() {
+	std::lock_guard<std::mutex> lock(decoders_mutex);
+	_ensure_decoders_built();
+	print_line("Supported video codecs:");
+	const AVCodecDescriptor *desc = nullptr;
+	while ((desc = avcodec_descriptor_next(desc))) {
+		HashMap<int, Vector<Ref<FFmpegCodec>>>::Iterator it = decoders.find(desc->id);
+		if (it == decoders.end()) {
+			continue;
+		}
+		print_line(vformat("\tdecode %s", desc->name));
+		for (const Ref<FFmpegCodec> &codec : it->value) {
+			if (strcmp(codec->get_codec_ptr()->name, desc->name) != 0) {
+				print_line(vformat("\t  codec: %s", codec->get_codec_ptr()->name));
+			}
+		}
+	}
+}
+
+FFmpegCodecRegistry::FFmpegCodecRegistry() {
+	singleton = this;
+}
+
+FFmpegCodecRegistry::~FFmpegCodecRegistry() {
+	singleton = nullptr;
+}
@@ -0,0 +1,96 @@
+/**************************************************************************/
+/*  ffmpeg_codec_registry.h                                               */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_CODEC_REGISTRY_H
+#define FFMPEG_CODEC_REGISTRY_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/godot.hpp>
+#include <godot_cpp/templates/hash_map.hpp>
+#include <godot_cpp/templates/hash_set.hpp>
+#include <godot_cpp/templates/vector.hpp>
+#include <godot_cpp/variant/packed_string_array.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/templates/hash_map.h"
+#include "core/templates/hash_set.h"
+#include "core/templates/vector.h"
+#include "core/variant/variant.h"
+
+#endif
+
+#include "ffmpeg_codec.h"
+
+#include <atomic>
+#include <mutex>
+
+// What the linked FFmpeg build can decode and demux, gathered once on first use instead of walking
+// FFmpeg's codec and demuxer lists every time a stream is opened or a loader is queried.
+// The loaders ask for extensions during the startup filesystem scan, so those are gathered on their own
+// and the decoders only once the first stream is opened.
+class FFmpegCodecRegistry {
+	static FFmpegCodecRegistry *singleton;
+
+	std::mutex extensions_mutex;
+	std::atomic<bool> extensions_built = { false };
+	HashSet<String> extensions;
+	PackedStringArray extension_list;
+
+	// Guards everything below, streams are opened from several threads.
+	std::mutex decoders_mutex;
+	bool decoders_built = false;
+	// Decoders of each codec id in av_codec_iterate order, so the first one is what avcodec_find_decoder returns.
+	HashMap<int, Vector<Ref<FFmpegCodec>>> decoders;
+	// Codec ids whose decoders had their HW configs cached, which makes them safe to share between threads.
+	HashSet<int> probed_codec_ids;
+
+	void _ensure_extensions_built();
+	void _ensure_decoders_built();
+
+public:
+	static FFmpegCodecRegistry *get_singleton();
+
+	Vector<Ref<FFmpegCodec>> get_decoders(AVCodecID p_codec_id);
+	Ref<FFmpegCodec> get_default_decoder(AVCodecID p_codec_id);
+	// Extensions any demuxer claims, lower case.
+	bool is_extension_supported(const String &p_extension);
+	PackedStringArray get_supported_extensions();
+	void print_codecs();
+
+	FFmpegCodecRegistry();
+	~FFmpegCodecRegistry();
+};
+
+#endif // FFMPEG_CODEC_REGISTRY_H
@@ -0,0 +1,256 @@
+/**************************************************************************/
+/*  ffmpeg_decode_scheduler.cpp                                           */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#include "ffmpeg_decode_scheduler.h"
+
+#ifdef GDEXTENSION
+#include <godot_cpp/classes/os.hpp>
+#else
+#include "core/os/os.h"
+#endif
+
+#include "tracy_import.h"
+
+#include <chrono>
+
+FFmpegDecodeScheduler *FFmpegDecodeScheduler::singleton = nullptr;
+
+void FFmpegDecodeTask::set_priority(int p_priority) {
+	ERR_FAIL_INDEX(p_priority, FFmpegDecodeScheduler::PRIORITY_MAX);
+	// Picked up the next time the task is queued.
+	priority.store(p_priority);
+}
+
+int FFmpegDecodeTask::get_priority() const {
+	return priority.load();
+}
+
+void FFmpegDecodeTask::set_retry_delay_usec(uint64_t p_delay_usec) {
+	retry_delay_usec.store(p_delay_usec);
+}
+
+FFmpegDecodeTask::FFmpegDecodeTask(StepFunc p_step_func, void *p_userdata, int p_priority) :
+		step_func(p_step_func), userdata(p_userdata), priority(p_priority) {
+}
+
+void FFmpegDecodeScheduler::_worker_func(FFmpegDecodeScheduler *p_scheduler) {
+	p_scheduler->_process_tasks();
+}
+
+void FFmpegDecodeScheduler::_process_tasks() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!exiting) {
+		if (!delayed_tasks.is_empty()) {
+			_wake_delayed_tasks(OS::get_singleton()->get_ticks_usec());
+		}
+
+		FFmpegDecodeTask *task = _pop_task();
+		if (task == nullptr) {
+			if (delayed_tasks.is_empty()) {
+				work_condition.wait(lock);
+			} else {
+				uint64_t next_wake_usec = delayed_tasks[0].wake_usec;
+				for (const DelayedTask &delayed_task : delayed_tasks) {
+					next_wake_usec = MIN(next_wake_usec, delayed_task.wake_usec);
+				}
+				uint64_t now_usec = OS::get_singleton()->get_ticks_usec();
+				work_condition.wait_for(lock, std::chrono::microseconds(next_wake_usec > now_usec ? next_wake_usec - now_usec : 0));
+			}
+			continue;
+		}
+
+		task->running = true;
+		task->state.store(FFmpegDecodeTask::STATE_RUNNING);
+		lock.unlock();
+
+		FFmpegDecodeTask::StepResult result;
+		{
+			ZoneScopedN("Decode task step");
+			result = task->step_func(task->userdata);
+		}
+
+		lock.lock();
+		task->running = false;
+		_finish_step(task, result);
+	}
+}
+
+void FFmpegDecodeScheduler::_push_task(FFmpegDecodeTask *p_task) {
+	p_task->queued_priority = p_task->priority.load();
+	p_task->queue_element = queues[p_task->queued_priority].push_back(p_task);
+}
+
+FFmpegDecodeTask *FFmpegDecodeScheduler::_pop_task() {
+	bool serve_lowest = (dispatch_count + 1) % AGING_INTERVAL == 0;
+	for (int i = 0; i < PRIORITY_MAX; i++) {
+		int level = serve_lowest ? i : PRIORITY_MAX - 1 - i;
+		if (queues[level].is_empty()) {
+			continue;
+		}
+		FFmpegDecodeTask *task = queues[level].front()->get();
+		queues[level].pop_front();
+		task->queue_element = nullptr;
+		dispatch_count++;
+		return task;
+	}
+	return nullptr;
+}
+
+void FFmpegDecodeScheduler::_finish_step(FFmpegDecodeTask *p_task, FFmpegDecodeTask::StepResult p_result) {
+	int expected = FFmpegDecodeTask::STATE_RUNNING;
+	if (p_result != FFmpegDecodeTask::STEP_CONTINUE && p_task->state.compare_exchange_strong(expected, FFmpegDecodeTask::STATE_IDLE)) {
+		if (p_result == FFmpegDecodeTask::STEP_RETRY_LATER) {
+			DelayedTask delayed_task;
+			delayed_task.task = p_task;
+			uint64_t delay_usec = p_task->retry_delay_usec.load();
+			delayed_task.wake_usec = OS::get_singleton()->get_ticks_usec() + (delay_usec > 0 ? delay_usec : RETRY_DELAY_USEC);
+			delayed_tasks.push_back(delayed_task);
+		}
+		return;
+	}
+
+	// Either there's more to do or it was signaled while running. Goes to the back of its queue
+	// so other tasks of the same priority get a turn.
+	// cancel() holds the mutex too, the only transition that can race with this is a signal.
+	int state = p_task->state.load();
+	while (state != FFmpegDecodeTask::STATE_CANCELLED) {
+		if (p_task->state.compare_exchange_weak(state, FFmpegDecodeTask::STATE_QUEUED)) {
+			_push_task(p_task);
+			return;
+		}
+	}
+	cancel_condition.notify_all();
+}
+
+void FFmpegDecodeScheduler::_wake_delayed_tasks(uint64_t p_now_usec) {
+	for (uint32_t i = 0; i < delayed_tasks.size();) {
+		if (delayed_tasks[i].wake_usec > p_now_usec) {
+			i++;
+			continue;
+		}
+		FFmpegDecodeTask *task = delayed_tasks[i].task;
+		delayed_tasks.remove_at_unordered(i);
+		// It may have been signaled and run in the meantime, then this is a no-op.
+		int expected = FFmpegDecodeTask::STATE_IDLE;
+		if (task->state.compare_exchange_strong(expected, FFmpegDecodeTask::STATE_QUEUED)) {
+			_push_task(task);
+		}
+	}
+}
+
+FFmpegDecodeScheduler *FFmpegDecodeScheduler::get_singleton() {
+	return singleton;
+}
+
+void FFmpegDecodeScheduler::signal(FFmpegDecodeTask *p_task) {
+	int state = p_task->state.load();
+	while (true) {
+		if (state == FFmpegDecodeTask::STATE_IDLE) {
+			if (p_task->state.compare_exchange_weak(state, FFmpegDecodeTask::STATE_QUEUED)) {
+				std::lock_guard<std::mutex> lock(mutex);
+				// Cancelled between the exchange and taking the lock.
+				if (p_task->state.load() == FFmpegDecodeTask::STATE_QUEUED) {
+					if (workers.is_empty()) {
+						_start_workers();
+					}
+					_push_task(p_task);
+					work_condition.notify_one();
+				}
+				return;
+			}
+		} else if (state == FFmpegDecodeTask::STATE_RUNNING) {
+			if (p_task->state.compare_exchange_weak(state, FFmpegDecodeTask::STATE_RUNNING_SIGNALED)) {
+				return;
+			}
+		} else {
+			return;
+		}
+	}
+}
+
+void FFmpegDecodeScheduler::cancel(FFmpegDecodeTask *p_task) {
+	std::unique_lock<std::mutex> lock(mutex);
+	p_task->state.store(FFmpegDecodeTask::STATE_CANCELLED);
+	if (p_task->queue_element != nullptr) {
+		queues[p_task->queued_priority].erase(p_task->queue_element);
+		p_task->queue_element = nullptr;
+	}
+	for (uint32_t i = 0; i < delayed_tasks.size();) {
+		if (delayed_tasks[i].task == p_task) {
+			delayed_tasks.remove_at_unordered(i);
+		} else {
+			i++;
+		}
+	}
+	cancel_condition.wait(lock, [p_task]() { return !p_task->running; });
+}
+
+void FFmpegDecodeScheduler::register_video_decoder() {
+	video_decoder_count.increment();
+}
+
+void FFmpegDecodeScheduler::unregister_video_decoder() {
+	video_decoder_count.decrement();
+}
+
+int FFmpegDecodeScheduler::get_codec_thread_count() const {
+	// A lone 4K stream still gets every core, a wall of cameras gets single threaded codecs and
+	// relies on the workers for parallelism.
+	return MAX(1, get_worker_count() / (int)MAX(1u, video_decoder_count.get()));
+}
+
+int FFmpegDecodeScheduler::get_worker_count() const {
+	return worker_count;
+}
+
+void FFmpegDecodeScheduler::_start_workers() {
+	for (int i = 0; i < worker_count; i++) {
+		workers.push_back(memnew(std::thread(_worker_func, this)));
+	}
+}
+
+FFmpegDecodeScheduler::FFmpegDecodeScheduler() {
+	singleton = this;
+	// Leave a core for the main thread.
+	worker_count = MAX(1, OS::get_singleton()->get_processor_count() - 1);
+}
+
+FFmpegDecodeScheduler::~FFmpegDecodeScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		exiting = true;
+		work_condition.notify_all();
+	}
+	for (uint32_t i = 0; i < workers.size(); i++) {
+		workers[i]->join();
+		memdelete(workers[i]);
+	}
+	singleton = nullptr;
+}
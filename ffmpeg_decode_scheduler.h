@@ -0,0 +1,165 @@
+/**************************************************************************/
+/*  ffmpeg_decode_scheduler.h                                             */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_DECODE_SCHEDULER_H
+#define FFMPEG_DECODE_SCHEDULER_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/godot.hpp>
+#include <godot_cpp/templates/list.hpp>
+#include <godot_cpp/templates/local_vector.hpp>
+#include <godot_cpp/templates/safe_refcount.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/templates/list.h"
+#include "core/templates/local_vector.h"
+#include "core/templates/safe_refcount.h"
+
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// A resumable piece of decoder work, e.g. demuxing or decoding one stream. The scheduler runs one
+// step at a time and never runs the same task on two workers at once.
+class FFmpegDecodeTask {
+	friend class FFmpegDecodeScheduler;
+
+public:
+	enum StepResult {
+		// Nothing to do until signaled again.
+		STEP_IDLE,
+		STEP_CONTINUE,
+		// Input isn't ready yet, try again after a short delay.
+		STEP_RETRY_LATER,
+	};
+	typedef StepResult (*StepFunc)(void *p_userdata);
+
+private:
+	enum State {
+		STATE_IDLE,
+		STATE_QUEUED,
+		STATE_RUNNING,
+		// Signaled while running, goes back to the queue once the step is done.
+		STATE_RUNNING_SIGNALED,
+		STATE_CANCELLED,
+	};
+
+	StepFunc step_func;
+	void *userdata;
+	std::atomic<int> state = { STATE_IDLE };
+	std::atomic<int> priority;
+	std::atomic<uint64_t> retry_delay_usec = { 0 };
+	// Only accessed with the scheduler mutex held.
+	bool running = false;
+	int queued_priority = 0;
+	List<FFmpegDecodeTask *>::Element *queue_element = nullptr;
+
+public:
+	void set_priority(int p_priority);
+	int get_priority() const;
+	// How long STEP_RETRY_LATER waits before running the task again, 0 uses the scheduler's default.
+	// Tasks polling a consumer that must never signal them, like the audio thread, set their own.
+	void set_retry_delay_usec(uint64_t p_delay_usec);
+	FFmpegDecodeTask(StepFunc p_step_func, void *p_userdata, int p_priority);
+};
+
+// Runs the decode tasks of every stream on a fixed set of workers sized to the core count, so
+// having many streams open doesn't translate into many CPU-bound threads fighting each other.
+class FFmpegDecodeScheduler {
+public:
+	enum Priority {
+		PRIORITY_OFFSCREEN,
+		PRIORITY_VISIBLE,
+		PRIORITY_FOCUSED,
+		// Audio underruns are audible, it always goes first. Demuxing uses it too since both
+		// the audio and video stages wait on it.
+		PRIORITY_AUDIO,
+		PRIORITY_MAX,
+	};
+
+private:
+	static FFmpegDecodeScheduler *singleton;
+	// Every this many dispatches the lowest waiting priority is served, so busy focused streams
+	// slow offscreen ones down instead of freezing them.
+	static const uint32_t AGING_INTERVAL = 8;
+	static const uint64_t RETRY_DELAY_USEC = 1000;
+
+	struct DelayedTask {
+		FFmpegDecodeTask *task = nullptr;
+		uint64_t wake_usec = 0;
+	};
+
+	std::mutex mutex;
+	std::condition_variable work_condition;
+	std::condition_variable cancel_condition;
+	List<FFmpegDecodeTask *> queues[PRIORITY_MAX];
+	LocalVector<DelayedTask> delayed_tasks;
+	LocalVector<std::thread *> workers;
+	// Workers are only started once the first task is queued.
+	int worker_count = 0;
+	uint32_t dispatch_count = 0;
+	bool exiting = false;
+	SafeNumeric<uint32_t> video_decoder_count;
+
+	static void _worker_func(FFmpegDecodeScheduler *p_scheduler);
+	void _process_tasks();
+	void _push_task(FFmpegDecodeTask *p_task);
+	FFmpegDecodeTask *_pop_task();
+	void _finish_step(FFmpegDecodeTask *p_task, FFmpegDecodeTask::StepResult p_result);
+	void _wake_delayed_tasks(uint64_t p_now_usec);
+	void _start_workers();
+
+public:
+	static FFmpegDecodeScheduler *get_singleton();
+
+	// Queues p_task if it is idle, safe to call from any thread and cheap when it's already queued.
+	void signal(FFmpegDecodeTask *p_task);
+	// Removes p_task from the scheduler, waiting for its current step to finish. It can be freed after this.
+	void cancel(FFmpegDecodeTask *p_task);
+
+	// Video decoders register themselves so the codecs' own thread pools can be sized to share the cores.
+	void register_video_decoder();
+	void unregister_video_decoder();
+	int get_codec_thread_count() const;
+	int get_worker_count() const;
+
+	FFmpegDecodeScheduler();
+	~FFmpegDecodeScheduler();
+};
+
+#endif // FFMPEG_DECODE_SCHEDULER_H
@@ -0,0 +1,190 @@
+/**************************************************************************/
+/*  ffmpeg_decoder_registry.cpp                                           */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#include "ffmpeg_decoder_registry.h"
+
+#ifdef GDEXTENSION
+#include <godot_cpp/classes/engine.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+#else
+#include "core/config/engine.h"
+#include "core/config/project_settings.h"
+#endif
+
+#include "tracy_import.h"
+
+FFmpegDecoderRegistry *FFmpegDecoderRegistry::singleton = nullptr;
+
+Ref<VideoDecoder> FFmpegSharedDecoder::get_decoder() const {
+	return decoder;
+}
+
+int FFmpegSharedDecoder::get_subscriber_count() const {
+	return subscriber_count.get();
+}
+
+double FFmpegSharedDecoder::advance_clock(double p_delta) {
+	MutexLock lock(mutex);
+	uint64_t process_frame = Engine::get_singleton()->get_process_frames();
+	if (process_frame != last_clock_process_frame) {
+		last_clock_process_frame = process_frame;
+		double media_delta = p_delta * 1000.0 * decoder->get_playback_speed();
+		if (decoder->is_reverse()) {
+			clock_position = MAX(clock_position - media_delta, 0.0);
+		} else {
+			clock_position += media_delta;
+		}
+	}
+	return clock_position;
+}
+
+void FFmpegSharedDecoder::set_clock_position(double p_position) {
+	MutexLock lock(mutex);
+	clock_position = MAX(p_position, 0.0);
+}
+
+Ref<DecodedFrame> FFmpegSharedDecoder::get_latest_frame(uint64_t &r_serial) {
+	MutexLock lock(mutex);
+
+	// The first subscriber updated in an engine frame does the pumping, the rest reuse its result.
+	uint64_t process_frame = Engine::get_singleton()->get_process_frames();
+	if (process_frame != last_pump_process_frame) {
+		ZoneScopedN("Shared decoder pump");
+		last_pump_process_frame = process_frame;
+
+		bool live = decoder->is_live();
+		bool reverse = decoder->is_reverse();
+		Ref<DecodedFrame> frame;
+		while (decoder->peek_decoded_frame(frame)) {
+			// Late frames are let through so the ones behind them can catch up, only the newest one is shown.
+			if (!live && (reverse ? frame->get_time() < clock_position : frame->get_time() > clock_position)) {
+				break;
+			}
+			decoder->pop_decoded_frame(frame);
+			// Subscribers may still hold the previous frame's images, the pool won't reuse them until
+			// they let go.
+			if (published_frame.is_valid()) {
+				decoder->return_frame(published_frame);
+			}
+			published_frame = frame;
+			published_frame_serial++;
+		}
+	}
+
+	r_serial = published_frame_serial;
+	return published_frame;
+}
+
+bool FFmpegSharedDecoder::claim_audio(const void *p_subscriber) {
+	MutexLock lock(mutex);
+	if (audio_subscriber == nullptr) {
+		audio_subscriber = p_subscriber;
+	}
+	return audio_subscriber == p_subscriber;
+}
+
+void FFmpegSharedDecoder::release_audio(const void *p_subscriber) {
+	MutexLock lock(mutex);
+	if (audio_subscriber == p_subscriber) {
+		audio_subscriber = nullptr;
+	}
+}
+
+FFmpegSharedDecoder::~FFmpegSharedDecoder() {
+	if (decoder.is_valid() && published_frame.is_valid()) {
+		decoder->return_frame(published_frame);
+	}
+}
+
+FFmpegDecoderRegistry *FFmpegDecoderRegistry::get_singleton() {
+	return singleton;
+}
+
+String FFmpegDecoderRegistry::make_key(const String &p_path, VideoDecoder::OutputFormat p_output_format, bool p_live, Vector2i p_target_size, bool p_fit, VideoDecoder::ScaleFilter p_filter) {
+	String path = p_path.strip_edges();
+	int scheme_end = path.find("://");
+	if (scheme_end != -1 && !path.begins_with("res://") && !path.begins_with("user://")) {
+		// Scheme names are case insensitive, the rest of the URL is not.
+		path = path.substr(0, scheme_end).to_lower() + path.substr(scheme_end);
+	} else {
+		path = ProjectSettings::get_singleton()->globalize_path(path).simplify_path();
+	}
+	return vformat("%s|%d|%d|%dx%d|%d|%d", path, (int)p_output_format, (int)p_live, p_target_size.x, p_target_size.y, (int)p_fit, (int)p_filter);
+}
+
+Ref<FFmpegSharedDecoder> FFmpegDecoderRegistry::subscribe(const String &p_key) {
+	MutexLock lock(mutex);
+	HashMap<String, Ref<FFmpegSharedDecoder>>::Iterator it = decoders.find(p_key);
+	if (it == decoders.end()) {
+		return Ref<FFmpegSharedDecoder>();
+	}
+	it->value->subscriber_count.increment();
+	return it->value;
+}
+
+Ref<FFmpegSharedDecoder> FFmpegDecoderRegistry::subscribe(const String &p_key, const Ref<VideoDecoder> &p_decoder) {
+	ERR_FAIL_COND_V(p_decoder.is_null(), Ref<FFmpegSharedDecoder>());
+
+	MutexLock lock(mutex);
+	HashMap<String, Ref<FFmpegSharedDecoder>>::Iterator it = decoders.find(p_key);
+	if (it != decoders.end()) {
+		it->value->subscriber_count.increment();
+		return it->value;
+	}
+
+	Ref<FFmpegSharedDecoder> shared_decoder;
+	shared_decoder.instantiate();
+	shared_decoder->key = p_key;
+	shared_decoder->decoder = p_decoder;
+	shared_decoder->subscriber_count.set(1);
+	decoders.insert(p_key, shared_decoder);
+	return shared_decoder;
+}
+
+void FFmpegDecoderRegistry::unsubscribe(const Ref<FFmpegSharedDecoder> &p_shared_decoder, const void *p_subscriber) {
+	ERR_FAIL_COND(p_shared_decoder.is_null());
+	p_shared_decoder->release_audio(p_subscriber);
+
+	MutexLock lock(mutex);
+	ERR_FAIL_COND(p_shared_decoder->subscriber_count.get() <= 0);
+	if (p_shared_decoder->subscriber_count.decrement() == 0) {
+		// Subscribers drop their own references, the decoder threads stop when the last one goes.
+		decoders.erase(p_shared_decoder->key);
+	}
+}
+
+FFmpegDecoderRegistry::FFmpegDecoderRegistry() {
+	singleton = this;
+}
+
+FFmpegDecoderRegistry::~FFmpegDecoderRegistry() {
+	decoders.clear();
+	singleton = nullptr;
+}
@@ -0,0 +1,120 @@
+/**************************************************************************/
+/*  ffmpeg_decoder_registry.h                                             */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_DECODER_REGISTRY_H
+#define FFMPEG_DECODER_REGISTRY_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/classes/mutex.hpp>
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/core/mutex_lock.hpp>
+#include <godot_cpp/godot.hpp>
+#include <godot_cpp/templates/hash_map.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
+#include "core/templates/hash_map.h"
+
+#endif
+
+#include "video_decoder.h"
+
+// One decoder feeding every playback subscribed to the same source, so N players showing the
+// same camera or video only demux, decode and convert it once.
+class FFmpegSharedDecoder : public RefCounted {
+	friend class FFmpegDecoderRegistry;
+
+	String key;
+	Ref<VideoDecoder> decoder;
+	// Only modified with the registry mutex held.
+	SafeNumeric<int> subscriber_count;
+
+	// Subscribers may be updated from different threads, the decoder's consumer side is only
+	// touched with this held.
+	Mutex mutex;
+	Ref<DecodedFrame> published_frame;
+	uint64_t published_frame_serial = 0;
+	uint64_t last_pump_process_frame = UINT64_MAX;
+	// Media time in ms the published frames are paced against, so files play at their own rate and
+	// not at decode speed. Advanced by the first subscriber updated in an engine frame, like the pump.
+	double clock_position = 0.0;
+	uint64_t last_clock_process_frame = UINT64_MAX;
+	// Audio can't be fanned out without mixing it once per player, so only one subscriber gets it.
+	const void *audio_subscriber = nullptr;
+
+public:
+	Ref<VideoDecoder> get_decoder() const;
+	int get_subscriber_count() const;
+	// Moves the clock on by p_delta seconds at most once per engine frame, returns it in ms.
+	double advance_clock(double p_delta);
+	// For the subscriber controlling the decoder, after seeking it or correcting for audio drift.
+	void set_clock_position(double p_position);
+	// Returns the newest frame due at the clock, live sources always publish the newest decoded one.
+	// The decoder is moved forward at most once per engine frame and r_serial changes whenever a new
+	// frame is published. The returned frame stays owned by the shared decoder and must not be handed
+	// back to the VideoDecoder by subscribers.
+	Ref<DecodedFrame> get_latest_frame(uint64_t &r_serial);
+	// Claims the audio output for p_subscriber if nobody else holds it.
+	bool claim_audio(const void *p_subscriber);
+	void release_audio(const void *p_subscriber);
+	~FFmpegSharedDecoder();
+};
+
+class FFmpegDecoderRegistry {
+	static FFmpegDecoderRegistry *singleton;
+
+	Mutex mutex;
+	HashMap<String, Ref<FFmpegSharedDecoder>> decoders;
+
+public:
+	static FFmpegDecoderRegistry *get_singleton();
+	// Builds the lookup key, paths are globalized so "res://a.mp4" and its absolute path match.
+	// Playbacks asking for a different output size or filter get a decoder of their own.
+	static String make_key(const String &p_path, VideoDecoder::OutputFormat p_output_format, bool p_live, Vector2i p_target_size = Vector2i(), bool p_fit = true, VideoDecoder::ScaleFilter p_filter = VideoDecoder::SCALE_FILTER_FAST_BILINEAR);
+
+	// Subscribes to the decoder registered under p_key, returns an invalid Ref if there is none.
+	Ref<FFmpegSharedDecoder> subscribe(const String &p_key);
+	// Registers p_decoder under p_key and subscribes to it. If another thread registered the key
+	// first, subscribes to that one instead and p_decoder is discarded.
+	Ref<FFmpegSharedDecoder> subscribe(const String &p_key, const Ref<VideoDecoder> &p_decoder);
+	// The decoder is torn down once its last subscriber leaves.
+	void unsubscribe(const Ref<FFmpegSharedDecoder> &p_shared_decoder, const void *p_subscriber);
+
+	FFmpegDecoderRegistry();
+	~FFmpegDecoderRegistry();
+};
+
+#endif // FFMPEG_DECODER_REGISTRY_H
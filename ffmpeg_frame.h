@@ -35,7 +35,6 @@
 
 // Headers for building as GDExtension plug-in.
 #include <godot_cpp/classes/ref_counted.hpp>
-#include <godot_cpp/classes/weak_ref.hpp>
 #include <godot_cpp/godot.hpp>
 
 using namespace godot;
@@ -49,20 +48,12 @@ extern "C" {
 #include "libavutil/frame.h"
 }
 
+// Recycled through the owning decoder's FFmpegObjectPool, so it doesn't need to know where to return itself.
 class FFmpegFrame : public RefCounted {
-public:
-	typedef void (*return_frame_callback_t)(Ref<RefCounted> p_instance, Ref<FFmpegFrame> p_frame);
-
-private:
 	AVFrame *frame = nullptr;
-	return_frame_callback_t return_func = nullptr;
-	Ref<WeakRef> return_instance;
 
 public:
 	AVFrame *get_frame() const;
-	double get_time() const;
-	void do_return();
-	FFmpegFrame(Ref<RefCounted> p_return_func_instance, return_frame_callback_t p_return_func);
 	FFmpegFrame();
 	~FFmpegFrame();
 };
@@ -0,0 +1,161 @@
+/**************************************************************************/
+/*  ffmpeg_object_pool.h                                                  */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_OBJECT_POOL_H
+#define FFMPEG_OBJECT_POOL_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/classes/mutex.hpp>
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/core/mutex_lock.hpp>
+#include <godot_cpp/templates/local_vector.hpp>
+#include <godot_cpp/templates/safe_refcount.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
+#include "core/templates/local_vector.h"
+#include "core/templates/safe_refcount.h"
+
+#endif
+
+// Handle to an object lent out by an FFmpegObjectPool, the generation makes stale or double releases detectable.
+struct FFmpegPoolHandle {
+	uint32_t index = UINT32_MAX;
+	uint32_t generation = 0;
+
+	bool is_valid() const { return index != UINT32_MAX; }
+};
+
+// Pool of reference counted objects recycled between the decoder thread and its consumers.
+// Objects are tagged with a key (e.g. size and format for images) and only handed out again
+// once nothing but the pool references them anymore.
+template <class T>
+class FFmpegObjectPool {
+	struct Slot {
+		Ref<T> object;
+		uint64_t key = 0;
+		uint32_t generation = 1;
+		bool in_use = false;
+	};
+
+	Mutex mutex;
+	LocalVector<Slot> slots;
+	LocalVector<uint32_t> free_slots;
+	LocalVector<uint32_t> empty_slots;
+	uint32_t max_free_objects;
+	SafeNumeric<uint64_t> allocation_count;
+
+	void _lend(uint32_t p_index, FFmpegPoolHandle &r_handle) {
+		slots[p_index].in_use = true;
+		r_handle.index = p_index;
+		r_handle.generation = slots[p_index].generation;
+	}
+
+public:
+	// Returns a free object with the given key, or an invalid reference if the caller has to create one and insert() it.
+	Ref<T> acquire(uint64_t p_key, FFmpegPoolHandle &r_handle) {
+		MutexLock lock(mutex);
+		for (uint32_t i = 0; i < free_slots.size(); i++) {
+			Slot &slot = slots[free_slots[i]];
+			// A consumer that returned the object may still hold a reference for a little while.
+			if (slot.key != p_key || slot.object->get_reference_count() > 1) {
+				continue;
+			}
+			_lend(free_slots[i], r_handle);
+			free_slots.remove_at_unordered(i);
+			return slot.object;
+		}
+		r_handle = FFmpegPoolHandle();
+		return Ref<T>();
+	}
+
+	// Adds a freshly created object to the pool, already lent out to the caller.
+	FFmpegPoolHandle insert(const Ref<T> &p_object, uint64_t p_key) {
+		MutexLock lock(mutex);
+		allocation_count.increment();
+		if (free_slots.size() >= max_free_objects) {
+			// Evict the oldest free object, most likely one with a stale key.
+			uint32_t evicted = free_slots[0];
+			free_slots.remove_at(0);
+			slots[evicted].object.unref();
+			slots[evicted].generation++;
+			empty_slots.push_back(evicted);
+		}
+		uint32_t index;
+		if (empty_slots.size() > 0) {
+			index = empty_slots[empty_slots.size() - 1];
+			empty_slots.remove_at(empty_slots.size() - 1);
+		} else {
+			index = slots.size();
+			slots.push_back(Slot());
+		}
+		slots[index].object = p_object;
+		slots[index].key = p_key;
+		FFmpegPoolHandle handle;
+		_lend(index, handle);
+		return handle;
+	}
+
+	// Returns false if the handle is stale, i.e. the object was already released.
+	bool release(const FFmpegPoolHandle &p_handle) {
+		MutexLock lock(mutex);
+		ERR_FAIL_COND_V(!p_handle.is_valid() || p_handle.index >= slots.size(), false);
+		Slot &slot = slots[p_handle.index];
+		if (slot.generation != p_handle.generation || !slot.in_use) {
+			return false;
+		}
+		slot.in_use = false;
+		slot.generation++;
+		free_slots.push_back(p_handle.index);
+		return true;
+	}
+
+	// Modes that hold on to many objects at once raise this so the pool doesn't churn.
+	void set_max_free_objects(uint32_t p_max_free_objects) {
+		MutexLock lock(mutex);
+		max_free_objects = p_max_free_objects;
+	}
+
+	uint64_t get_allocation_count() const {
+		return allocation_count.get();
+	}
+
+	FFmpegObjectPool(uint32_t p_max_free_objects) {
+		max_free_objects = p_max_free_objects;
+	}
+};
+
+#endif // FFMPEG_OBJECT_POOL_H
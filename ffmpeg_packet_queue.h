@@ -0,0 +1,128 @@
+/**************************************************************************/
+/*  ffmpeg_packet_queue.h                                                 */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_PACKET_QUEUE_H
+#define FFMPEG_PACKET_QUEUE_H
+
+#include "ffmpeg_spsc_queue.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+// Bounded queue of demuxed packets feeding a single decode stage. The demuxer is the only producer and the
+// decode thread the only consumer. Packets are allocated once up front and travel back to the demuxer through
+// a second SPSC queue once decoded, so running out of free packets is what applies backpressure to the demuxer.
+class FFmpegPacketQueue {
+public:
+	enum EntryType {
+		ENTRY_PACKET,
+		// The demuxer reached the end and rewound, the decoder has to be drained and flushed.
+		ENTRY_LOOP,
+		ENTRY_END_OF_STREAM,
+		// Reverse playback: every packet of the window has been sent, its frames can be output backwards.
+		ENTRY_REVERSE_WINDOW_END,
+	};
+
+	struct Entry {
+		AVPacket *packet = nullptr;
+		EntryType type = ENTRY_PACKET;
+		// Seek serial the packet was demuxed under, and the target of that seek.
+		uint32_t serial = 0;
+		double seek_time = -1.0;
+		// Reverse playback only, frames from this time on belong to the window output before this one.
+		double end_time = -1.0;
+	};
+
+private:
+	LocalVector<AVPacket *> packets;
+	FFmpegSPSCQueue<Entry> pending;
+	FFmpegSPSCQueue<AVPacket *> free_packets;
+
+public:
+	// Demuxer side. Moves the contents of p_source (if any) into a free packet, returns false if there is none.
+	bool push(AVPacket *p_source, EntryType p_type, uint32_t p_serial, double p_seek_time, double p_end_time = -1.0) {
+		Entry entry;
+		if (!free_packets.pop(entry.packet)) {
+			return false;
+		}
+		if (p_source != nullptr) {
+			av_packet_move_ref(entry.packet, p_source);
+		}
+		entry.type = p_type;
+		entry.serial = p_serial;
+		entry.seek_time = p_seek_time;
+		entry.end_time = p_end_time;
+		// Can't fail, there are never more entries than packets.
+		pending.push(entry);
+		return true;
+	}
+
+	bool has_free_packet() const {
+		return free_packets.size() > 0;
+	}
+
+	// Decoder side. Entries must be handed back with recycle() once decoded.
+	bool pop(Entry &r_entry) {
+		return pending.pop(r_entry);
+	}
+
+	// Decoder side, the entry stays queued.
+	const Entry *peek() {
+		return pending.peek();
+	}
+
+	bool is_empty() const {
+		return pending.size() == 0;
+	}
+
+	void recycle(const Entry &p_entry) {
+		av_packet_unref(p_entry.packet);
+		free_packets.push(p_entry.packet);
+	}
+
+	FFmpegPacketQueue(uint32_t p_capacity) :
+			pending(p_capacity),
+			free_packets(p_capacity) {
+		packets.resize(p_capacity);
+		for (uint32_t i = 0; i < p_capacity; i++) {
+			packets[i] = av_packet_alloc();
+			free_packets.push(packets[i]);
+		}
+	}
+
+	~FFmpegPacketQueue() {
+		for (uint32_t i = 0; i < packets.size(); i++) {
+			av_packet_free(&packets[i]);
+		}
+	}
+};
+
+#endif // FFMPEG_PACKET_QUEUE_H
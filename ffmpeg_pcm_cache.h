@@ -0,0 +1,113 @@
+/**************************************************************************/
+/*  ffmpeg_pcm_cache.h                                                    */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_PCM_CACHE_H
+#define FFMPEG_PCM_CACHE_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/core/math.hpp>
+#include <godot_cpp/templates/local_vector.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/math/math_funcs.h"
+#include "core/object/ref_counted.h"
+#include "core/templates/local_vector.h"
+
+#endif
+
+#include <cstring>
+
+// A whole clip decoded to interleaved PCM at the mix rate, shared by every playback of a stream.
+// Never changes once created, so any number of mixing threads can read it without locking.
+class FFmpegPCMCache : public RefCounted {
+	LocalVector<float> samples;
+	// Used instead of samples when stored at 16 bit, which halves the memory.
+	LocalVector<int16_t> samples_16;
+	bool is_16_bit = false;
+	uint32_t frame_count = 0;
+	uint32_t channel_count = 0;
+	int sample_rate = 0;
+
+public:
+	// Frames converted per read() from 16 bit storage, the scratch buffer must fit this many.
+	static const uint32_t MAX_CONVERTED_FRAMES = 512;
+
+	// Points r_samples at up to p_max_frames frames starting at p_position and returns how many.
+	// 16 bit data is converted into p_scratch first, which must hold MAX_CONVERTED_FRAMES frames.
+	// Never locks nor allocates.
+	uint32_t read(uint32_t p_position, uint32_t p_max_frames, float *p_scratch, const float *&r_samples) const {
+		if (p_position >= frame_count) {
+			return 0;
+		}
+		uint32_t frames = MIN(p_max_frames, frame_count - p_position);
+		if (!is_16_bit) {
+			r_samples = samples.ptr() + p_position * channel_count;
+			return frames;
+		}
+		frames = MIN(frames, MAX_CONVERTED_FRAMES);
+		const int16_t *source = samples_16.ptr() + p_position * channel_count;
+		for (uint32_t i = 0; i < frames * channel_count; i++) {
+			p_scratch[i] = source[i] * (1.0f / 32768.0f);
+		}
+		r_samples = p_scratch;
+		return frames;
+	}
+
+	bool is_stored_16_bit() const { return is_16_bit; }
+	uint32_t get_frame_count() const { return frame_count; }
+	uint32_t get_channel_count() const { return channel_count; }
+	int get_sample_rate() const { return sample_rate; }
+	double get_length() const { return frame_count / (double)sample_rate; }
+
+	FFmpegPCMCache(const LocalVector<float> &p_samples, uint32_t p_channel_count, int p_sample_rate, bool p_16_bit) {
+		ERR_FAIL_COND(p_channel_count == 0 || p_sample_rate <= 0);
+		channel_count = p_channel_count;
+		sample_rate = p_sample_rate;
+		frame_count = p_samples.size() / p_channel_count;
+		is_16_bit = p_16_bit;
+		if (is_16_bit) {
+			samples_16.resize(frame_count * channel_count);
+			for (uint32_t i = 0; i < frame_count * channel_count; i++) {
+				samples_16[i] = (int16_t)CLAMP(Math::round(p_samples[i] * 32767.0f), -32768.0f, 32767.0f);
+			}
+		} else {
+			samples.resize(frame_count * channel_count);
+			memcpy(samples.ptr(), p_samples.ptr(), frame_count * channel_count * sizeof(float));
+		}
+	}
+};
+
+#endif // FFMPEG_PCM_CACHE_H
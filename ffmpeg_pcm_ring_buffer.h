@@ -0,0 +1,141 @@
+/**************************************************************************/
+/*  ffmpeg_pcm_ring_buffer.h                                              */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_PCM_RING_BUFFER_H
+#define FFMPEG_PCM_RING_BUFFER_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/core/error_macros.hpp>
+#include <godot_cpp/templates/local_vector.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/error/error_macros.h"
+#include "core/templates/local_vector.h"
+
+#endif
+
+#include <atomic>
+#include <cstring>
+
+// Single-producer/single-consumer ring of interleaved float samples, counted in frames of
+// get_channel_count() samples each. Neither side ever locks or allocates, only resize() does.
+// write() may only be called from the producer thread, peek(), consume() and skip_to() only from the consumer thread.
+class FFmpegPCMRingBuffer {
+	LocalVector<float> buffer;
+	uint32_t capacity = 0;
+	uint32_t channel_count = 0;
+	// Monotonic frame counters, never wrapped so they double as a sample clock for the consumer.
+	// Padded apart so the producer and the consumer don't keep invalidating each other's cache line.
+	uint8_t write_padding[64];
+	std::atomic<uint64_t> write_position = { 0 };
+	uint8_t read_padding[64];
+	std::atomic<uint64_t> read_position = { 0 };
+
+public:
+	// Only while neither side is using the buffer, drops everything in it.
+	void resize(uint32_t p_capacity_frames, uint32_t p_channel_count) {
+		ERR_FAIL_COND(p_capacity_frames == 0 || p_channel_count == 0);
+		capacity = p_capacity_frames;
+		channel_count = p_channel_count;
+		buffer.resize(p_capacity_frames * p_channel_count);
+		write_position.store(0);
+		read_position.store(0);
+	}
+
+	// Writes as many of p_frames as fit, returns how many did.
+	uint32_t write(const float *p_samples, uint32_t p_frames) {
+		if (capacity == 0) {
+			return 0;
+		}
+		uint64_t current_write = write_position.load(std::memory_order_relaxed);
+		uint32_t free_frames = capacity - (uint32_t)(current_write - read_position.load(std::memory_order_acquire));
+		uint32_t frames = MIN(p_frames, free_frames);
+		uint32_t start = current_write % capacity;
+		uint32_t first_run = MIN(frames, capacity - start);
+		memcpy(buffer.ptr() + start * channel_count, p_samples, first_run * channel_count * sizeof(float));
+		memcpy(buffer.ptr(), p_samples + first_run * channel_count, (frames - first_run) * channel_count * sizeof(float));
+		write_position.store(current_write + frames, std::memory_order_release);
+		return frames;
+	}
+
+	// Points r_samples at the next contiguous run of at most p_max_frames readable frames and
+	// returns its length. Reading past the end of the ring takes a second call after consume().
+	uint32_t peek(uint32_t p_max_frames, const float *&r_samples) const {
+		if (capacity == 0) {
+			return 0;
+		}
+		uint64_t current_read = read_position.load(std::memory_order_relaxed);
+		uint32_t readable = (uint32_t)(write_position.load(std::memory_order_acquire) - current_read);
+		uint32_t start = current_read % capacity;
+		r_samples = buffer.ptr() + start * channel_count;
+		return MIN(MIN(p_max_frames, readable), capacity - start);
+	}
+
+	void consume(uint32_t p_frames) {
+		read_position.store(read_position.load(std::memory_order_relaxed) + p_frames, std::memory_order_release);
+	}
+
+	// Drops everything written before p_position, or everything written so far if that comes first.
+	void skip_to(uint64_t p_position) {
+		uint64_t current_read = read_position.load(std::memory_order_relaxed);
+		uint64_t target = MIN(p_position, write_position.load(std::memory_order_acquire));
+		if (target > current_read) {
+			read_position.store(target, std::memory_order_release);
+		}
+	}
+
+	// Exact on the producer thread for the write position, on the consumer thread for the read position.
+	uint64_t get_write_position() const {
+		return write_position.load(std::memory_order_acquire);
+	}
+
+	uint64_t get_read_position() const {
+		return read_position.load(std::memory_order_acquire);
+	}
+
+	uint32_t get_free_frames() const {
+		return capacity - (uint32_t)(get_write_position() - get_read_position());
+	}
+
+	uint32_t get_capacity() const {
+		return capacity;
+	}
+
+	uint32_t get_channel_count() const {
+		return channel_count;
+	}
+};
+
+#endif // FFMPEG_PCM_RING_BUFFER_H
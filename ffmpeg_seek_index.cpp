@@ -0,0 +1,335 @@
+/**************************************************************************/
+/*  ffmpeg_seek_index.cpp                                                 */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#include "ffmpeg_seek_index.h"
+
+#ifdef GDEXTENSION
+#include <godot_cpp/classes/dir_access.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+#else
+#include "core/config/project_settings.h"
+#include "core/io/dir_access.h"
+#endif
+
+#include "tracy_import.h"
+
+static const char *SEEK_INDEX_CACHE_DIR = "user://ffmpeg_seek_index";
+
+static String ffmpeg_seek_index_get_error_message(int p_error_code) {
+	const uint64_t buffer_size = 256;
+	Vector<char> buffer;
+	buffer.resize(buffer_size);
+
+	int str_error_code = av_strerror(p_error_code, buffer.ptrw(), buffer.size());
+
+	if (str_error_code < 0) {
+		return vformat("%d (av_strerror failed with code %d)", p_error_code, str_error_code);
+	}
+
+	return String::utf8(buffer.ptr());
+}
+
+int FFmpegSeekIndex::_read_packet_callback(void *p_opaque, uint8_t *p_buf, int p_buf_size) {
+	FFmpegSeekIndex *index = (FFmpegSeekIndex *)p_opaque;
+	uint64_t read_bytes = index->scan_file->get_buffer(p_buf, p_buf_size);
+	return read_bytes != 0 ? read_bytes : AVERROR_EOF;
+}
+
+int64_t FFmpegSeekIndex::_stream_seek_callback(void *p_opaque, int64_t p_offset, int p_whence) {
+	FFmpegSeekIndex *index = (FFmpegSeekIndex *)p_opaque;
+	switch (p_whence) {
+		case SEEK_CUR: {
+			index->scan_file->seek(index->scan_file->get_position() + p_offset);
+		} break;
+		case SEEK_SET: {
+			index->scan_file->seek(p_offset);
+		} break;
+		case SEEK_END: {
+			index->scan_file->seek_end(p_offset);
+		} break;
+		case AVSEEK_SIZE: {
+			return index->scan_file->get_length();
+		} break;
+		default: {
+			return -1;
+		} break;
+	}
+	return index->scan_file->get_position();
+}
+
+FFmpegDecodeTask::StepResult FFmpegSeekIndex::_scan_task_func(void *p_userdata) {
+	return ((FFmpegSeekIndex *)p_userdata)->_scan_step();
+}
+
+FFmpegDecodeTask::StepResult FFmpegSeekIndex::_scan_step() {
+	ZoneScopedN("Seek index scan");
+	if (scan_format_context == nullptr && !_open_scan()) {
+		_close_scan();
+		failed.set();
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+
+	// A slice of the file per step, so the scan yields to actual decoding between steps.
+	for (int i = 0; i < PACKETS_PER_STEP; i++) {
+		int read_result = av_read_frame(scan_format_context, scan_packet);
+		if (read_result == AVERROR(EAGAIN)) {
+			return FFmpegDecodeTask::STEP_RETRY_LATER;
+		}
+		if (read_result < 0) {
+			if (read_result == AVERROR_EOF) {
+				_finish_scan();
+			} else {
+				print_line(vformat("Seek index scan of %s failed: %s", path, ffmpeg_seek_index_get_error_message(read_result)));
+				failed.set();
+			}
+			_close_scan();
+			return FFmpegDecodeTask::STEP_IDLE;
+		}
+
+		if (scan_packet->stream_index == stream_index) {
+			frame_count++;
+			int64_t pts = scan_packet->pts != AV_NOPTS_VALUE ? scan_packet->pts : scan_packet->dts;
+			if (pts != AV_NOPTS_VALUE) {
+				int64_t packet_end_pts = pts + MAX(scan_packet->duration, (int64_t)0);
+				if (end_pts == AV_NOPTS_VALUE || packet_end_pts > end_pts) {
+					end_pts = packet_end_pts;
+				}
+				if (scan_packet->flags & AV_PKT_FLAG_KEY) {
+					Keyframe keyframe;
+					keyframe.pts = pts;
+					keyframe.pos = scan_packet->pos;
+					keyframes.push_back(keyframe);
+				}
+			}
+		}
+		av_packet_unref(scan_packet);
+	}
+	return FFmpegDecodeTask::STEP_CONTINUE;
+}
+
+bool FFmpegSeekIndex::_open_scan() {
+	scan_file = FileAccess::open(path, FileAccess::READ);
+	ERR_FAIL_COND_V_MSG(scan_file.is_null(), false, vformat("Couldn't open %s to build its seek index.", path));
+
+	const int context_buffer_size = 4096;
+	unsigned char *context_buffer = (unsigned char *)av_malloc(context_buffer_size);
+	scan_io_context = avio_alloc_context(context_buffer, context_buffer_size, 0, this, &FFmpegSeekIndex::_read_packet_callback, nullptr, &FFmpegSeekIndex::_stream_seek_callback);
+
+	scan_format_context = avformat_alloc_context();
+	scan_format_context->pb = scan_io_context;
+	// Same as the playback demuxer, so both see the same streams and timestamps.
+	scan_format_context->flags |= AVFMT_FLAG_GENPTS;
+	int open_input_res = avformat_open_input(&scan_format_context, "dummy", nullptr, nullptr);
+	ERR_FAIL_COND_V_MSG(open_input_res < 0, false, vformat("Error opening %s for its seek index: %s", path, ffmpeg_seek_index_get_error_message(open_input_res)));
+	int find_stream_info_result = avformat_find_stream_info(scan_format_context, nullptr);
+	ERR_FAIL_COND_V_MSG(find_stream_info_result < 0, false, vformat("Error finding stream info: %s", ffmpeg_seek_index_get_error_message(find_stream_info_result)));
+	ERR_FAIL_INDEX_V((unsigned int)stream_index, scan_format_context->nb_streams, false);
+	ERR_FAIL_COND_V(scan_format_context->streams[stream_index]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO, false);
+
+	// Only the video stream's packet headers are needed, the demuxer can skip over everything else.
+	for (unsigned int i = 0; i < scan_format_context->nb_streams; i++) {
+		if ((int)i != stream_index) {
+			scan_format_context->streams[i]->discard = AVDISCARD_ALL;
+		}
+	}
+	scan_packet = av_packet_alloc();
+	return true;
+}
+
+void FFmpegSeekIndex::_finish_scan() {
+	keyframes.sort();
+
+	// Whatever the demuxer indexed while reading the whole file is exactly what its own seeking
+	// would have built up by scanning, e.g. the cluster positions of an MKV without cues.
+	AVStream *stream = scan_format_context->streams[stream_index];
+	int entry_count = avformat_index_get_entries_count(stream);
+	for (int i = 0; i < entry_count; i++) {
+		const AVIndexEntry *index_entry = avformat_index_get_entry(stream, i);
+		if (index_entry->flags & AVINDEX_KEYFRAME) {
+			DemuxerEntry entry;
+			entry.timestamp = index_entry->timestamp;
+			entry.pos = index_entry->pos;
+			demuxer_entries.push_back(entry);
+		}
+	}
+
+	_save_cache();
+	ready.set();
+}
+
+void FFmpegSeekIndex::_close_scan() {
+	if (scan_packet != nullptr) {
+		av_packet_free(&scan_packet);
+	}
+	if (scan_format_context != nullptr) {
+		// avformat_open_input frees the context itself when it fails.
+		avformat_close_input(&scan_format_context);
+	}
+	if (scan_io_context != nullptr) {
+		av_free(scan_io_context->buffer);
+		avio_context_free(&scan_io_context);
+	}
+	scan_file.unref();
+}
+
+bool FFmpegSeekIndex::_load_cache() {
+	Ref<FileAccess> file = FileAccess::open(cache_path, FileAccess::READ);
+	if (file.is_null()) {
+		return false;
+	}
+	if (file->get_32() != CACHE_MAGIC || file->get_32() != CACHE_VERSION) {
+		return false;
+	}
+	// The source changed since it was indexed.
+	if (file->get_64() != source_length || file->get_64() != source_modified_time || (int)file->get_32() != stream_index) {
+		return false;
+	}
+	frame_count = file->get_64();
+	end_pts = file->get_64();
+
+	uint32_t keyframe_count = file->get_32();
+	if (file->get_position() + keyframe_count * 16ull > file->get_length()) {
+		return false;
+	}
+	keyframes.resize(keyframe_count);
+	for (uint32_t i = 0; i < keyframe_count; i++) {
+		keyframes[i].pts = file->get_64();
+		keyframes[i].pos = file->get_64();
+	}
+
+	uint32_t entry_count = file->get_32();
+	if (file->get_position() + entry_count * 16ull != file->get_length()) {
+		keyframes.clear();
+		return false;
+	}
+	demuxer_entries.resize(entry_count);
+	for (uint32_t i = 0; i < entry_count; i++) {
+		demuxer_entries[i].timestamp = file->get_64();
+		demuxer_entries[i].pos = file->get_64();
+	}
+	return true;
+}
+
+void FFmpegSeekIndex::_save_cache() const {
+	if (!DirAccess::dir_exists_absolute(SEEK_INDEX_CACHE_DIR)) {
+		DirAccess::make_dir_recursive_absolute(SEEK_INDEX_CACHE_DIR);
+	}
+	Ref<FileAccess> file = FileAccess::open(cache_path, FileAccess::WRITE);
+	ERR_FAIL_COND_MSG(file.is_null(), vformat("Couldn't write the seek index cache %s.", cache_path));
+	file->store_32(CACHE_MAGIC);
+	file->store_32(CACHE_VERSION);
+	file->store_64(source_length);
+	file->store_64(source_modified_time);
+	file->store_32(stream_index);
+	file->store_64(frame_count);
+	file->store_64(end_pts);
+	file->store_32(keyframes.size());
+	for (const Keyframe &keyframe : keyframes) {
+		file->store_64(keyframe.pts);
+		file->store_64(keyframe.pos);
+	}
+	file->store_32(demuxer_entries.size());
+	for (const DemuxerEntry &entry : demuxer_entries) {
+		file->store_64(entry.timestamp);
+		file->store_64(entry.pos);
+	}
+}
+
+Ref<FFmpegSeekIndex> FFmpegSeekIndex::open(const String &p_path, uint64_t p_length, int p_stream_index) {
+	// Files opened from memory or a pack have no path to reopen them with.
+	if (p_path.is_empty() || p_stream_index < 0) {
+		return Ref<FFmpegSeekIndex>();
+	}
+	FFmpegDecodeScheduler *scheduler = FFmpegDecodeScheduler::get_singleton();
+	ERR_FAIL_NULL_V(scheduler, Ref<FFmpegSeekIndex>());
+
+	Ref<FFmpegSeekIndex> index;
+	index.instantiate();
+	index->path = p_path;
+	index->stream_index = p_stream_index;
+	index->source_length = p_length;
+	index->source_modified_time = FileAccess::get_modified_time(p_path);
+	String global_path = ProjectSettings::get_singleton()->globalize_path(p_path).simplify_path();
+	index->cache_path = String(SEEK_INDEX_CACHE_DIR).path_join(global_path.md5_text() + ".idx");
+
+	if (index->_load_cache()) {
+		index->ready.set();
+		return index;
+	}
+
+	// Lowest priority, the scan must never hold up a stream that's being watched.
+	index->task = memnew(FFmpegDecodeTask(_scan_task_func, index.ptr(), FFmpegDecodeScheduler::PRIORITY_OFFSCREEN));
+	scheduler->signal(index->task);
+	return index;
+}
+
+bool FFmpegSeekIndex::is_ready() const {
+	return ready.is_set();
+}
+
+bool FFmpegSeekIndex::find_keyframe(int64_t p_pts, Keyframe &r_keyframe) const {
+	ERR_FAIL_COND_V(!ready.is_set(), false);
+	if (keyframes.is_empty() || p_pts < keyframes[0].pts) {
+		return false;
+	}
+	// Last keyframe with pts <= p_pts.
+	uint32_t low = 0;
+	uint32_t high = keyframes.size();
+	while (high - low > 1) {
+		uint32_t middle = low + (high - low) / 2;
+		if (keyframes[middle].pts <= p_pts) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	r_keyframe = keyframes[low];
+	return true;
+}
+
+const LocalVector<FFmpegSeekIndex::DemuxerEntry> &FFmpegSeekIndex::get_demuxer_entries() const {
+	return demuxer_entries;
+}
+
+int64_t FFmpegSeekIndex::get_frame_count() const {
+	return ready.is_set() ? frame_count : -1;
+}
+
+int64_t FFmpegSeekIndex::get_end_pts() const {
+	return ready.is_set() ? end_pts : AV_NOPTS_VALUE;
+}
+
+FFmpegSeekIndex::~FFmpegSeekIndex() {
+	if (task != nullptr) {
+		FFmpegDecodeScheduler::get_singleton()->cancel(task);
+		memdelete(task);
+	}
+	_close_scan();
+}
@@ -0,0 +1,132 @@
+/**************************************************************************/
+/*  ffmpeg_seek_index.h                                                   */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_SEEK_INDEX_H
+#define FFMPEG_SEEK_INDEX_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/godot.hpp>
+#include <godot_cpp/templates/local_vector.hpp>
+#include <godot_cpp/templates/safe_refcount.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/io/file_access.h"
+#include "core/object/ref_counted.h"
+#include "core/templates/local_vector.h"
+#include "core/templates/safe_refcount.h"
+
+#endif
+
+#include "ffmpeg_decode_scheduler.h"
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+// Keyframe positions of a file's video stream, found by reading through its packets once in the
+// background and cached in user:// so later opens of the same file get it for free. Containers
+// without an index of their own (MPEG-TS, MKV without cues, camera dumps) can then seek straight
+// to the right GOP, and VFR content gets an exact frame count and duration.
+class FFmpegSeekIndex : public RefCounted {
+public:
+	struct Keyframe {
+		int64_t pts = AV_NOPTS_VALUE;
+		// Byte offset of the keyframe packet, -1 if the demuxer didn't report one.
+		int64_t pos = -1;
+
+		bool operator<(const Keyframe &p_other) const { return pts < p_other.pts; }
+	};
+	// An entry of the index the demuxer itself built while reading, in its own units. These are fed
+	// back to it so its timestamp seeks don't have to scan the file.
+	struct DemuxerEntry {
+		int64_t timestamp = 0;
+		int64_t pos = 0;
+	};
+
+private:
+	static const uint32_t CACHE_MAGIC = 0x58495346; // "FSIX"
+	static const uint32_t CACHE_VERSION = 1;
+	static const int PACKETS_PER_STEP = 256;
+
+	String path;
+	String cache_path;
+	int stream_index = -1;
+	uint64_t source_length = 0;
+	uint64_t source_modified_time = 0;
+
+	// Written by the scan task only, read-only once ready is set.
+	LocalVector<Keyframe> keyframes;
+	LocalVector<DemuxerEntry> demuxer_entries;
+	int64_t frame_count = 0;
+	int64_t end_pts = AV_NOPTS_VALUE;
+	SafeFlag ready;
+	SafeFlag failed;
+
+	// Scan state, the scan has its own file and demuxer so it never gets in the way of playback.
+	FFmpegDecodeTask *task = nullptr;
+	Ref<FileAccess> scan_file;
+	AVIOContext *scan_io_context = nullptr;
+	AVFormatContext *scan_format_context = nullptr;
+	AVPacket *scan_packet = nullptr;
+
+	static int _read_packet_callback(void *p_opaque, uint8_t *p_buf, int p_buf_size);
+	static int64_t _stream_seek_callback(void *p_opaque, int64_t p_offset, int p_whence);
+	static FFmpegDecodeTask::StepResult _scan_task_func(void *p_userdata);
+	FFmpegDecodeTask::StepResult _scan_step();
+	bool _open_scan();
+	void _finish_scan();
+	void _close_scan();
+	bool _load_cache();
+	void _save_cache() const;
+
+public:
+	// Loads the cached index of p_path, or starts building it in the background. Returns an invalid
+	// Ref if p_path can't be indexed.
+	static Ref<FFmpegSeekIndex> open(const String &p_path, uint64_t p_length, int p_stream_index);
+
+	bool is_ready() const;
+	// Finds the last keyframe at or before p_pts. Only valid once ready.
+	bool find_keyframe(int64_t p_pts, Keyframe &r_keyframe) const;
+	const LocalVector<DemuxerEntry> &get_demuxer_entries() const;
+	// Number of video packets in the stream, -1 until ready.
+	int64_t get_frame_count() const;
+	// Presentation time where the last frame ends, in stream time base. AV_NOPTS_VALUE until ready.
+	int64_t get_end_pts() const;
+
+	~FFmpegSeekIndex();
+};
+
+#endif // FFMPEG_SEEK_INDEX_H
@@ -0,0 +1,118 @@
+/**************************************************************************/
+/*  ffmpeg_spsc_queue.h                                                   */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef FFMPEG_SPSC_QUEUE_H
+#define FFMPEG_SPSC_QUEUE_H
+
+#ifdef GDEXTENSION
+
+// Headers for building as GDExtension plug-in.
+#include <godot_cpp/core/error_macros.hpp>
+#include <godot_cpp/templates/local_vector.hpp>
+
+using namespace godot;
+
+#else
+
+#include "core/error/error_macros.h"
+#include "core/templates/local_vector.h"
+
+#endif
+
+#include <atomic>
+
+// Bounded single-producer/single-consumer ring buffer, neither side ever locks or allocates.
+// push() may only be called from the producer thread, peek() and pop() only from the consumer thread.
+template <class T>
+class FFmpegSPSCQueue {
+	LocalVector<T> buffer;
+	uint32_t capacity = 0;
+	// Monotonic counters, the slot is the counter modulo capacity. Padded apart so the producer
+	// and the consumer don't keep invalidating each other's cache line.
+	uint8_t head_padding[64];
+	std::atomic<uint32_t> head = { 0 };
+	uint8_t tail_padding[64];
+	std::atomic<uint32_t> tail = { 0 };
+
+public:
+	// Returns false if the queue is full.
+	bool push(const T &p_value) {
+		uint32_t current_head = head.load(std::memory_order_relaxed);
+		if (current_head - tail.load(std::memory_order_acquire) >= capacity) {
+			return false;
+		}
+		buffer[current_head % capacity] = p_value;
+		head.store(current_head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns the oldest element without removing it, or nullptr if the queue is empty.
+	T *peek() {
+		uint32_t current_tail = tail.load(std::memory_order_relaxed);
+		if (current_tail == head.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &buffer[current_tail % capacity];
+	}
+
+	bool pop(T &r_value) {
+		uint32_t current_tail = tail.load(std::memory_order_relaxed);
+		if (current_tail == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		T &slot = buffer[current_tail % capacity];
+		r_value = slot;
+		// Don't keep references alive in the ring, pooled objects are only recycled once released.
+		slot = T();
+		tail.store(current_tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate when called from a thread other than the producer or the consumer.
+	uint32_t size() const {
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+	bool is_full() const {
+		return size() >= capacity;
+	}
+
+	uint32_t get_capacity() const {
+		return capacity;
+	}
+
+	FFmpegSPSCQueue(uint32_t p_capacity) {
+		ERR_FAIL_COND(p_capacity == 0);
+		capacity = p_capacity;
+		buffer.resize(p_capacity);
+	}
+};
+
+#endif // FFMPEG_SPSC_QUEUE_H
@@ -32,19 +32,50 @@
 
 #ifdef GDEXTENSION
 #include "gdextension_build/gdex_print.h"
+#include <godot_cpp/classes/audio_server.hpp>
+#else
+#include "servers/audio_server.h"
 #endif
 
 #include "tracy_import.h"
 
+static const char *yuv_shader_code = R"(
+shader_type canvas_item;
+
+// TEXTURE is the luma plane, chroma_texture holds U (or interleaved UV for NV12) and chroma_v_texture holds V.
+uniform sampler2D chroma_texture : filter_linear;
+uniform sampler2D chroma_v_texture : filter_linear;
+uniform bool nv12 = false;
+uniform bool full_range = false;
+uniform bool bt709 = true;
+
+void fragment() {
+	float y = texture(TEXTURE, UV).r;
+	vec2 uv;
+	if (nv12) {
+		uv = texture(chroma_texture, UV).rg;
+	} else {
+		uv = vec2(texture(chroma_texture, UV).r, texture(chroma_v_texture, UV).r);
+	}
+	if (full_range) {
+		uv -= 0.5;
+	} else {
+		y = (y * 255.0 - 16.0) / 219.0;
+		uv = (uv * 255.0 - 128.0) / 224.0;
+	}
+	vec3 rgb;
+	if (bt709) {
+		rgb = vec3(y + 1.5748 * uv.y, y - 0.1873 * uv.x - 0.4681 * uv.y, y + 1.8556 * uv.x);
+	} else {
+		rgb = vec3(y + 1.402 * uv.y, y - 0.344136 * uv.x - 0.714136 * uv.y, y + 1.772 * uv.x);
+	}
+	COLOR = vec4(clamp(rgb, 0.0, 1.0), COLOR.a);
+}
+)";
+
 void FFmpegVideoStreamPlayback::seek_into_sync() {
+	// Frames still queued from before the seek are dropped and recycled by the decoder.
 	decoder->seek(playback_position);
-	Vector<Ref<DecodedFrame>> decoded_frames;
-	for (Ref<DecodedFrame> df : available_frames) {
-		decoded_frames.push_back(df);
-	}
-	decoder->return_frames(decoded_frames);
-	available_frames.clear();
-	available_audio_frames.clear();
 }
 
 double FFmpegVideoStreamPlayback::get_current_frame_time() {
@@ -55,21 +86,113 @@ double FFmpegVideoStreamPlayback::get_current_frame_time() {
 }
 
 bool FFmpegVideoStreamPlayback::check_next_frame_valid(Ref<DecodedFrame> p_decoded_frame) {
+	// Live streams have no timeline to keep in sync with, the newest frame is always the right one.
+	if (decoder->is_live()) {
+		return true;
+	}
 	// in the case of looping, we may start a seek back to the beginning but still receive some lingering frames from the end of the last loop. these should be allowed to continue playing.
-	// if (looping && Math::abs((p_decoded_frame->get_time() - decoder->get_duration()) - playback_position) < LENIENCE_BEFORE_SEEK)
-	// 	return true;
+	if (looping && Math::abs((p_decoded_frame->get_time() - decoder->get_duration()) - playback_position) < LENIENCE_BEFORE_SEEK)
+		return true;
 
-	// return p_decoded_frame->get_time() <= playback_position && Math::abs(p_decoded_frame->get_time() - playback_position) < LENIENCE_BEFORE_SEEK;
-	//@DEBUG IVAN
-	return true;
+	// Late frames are let through so the ones behind them get a chance to catch up, only the newest one is shown.
+	if (decoder->is_reverse()) {
+		return p_decoded_frame->get_time() >= playback_position;
+	}
+	return p_decoded_frame->get_time() <= playback_position;
 }
 
-bool FFmpegVideoStreamPlayback::check_next_audio_frame_valid(Ref<DecodedAudioFrame> p_decoded_frame) {
-	// in the case of looping, we may start a seek back to the beginning but still receive some lingering frames from the end of the last loop. these should be allowed to continue playing.
-	if (looping && Math::abs((p_decoded_frame->get_time() - decoder->get_duration()) - playback_position) < LENIENCE_BEFORE_SEEK)
-		return true;
+void FFmpegVideoStreamPlayback::_mix_audio_frames() {
+#ifndef GDEXTENSION
+	if (!mix_callback) {
+		return;
+	}
+#endif
+	int channel_count = decoder->get_audio_channel_count();
+	int mix_rate = decoder->get_audio_mix_rate();
+	if (channel_count <= 0 || mix_rate <= 0) {
+		return;
+	}
+	// Time stretched audio covers more media time per sample.
+	double media_msec_per_sample = 1000.0 * decoder->get_playback_speed() / mix_rate;
 
-	return p_decoded_frame->get_time() <= playback_position && Math::abs(p_decoded_frame->get_time() - playback_position) < LENIENCE_BEFORE_SEEK;
+	// Audio is handed over as far ahead as the player takes it, the player's buffer decides the pace
+	// instead of our idea of the current time.
+	Ref<DecodedAudioFrame> audio_frame;
+	while (decoder->peek_decoded_audio_frame(audio_frame)) {
+		ZoneNamedN(__audio_mix, "Audio mix", true);
+		if (audio_frame != audio_mix_frame) {
+			audio_mix_frame = audio_frame;
+			audio_mix_frame_offset = 0;
+		}
+		int sample_count = audio_frame->get_sample_data().size() / channel_count;
+
+		// Without audio queued the clock is the wall clock, audio that is already way behind it would only drag the video back.
+		if (!audio_clock_active && audio_frame->get_time() + sample_count * media_msec_per_sample < playback_position - AV_RESYNC_THRESHOLD) {
+			decoder->pop_decoded_audio_frame(audio_frame);
+			audio_mix_frame.unref();
+			continue;
+		}
+
+		int remaining = sample_count - audio_mix_frame_offset;
+		int accepted = 0;
+		if (remaining > 0) {
+#ifdef GDEXTENSION
+			accepted = mix_audio(remaining, audio_frame->get_sample_data(), audio_mix_frame_offset * channel_count);
+#else
+			accepted = mix_callback(mix_udata, audio_frame->get_sample_data().ptr() + audio_mix_frame_offset * channel_count, remaining);
+#endif
+			if (accepted < 0) {
+				// Nobody is listening.
+				return;
+			}
+		}
+		if (accepted > 0) {
+			audio_mix_frame_offset += accepted;
+			audio_sink_frames += accepted;
+			audio_clock_end_time = audio_frame->get_time() + audio_mix_frame_offset * media_msec_per_sample;
+		}
+		if (accepted < remaining) {
+			// The player's buffer is full, this is the one moment we know exactly how much it holds.
+			audio_sink_capacity = MAX(audio_sink_capacity, audio_sink_frames);
+			audio_sink_frames = audio_sink_capacity;
+			break;
+		}
+		decoder->pop_decoded_audio_frame(audio_frame);
+		audio_mix_frame.unref();
+	}
+}
+
+void FFmpegVideoStreamPlayback::_sync_to_audio_clock() {
+	int mix_rate = decoder->get_audio_mix_rate();
+	audio_clock_active = audio_clock_end_time >= 0.0 && audio_sink_frames > 0.0 && mix_rate > 0;
+	if (!audio_clock_active) {
+		av_drift = 0.0;
+		return;
+	}
+	// What the speakers play right now is behind what we handed over by the player's buffer and the output latency.
+	double queued_sec = audio_sink_frames / mix_rate + AudioServer::get_singleton()->get_output_latency();
+	double audio_clock = audio_clock_end_time - queued_sec * 1000.0 * decoder->get_playback_speed();
+
+	av_drift = audio_clock - playback_position;
+	if (Math::abs(av_drift) > AV_RESYNC_THRESHOLD) {
+		playback_position = audio_clock;
+		av_resync_count++;
+	} else if (Math::abs(av_drift) > AV_SYNC_THRESHOLD) {
+		// Eased in over a few updates so the video doesn't visibly stutter.
+		double correction = av_drift * AV_CORRECTION_RATE;
+		playback_position += correction;
+		av_correction += Math::abs(correction);
+	}
+	playback_position = MAX(playback_position, 0.0);
+}
+
+void FFmpegVideoStreamPlayback::_reset_audio_clock() {
+	// Samples already in the player's buffer still play, so audio_sink_frames is kept.
+	audio_clock_end_time = -1.0;
+	audio_mix_frame.unref();
+	audio_mix_frame_offset = 0;
+	audio_clock_active = false;
+	av_drift = 0.0;
 }
 
 const char *const upd_str = "update_internal";
@@ -77,10 +200,41 @@ const char *const upd_str = "update_internal";
 void FFmpegVideoStreamPlayback::update_internal(double p_delta) {
 	ZoneScopedN("update_internal");
 
+	// Checked even while paused, scrubbing a paused video is when the landing position matters most.
+	uint32_t landed_seek_serial = decoder.is_valid() ? decoder->get_landed_seek_serial() : reported_seek_serial;
+	if (landed_seek_serial != reported_seek_serial) {
+		reported_seek_serial = landed_seek_serial;
+		emit_signal("seek_completed", decoder->get_seek_landing_time() / 1000.0);
+	}
+
 	if (paused || !playing) {
 		return;
 	}
-	playback_position += p_delta * 1000.0f;
+	if (shared_decoder.is_valid()) {
+		// Every subscriber follows the shared decoder's clock, it paces the frames it publishes.
+		playback_position = shared_decoder->advance_clock(p_delta);
+	} else {
+		double media_delta = p_delta * 1000.0 * decoder->get_playback_speed();
+		if (decoder->is_reverse()) {
+			playback_position = MAX(playback_position - media_delta, 0.0);
+		} else {
+			playback_position += media_delta;
+		}
+	}
+
+	// The player's audio buffer drains while we aren't paused.
+	audio_sink_frames = MAX(audio_sink_frames - p_delta * decoder->get_audio_mix_rate(), 0.0);
+
+	// Only one subscriber of a shared decoder plays its audio, otherwise it would be mixed once per player.
+	bool owns_audio = shared_decoder.is_null() || shared_decoder->claim_audio(this);
+	if (owns_audio && !decoder->is_reverse()) {
+		_mix_audio_frames();
+	}
+	_sync_to_audio_clock();
+	if (shared_decoder.is_valid() && owns_audio && audio_clock_active) {
+		// The subscriber playing the audio keeps the shared clock in sync with it.
+		shared_decoder->set_clock_position(playback_position);
+	}
 
 //#DEBUG
 	// if (decoder->get_decoder_state() == VideoDecoder::DecoderState::END_OF_STREAM && available_frames.size() == 0) {
@@ -92,10 +246,15 @@ void FFmpegVideoStreamPlayback::update_internal(double p_delta) {
 	// 	}
 	// }
 
-	Ref<DecodedFrame> peek_frame = available_frames.size() > 0 ? available_frames[0] : nullptr;
+	Ref<DecodedFrame> peek_frame;
+	// A shared decoder's frame queue is only consumed by FFmpegSharedDecoder.
+	if (shared_decoder.is_null()) {
+		decoder->peek_decoded_frame(peek_frame);
+	}
 	bool out_of_sync = false;
 
-	if (peek_frame.is_valid()) {
+	// Live streams have no timeline to keep in sync with, the newest frame is always the right one.
+	if (peek_frame.is_valid() && !decoder->is_live()) {
 		out_of_sync = Math::abs(playback_position - peek_frame->get_time()) > LENIENCE_BEFORE_SEEK;
 
 		if (looping) {
@@ -114,111 +273,272 @@ void FFmpegVideoStreamPlayback::update_internal(double p_delta) {
 
 	bool got_new_frame = false;
 
-	while (available_frames.size() > 0 && check_next_frame_valid(available_frames[0])) {
+	Ref<DecodedFrame> next_frame;
+	if (shared_decoder.is_valid()) {
+		uint64_t frame_serial = 0;
+		next_frame = shared_decoder->get_latest_frame(frame_serial);
+		if (next_frame.is_valid() && frame_serial != shared_frame_serial) {
+			ZoneNamedN(__frame_receive, "frame_receive", true);
+			// Shared frames are returned to the decoder by FFmpegSharedDecoder, not by us.
+			shared_frame_serial = frame_serial;
+			last_frame = next_frame;
+			last_frame_image = last_frame->get_image();
+#ifdef FFMPEG_MT_GPU_UPLOAD
+			last_frame_texture = last_frame->get_texture();
+#endif
+			got_new_frame = true;
+		}
+	}
+	while (shared_decoder.is_null() && decoder->peek_decoded_frame(next_frame) && check_next_frame_valid(next_frame)) {
 		ZoneNamedN(__frame_receive, "frame_receive", true);
 
 		if (last_frame.is_valid()) {
 			decoder->return_frame(last_frame);
 		}
-		last_frame = available_frames[0];
+		decoder->pop_decoded_frame(last_frame);
 		last_frame_image = last_frame->get_image();
 #ifdef FFMPEG_MT_GPU_UPLOAD
 		last_frame_texture = last_frame->get_texture();
 #endif
-		available_frames.pop_front();
 		got_new_frame = true;
 	}
 #ifndef FFMPEG_MT_GPU_UPLOAD
-	if (got_new_frame) {
-		if (texture.is_valid()) {
-			if (texture->get_size() != last_frame_image->get_size() || texture->get_format() != last_frame_image->get_format()) {
-				ZoneNamedN(__img_upate_slow, "Image update slow", true);
-				texture->set_image(last_frame_image); // should never happen, but life has many doors ed-boy...
-			} else {
-				ZoneNamedN(__img_upate_fast, "Image update fast", true);
-				texture->update(last_frame_image);
-			}
+	if (got_new_frame && texture.is_valid()) {
+		_update_texture(texture, last_frame_image);
+		if (last_frame->get_plane_layout() != DecodedFrame::PLANE_LAYOUT_RGBA) {
+			_update_yuv_textures();
 		}
 	}
 #endif
 
-	if (available_frames.size() == 0) {
-		for (Ref<DecodedFrame> frame : decoder->get_decoded_frames()) {
-			available_frames.push_back(frame);
-		}
+	if (shared_decoder.is_valid()) {
+		buffering = decoder->is_running() && last_frame.is_null();
+	} else {
+		buffering = decoder->is_running() && !decoder->peek_decoded_frame(next_frame);
 	}
 
-	Ref<DecodedAudioFrame> peek_audio_frame;
-	if (available_audio_frames.size() > 0) {
-		peek_audio_frame = available_audio_frames[0];
+	if (frame_time != get_current_frame_time()) {
+		frames_processed++;
 	}
+}
 
-	bool audio_out_of_sync = false;
-
-	if (peek_audio_frame.is_valid()) {
-		audio_out_of_sync = Math::abs(playback_position - peek_audio_frame->get_time()) > LENIENCE_BEFORE_SEEK;
-
-		if (looping) {
-			out_of_sync &= Math::abs(playback_position - decoder->get_duration() - peek_audio_frame->get_time()) > LENIENCE_BEFORE_SEEK &&
-					Math::abs(playback_position + decoder->get_duration() - peek_audio_frame->get_time()) > LENIENCE_BEFORE_SEEK;
-		}
+void FFmpegVideoStreamPlayback::_update_texture(Ref<ImageTexture> &p_texture, const Ref<Image> &p_image) {
+	if (!p_image.is_valid()) {
+		return;
 	}
-
-	if (audio_out_of_sync) {
-		// TODO: seek audio stream individually if it desyncs
+	if (!p_texture.is_valid()) {
+		ZoneNamedN(__img_create, "Image texture create", true);
+		p_texture = ImageTexture::create_from_image(p_image);
+	} else if (p_texture->get_size() != p_image->get_size() || p_texture->get_format() != p_image->get_format()) {
+		ZoneNamedN(__img_upate_slow, "Image update slow", true);
+		p_texture->set_image(p_image); // should never happen, but life has many doors ed-boy...
+	} else {
+		ZoneNamedN(__img_upate_fast, "Image update fast", true);
+		p_texture->update(p_image);
 	}
+}
 
-	while (available_audio_frames.size() > 0 && check_next_audio_frame_valid(available_audio_frames[0])) {
-		ZoneNamedN(__audio_mix, "Audio mix", true);
-		Ref<DecodedAudioFrame> audio_frame = available_audio_frames[0];
-		int sample_count = audio_frame->get_sample_data().size() / decoder->get_audio_channel_count();
+void FFmpegVideoStreamPlayback::_update_yuv_textures() {
+	_update_texture(chroma_texture, last_frame->get_chroma_image());
+	_update_texture(chroma_v_texture, last_frame->get_chroma_v_image());
+	if (!yuv_material.is_valid()) {
+		return;
+	}
+	bool nv12 = last_frame->get_plane_layout() == DecodedFrame::PLANE_LAYOUT_NV12;
+	yuv_material->set_shader_parameter("chroma_texture", chroma_texture);
+	yuv_material->set_shader_parameter("chroma_v_texture", nv12 ? Ref<ImageTexture>() : chroma_v_texture);
+	yuv_material->set_shader_parameter("nv12", nv12);
+	yuv_material->set_shader_parameter("full_range", last_frame->is_full_range());
+	yuv_material->set_shader_parameter("bt709", last_frame->is_bt709());
+}
 
+void FFmpegVideoStreamPlayback::_create_textures() {
+	if (decoder->get_decoder_state() == VideoDecoder::FAULTED) {
+		return;
+	}
+	Vector2i size = decoder->get_output_size();
+	// In YUV mode the main texture is the luma plane, chroma textures are created with the first frame.
+	Image::Format format = decoder->get_output_format() == VideoDecoder::OUTPUT_FORMAT_YUV ? Image::FORMAT_R8 : Image::FORMAT_RGBA8;
 #ifdef GDEXTENSION
-		mix_audio(sample_count, audio_frame->get_sample_data(), 0);
+	texture = ImageTexture::create_from_image(Image::create(size.x, size.y, false, format));
 #else
-		mix_callback(mix_udata, audio_frame->get_sample_data().ptr(), sample_count);
+	texture = ImageTexture::create_from_image(Image::create_empty(size.x, size.y, false, format));
 #endif
-		available_audio_frames.pop_front();
-	}
-	if (available_audio_frames.size() == 0) {
-		for (Ref<DecodedAudioFrame> frame : decoder->get_decoded_audio_frames()) {
-			available_audio_frames.push_back(frame);
+}
+
+void FFmpegVideoStreamPlayback::load(Ref<FileAccess> p_file_access, VideoDecoder::OutputFormat p_output_format, bool p_live) {
+	decoder = Ref<VideoDecoder>(memnew(VideoDecoder(p_file_access)));
+	decoder->set_output_format(p_output_format);
+	decoder->set_live(p_live);
+	decoder->set_audio_channel_mode(audio_channel_mode);
+
+	decoder->start_decoding();
+	_create_textures();
+}
+
+void FFmpegVideoStreamPlayback::load_from_url(const String &p_path, VideoDecoder::OutputFormat p_output_format, bool p_live) {
+	decoder = Ref<VideoDecoder>(memnew(VideoDecoder(p_path)));
+	decoder->set_output_format(p_output_format);
+	decoder->set_live(p_live);
+	decoder->set_audio_channel_mode(audio_channel_mode);
+
+	decoder->start_decoding();
+	_create_textures();
+}
+
+bool FFmpegVideoStreamPlayback::load_shared(const String &p_path, VideoDecoder::OutputFormat p_output_format, bool p_live, Vector2i p_target_size, bool p_fit, VideoDecoder::ScaleFilter p_filter) {
+	FFmpegDecoderRegistry *registry = FFmpegDecoderRegistry::get_singleton();
+	ERR_FAIL_NULL_V(registry, false);
+
+	String key = FFmpegDecoderRegistry::make_key(p_path, p_output_format, p_live, p_target_size, p_fit, p_filter);
+	shared_decoder = registry->subscribe(key);
+	if (shared_decoder.is_null()) {
+		Ref<VideoDecoder> new_decoder;
+		if (p_path.find("://") != -1 && !p_path.begins_with("res://") && !p_path.begins_with("user://")) {
+			new_decoder = Ref<VideoDecoder>(memnew(VideoDecoder(p_path)));
+		} else {
+			Ref<FileAccess> fa = FileAccess::open(p_path, FileAccess::READ);
+			if (!fa.is_valid()) {
+				return false;
+			}
+			new_decoder = Ref<VideoDecoder>(memnew(VideoDecoder(fa)));
 		}
+		new_decoder->set_output_format(p_output_format);
+		new_decoder->set_live(p_live);
+		new_decoder->set_audio_channel_mode(audio_channel_mode);
+		new_decoder->set_target_size(p_target_size, p_fit);
+		new_decoder->set_scale_filter(p_filter);
+		new_decoder->start_decoding();
+		// Lost a race with another playback opening the same source, its decoder is used instead.
+		shared_decoder = registry->subscribe(key, new_decoder);
 	}
 
-	buffering = decoder->is_running() && available_frames.size() == 0;
+	decoder = shared_decoder->get_decoder();
+	_create_textures();
+	return true;
+}
 
-	if (frame_time != get_current_frame_time()) {
-		frames_processed++;
+bool FFmpegVideoStreamPlayback::_can_control_decoder() const {
+	// Seeking a shared decoder would yank the other subscribers along, so it's only allowed
+	// while we are its sole user.
+	return shared_decoder.is_null() || shared_decoder->get_subscriber_count() == 1;
+}
+
+void FFmpegVideoStreamPlayback::set_yuv_shader(const Ref<Shader> &p_shader) {
+	ERR_FAIL_COND(p_shader.is_null());
+	yuv_material.instantiate();
+	yuv_material->set_shader(p_shader);
+}
+
+Ref<ShaderMaterial> FFmpegVideoStreamPlayback::get_yuv_material() const {
+	return yuv_material;
+}
+
+void FFmpegVideoStreamPlayback::set_audio_channel_mode(FFmpegAudioResampler::ChannelMode p_mode) {
+	ERR_FAIL_COND_MSG(decoder.is_valid(), "The audio channel mode has to be set before loading.");
+	audio_channel_mode = p_mode;
+}
+
+int64_t FFmpegVideoStreamPlayback::get_dropped_frame_count() const {
+	ERR_FAIL_COND_V(decoder.is_null(), 0);
+	return decoder->get_dropped_frame_count();
+}
+
+int64_t FFmpegVideoStreamPlayback::get_frame_count() const {
+	ERR_FAIL_COND_V(decoder.is_null(), -1);
+	return decoder->get_frame_count();
+}
+
+double FFmpegVideoStreamPlayback::get_av_drift() const {
+	return av_drift / 1000.0;
+}
+
+double FFmpegVideoStreamPlayback::get_av_correction() const {
+	return av_correction / 1000.0;
+}
+
+int64_t FFmpegVideoStreamPlayback::get_av_resync_count() const {
+	return av_resync_count;
+}
+
+bool FFmpegVideoStreamPlayback::is_audio_clock_active() const {
+	return audio_clock_active;
+}
+
+void FFmpegVideoStreamPlayback::set_conversion_slice_count(int p_slice_count) {
+	ERR_FAIL_COND(decoder.is_null());
+	decoder->set_conversion_slice_count(p_slice_count);
+}
+
+void FFmpegVideoStreamPlayback::set_decode_priority(int p_priority) {
+	ERR_FAIL_COND(decoder.is_null());
+	decoder->set_priority(p_priority);
+}
+
+void FFmpegVideoStreamPlayback::set_target_size(Vector2i p_size, bool p_fit) {
+	ERR_FAIL_COND(decoder.is_null());
+	if (shared_decoder.is_valid()) {
+		// Part of the registry key, changing it would resize the frames of every subscriber.
+		return;
 	}
+	// The texture follows on the next frame, _update_texture recreates it when the size changes.
+	decoder->set_target_size(p_size, p_fit);
 }
 
-void FFmpegVideoStreamPlayback::load(Ref<FileAccess> p_file_access) {
-	decoder = Ref<VideoDecoder>(memnew(VideoDecoder(p_file_access)));
+void FFmpegVideoStreamPlayback::set_keyframes_only(bool p_keyframes_only) {
+	ERR_FAIL_COND(decoder.is_null());
+	if (!_can_control_decoder()) {
+		// A preview tile would turn every other subscriber into keyframes only playback.
+		return;
+	}
+	decoder->set_keyframes_only(p_keyframes_only);
+}
 
-	decoder->start_decoding();
-	Vector2i size = decoder->get_size();
-	if (decoder->get_decoder_state() != VideoDecoder::FAULTED) {
-#ifdef GDEXTENSION
-		texture = ImageTexture::create_from_image(Image::create(size.x, size.y, false, Image::FORMAT_RGBA8));
-#else
-		texture = ImageTexture::create_from_image(Image::create_empty(size.x, size.y, false, Image::FORMAT_RGBA8));
-#endif
+void FFmpegVideoStreamPlayback::set_reverse(bool p_reverse) {
+	ERR_FAIL_COND(decoder.is_null());
+	if (!_can_control_decoder() || decoder->is_reverse() == p_reverse) {
+		return;
 	}
+	decoder->set_reverse(p_reverse);
+	// Decoding restarts in the new direction from the frame being shown.
+	decoder->seek(playback_position);
+	_reset_audio_clock();
 }
 
-void FFmpegVideoStreamPlayback::load_from_url(const String &p_path) {
-	decoder = Ref<VideoDecoder>(memnew(VideoDecoder(p_path)));
+void FFmpegVideoStreamPlayback::set_playback_speed(float p_speed) {
+	ERR_FAIL_COND(decoder.is_null());
+	if (!_can_control_decoder()) {
+		return;
+	}
+	decoder->set_playback_speed(p_speed);
+}
 
-	decoder->start_decoding();
-	Vector2i size = decoder->get_size();
-	if (decoder->get_decoder_state() != VideoDecoder::FAULTED) {
-#ifdef GDEXTENSION
-		texture = ImageTexture::create_from_image(Image::create(size.x, size.y, false, Image::FORMAT_RGBA8));
-#else
-		texture = ImageTexture::create_from_image(Image::create_empty(size.x, size.y, false, Image::FORMAT_RGBA8));
-#endif
+void FFmpegVideoStreamPlayback::set_scrub_cache_size_mb(int p_size_mb) {
+	ERR_FAIL_COND(decoder.is_null());
+	ERR_FAIL_COND(p_size_mb < 0);
+	if (!_can_control_decoder()) {
+		return;
+	}
+	decoder->set_scrub_cache_budget((uint64_t)p_size_mb * 1024 * 1024);
+}
+
+void FFmpegVideoStreamPlayback::set_scrub_mode(bool p_scrub_mode) {
+	ERR_FAIL_COND(decoder.is_null());
+	if (!_can_control_decoder()) {
+		// Scrubbing is tied to seeking, which shared subscribers can't do either.
+		return;
 	}
+	decoder->set_scrub_mode(p_scrub_mode);
+}
+
+void FFmpegVideoStreamPlayback::set_scale_filter(int p_filter) {
+	ERR_FAIL_COND(decoder.is_null());
+	ERR_FAIL_INDEX(p_filter, VideoDecoder::SCALE_FILTER_MAX);
+	if (shared_decoder.is_valid()) {
+		// Part of the registry key, like the target size.
+		return;
+	}
+	decoder->set_scale_filter((VideoDecoder::ScaleFilter)p_filter);
 }
 
 bool FFmpegVideoStreamPlayback::is_paused_internal() const {
@@ -239,8 +559,14 @@ void FFmpegVideoStreamPlayback::play_internal() {
 		return;
 	}
 	clear();
-	playback_position = 0;
-	decoder->seek(0, true);
+	// Playing backwards starts from the end.
+	playback_position = decoder->is_reverse() ? decoder->get_duration() : 0;
+	if (_can_control_decoder()) {
+		decoder->seek(playback_position, true);
+		if (shared_decoder.is_valid()) {
+			shared_decoder->set_clock_position(playback_position);
+		}
+	}
 	playing = true;
 }
 
@@ -248,16 +574,25 @@ void FFmpegVideoStreamPlayback::stop_internal() {
 	if (playing) {
 		clear();
 		playback_position = 0.0f;
-		decoder->seek(playback_position, true);
+		if (_can_control_decoder()) {
+			decoder->seek(playback_position, true);
+			if (shared_decoder.is_valid()) {
+				shared_decoder->set_clock_position(playback_position);
+			}
+		}
 	}
 	playing = false;
 }
 
 void FFmpegVideoStreamPlayback::seek_internal(double p_time) {
-	decoder->seek(p_time * 1000.0f);
-	available_frames.clear();
-	available_audio_frames.clear();
+	if (_can_control_decoder()) {
+		decoder->seek(p_time * 1000.0f);
+		if (shared_decoder.is_valid()) {
+			shared_decoder->set_clock_position(p_time * 1000.0f);
+		}
+	}
 	playback_position = p_time * 1000.0f;
+	_reset_audio_clock();
 }
 
 double FFmpegVideoStreamPlayback::get_length_internal() const {
@@ -287,11 +622,282 @@ int FFmpegVideoStreamPlayback::get_channels_internal() const {
 FFmpegVideoStreamPlayback::FFmpegVideoStreamPlayback() {
 }
 
+FFmpegVideoStreamPlayback::~FFmpegVideoStreamPlayback() {
+	clear();
+	if (shared_decoder.is_valid() && FFmpegDecoderRegistry::get_singleton()) {
+		FFmpegDecoderRegistry::get_singleton()->unsubscribe(shared_decoder, this);
+	}
+}
+
 void FFmpegVideoStreamPlayback::clear() {
+	if (decoder.is_valid() && shared_decoder.is_null()) {
+		if (last_frame.is_valid()) {
+			decoder->return_frame(last_frame);
+		}
+	}
 	last_frame.unref();
 	last_frame_texture.unref();
-	available_frames.clear();
-	available_audio_frames.clear();
+	shared_frame_serial = 0;
 	frames_processed = 0;
+	_reset_audio_clock();
+	// The player flushes its audio buffer when it's stopped.
+	audio_sink_frames = 0.0;
+	av_correction = 0.0;
+	av_resync_count = 0;
 	playing = false;
 }
+
+void FFmpegVideoStreamPlayback::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("get_dropped_frame_count"), &FFmpegVideoStreamPlayback::get_dropped_frame_count);
+	ClassDB::bind_method(D_METHOD("get_frame_count"), &FFmpegVideoStreamPlayback::get_frame_count);
+	ClassDB::bind_method(D_METHOD("get_yuv_material"), &FFmpegVideoStreamPlayback::get_yuv_material);
+	ClassDB::bind_method(D_METHOD("get_av_drift"), &FFmpegVideoStreamPlayback::get_av_drift);
+	ClassDB::bind_method(D_METHOD("get_av_correction"), &FFmpegVideoStreamPlayback::get_av_correction);
+	ClassDB::bind_method(D_METHOD("get_av_resync_count"), &FFmpegVideoStreamPlayback::get_av_resync_count);
+	ClassDB::bind_method(D_METHOD("is_audio_clock_active"), &FFmpegVideoStreamPlayback::is_audio_clock_active);
+	ClassDB::bind_method(D_METHOD("set_target_size", "size", "fit"), &FFmpegVideoStreamPlayback::set_target_size, DEFVAL(true));
+	ClassDB::bind_method(D_METHOD("set_scale_filter", "filter"), &FFmpegVideoStreamPlayback::set_scale_filter);
+	ClassDB::bind_method(D_METHOD("set_keyframes_only", "keyframes_only"), &FFmpegVideoStreamPlayback::set_keyframes_only);
+	ClassDB::bind_method(D_METHOD("set_reverse", "reverse"), &FFmpegVideoStreamPlayback::set_reverse);
+	ClassDB::bind_method(D_METHOD("set_playback_speed", "speed"), &FFmpegVideoStreamPlayback::set_playback_speed);
+	ClassDB::bind_method(D_METHOD("set_scrub_cache_size_mb", "size_mb"), &FFmpegVideoStreamPlayback::set_scrub_cache_size_mb);
+	ClassDB::bind_method(D_METHOD("set_scrub_mode", "scrub_mode"), &FFmpegVideoStreamPlayback::set_scrub_mode);
+
+	// Emitted with the time of the first frame shown after a seek, which is the exact frame it landed on.
+	ADD_SIGNAL(MethodInfo("seek_completed", PropertyInfo(Variant::FLOAT, "position")));
+}
+
+void FFmpegVideoStream::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("set_output_format", "output_format"), &FFmpegVideoStream::set_output_format);
+	ClassDB::bind_method(D_METHOD("get_output_format"), &FFmpegVideoStream::get_output_format);
+	ClassDB::bind_method(D_METHOD("set_conversion_slice_count", "slice_count"), &FFmpegVideoStream::set_conversion_slice_count);
+	ClassDB::bind_method(D_METHOD("get_conversion_slice_count"), &FFmpegVideoStream::get_conversion_slice_count);
+	ClassDB::bind_method(D_METHOD("set_live", "live"), &FFmpegVideoStream::set_live);
+	ClassDB::bind_method(D_METHOD("is_live"), &FFmpegVideoStream::is_live);
+	ClassDB::bind_method(D_METHOD("set_shared", "shared"), &FFmpegVideoStream::set_shared);
+	ClassDB::bind_method(D_METHOD("is_shared"), &FFmpegVideoStream::is_shared);
+	ClassDB::bind_method(D_METHOD("set_decode_priority", "priority"), &FFmpegVideoStream::set_decode_priority);
+	ClassDB::bind_method(D_METHOD("get_decode_priority"), &FFmpegVideoStream::get_decode_priority);
+	ClassDB::bind_method(D_METHOD("set_target_size", "size"), &FFmpegVideoStream::set_target_size);
+	ClassDB::bind_method(D_METHOD("get_target_size"), &FFmpegVideoStream::get_target_size);
+	ClassDB::bind_method(D_METHOD("set_fit_target_size", "fit"), &FFmpegVideoStream::set_fit_target_size);
+	ClassDB::bind_method(D_METHOD("is_fit_target_size"), &FFmpegVideoStream::is_fit_target_size);
+	ClassDB::bind_method(D_METHOD("set_scale_filter", "filter"), &FFmpegVideoStream::set_scale_filter);
+	ClassDB::bind_method(D_METHOD("get_scale_filter"), &FFmpegVideoStream::get_scale_filter);
+	ClassDB::bind_method(D_METHOD("set_keyframes_only", "keyframes_only"), &FFmpegVideoStream::set_keyframes_only);
+	ClassDB::bind_method(D_METHOD("is_keyframes_only"), &FFmpegVideoStream::is_keyframes_only);
+	ClassDB::bind_method(D_METHOD("set_reverse", "reverse"), &FFmpegVideoStream::set_reverse);
+	ClassDB::bind_method(D_METHOD("is_reverse"), &FFmpegVideoStream::is_reverse);
+	ClassDB::bind_method(D_METHOD("set_playback_speed", "speed"), &FFmpegVideoStream::set_playback_speed);
+	ClassDB::bind_method(D_METHOD("get_playback_speed"), &FFmpegVideoStream::get_playback_speed);
+	ClassDB::bind_method(D_METHOD("set_audio_channel_mode", "mode"), &FFmpegVideoStream::set_audio_channel_mode);
+	ClassDB::bind_method(D_METHOD("get_audio_channel_mode"), &FFmpegVideoStream::get_audio_channel_mode);
+	ClassDB::bind_method(D_METHOD("set_scrub_cache_size_mb", "size_mb"), &FFmpegVideoStream::set_scrub_cache_size_mb);
+	ClassDB::bind_method(D_METHOD("get_scrub_cache_size_mb"), &FFmpegVideoStream::get_scrub_cache_size_mb);
+	ClassDB::bind_method(D_METHOD("set_scrub_mode", "scrub_mode"), &FFmpegVideoStream::set_scrub_mode);
+	ClassDB::bind_method(D_METHOD("is_scrub_mode"), &FFmpegVideoStream::is_scrub_mode);
+
+	ClassDB::bind_static_method("FFmpegVideoStream", D_METHOD("print_codecs"), &FFmpegVideoStream::print_codecs);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "output_format", PROPERTY_HINT_ENUM, "RGBA,YUV"), "set_output_format", "get_output_format");
+	// 0 lets the decoder pick based on the frame height and the number of cores.
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "conversion_slice_count", PROPERTY_HINT_RANGE, "0,16,1"), "set_conversion_slice_count", "get_conversion_slice_count");
+	// Always show the newest decoded frame instead of playing them back in order, for low latency camera feeds.
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "live"), "set_live", "is_live");
+	// Playbacks of the same source share one decoder, seeking only works while a single one is alive.
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "shared"), "set_shared", "is_shared");
+	// How this stream's video decoding is ranked against other streams when the CPU is saturated, audio always goes first.
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "decode_priority", PROPERTY_HINT_ENUM, "Offscreen,Visible,Focused"), "set_decode_priority", "get_decode_priority");
+	// Decoding straight to the displayed size saves conversion, copy and upload work for small tiles.
+	// Shared playbacks only share a decoder with ones of the same size and filter, and keep them once created.
+	ADD_PROPERTY(PropertyInfo(Variant::VECTOR2I, "target_size"), "set_target_size", "get_target_size");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "fit_target_size"), "set_fit_target_size", "is_fit_target_size");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "scale_filter", PROPERTY_HINT_ENUM, "Fast Bilinear,Bilinear,Area,Bicubic,Lanczos"), "set_scale_filter", "get_scale_filter");
+	// Only decode one frame per GOP, for preview walls. Can be toggled while playing.
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "keyframes_only"), "set_keyframes_only", "is_keyframes_only");
+	// Plays backwards a GOP at a time, without audio. Can be toggled while playing.
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "reverse"), "set_reverse", "is_reverse");
+	// Audio keeps its pitch up to 4x, faster than that only keyframes are shown and audio is muted.
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "playback_speed", PROPERTY_HINT_RANGE, "0.25,16,0.05"), "set_playback_speed", "get_playback_speed");
+	// Recently decoded frames are kept in memory, seeks landing on them skip decoding altogether.
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "scrub_cache_size_mb", PROPERTY_HINT_RANGE, "0,4096,1,suffix:MiB"), "set_scrub_cache_size_mb", "get_scrub_cache_size_mb");
+	// For timeline scrubbing, seeks also cache the frames leading up to their target.
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "scrub_mode"), "set_scrub_mode", "is_scrub_mode");
+	// Auto keeps 5.1 on surround speaker setups and mixes it down to stereo otherwise.
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "audio_channel_mode", PROPERTY_HINT_ENUM, "Auto,Stereo,Mono"), "set_audio_channel_mode", "get_audio_channel_mode");
+}
+
+void FFmpegVideoStream::set_output_format(int p_output_format) {
+	ERR_FAIL_INDEX(p_output_format, VideoDecoder::OUTPUT_FORMAT_YUV + 1);
+	output_format = (VideoDecoder::OutputFormat)p_output_format;
+}
+
+int FFmpegVideoStream::get_output_format() const {
+	return output_format;
+}
+
+void FFmpegVideoStream::set_conversion_slice_count(int p_slice_count) {
+	ERR_FAIL_COND(p_slice_count < 0);
+	conversion_slice_count = p_slice_count;
+}
+
+int FFmpegVideoStream::get_conversion_slice_count() const {
+	return conversion_slice_count;
+}
+
+void FFmpegVideoStream::set_live(bool p_live) {
+	live = p_live;
+}
+
+bool FFmpegVideoStream::is_live() const {
+	return live;
+}
+
+void FFmpegVideoStream::set_shared(bool p_shared) {
+	shared = p_shared;
+}
+
+bool FFmpegVideoStream::is_shared() const {
+	return shared;
+}
+
+void FFmpegVideoStream::set_decode_priority(int p_priority) {
+	ERR_FAIL_INDEX(p_priority, FFmpegDecodeScheduler::PRIORITY_AUDIO);
+	decode_priority = p_priority;
+	_update_playbacks();
+}
+
+int FFmpegVideoStream::get_decode_priority() const {
+	return decode_priority;
+}
+
+void FFmpegVideoStream::set_target_size(Vector2i p_size) {
+	ERR_FAIL_COND(p_size.x < 0 || p_size.y < 0);
+	target_size = p_size;
+	_update_playbacks();
+}
+
+Vector2i FFmpegVideoStream::get_target_size() const {
+	return target_size;
+}
+
+void FFmpegVideoStream::set_fit_target_size(bool p_fit) {
+	fit_target_size = p_fit;
+	_update_playbacks();
+}
+
+bool FFmpegVideoStream::is_fit_target_size() const {
+	return fit_target_size;
+}
+
+void FFmpegVideoStream::set_scale_filter(int p_filter) {
+	ERR_FAIL_INDEX(p_filter, VideoDecoder::SCALE_FILTER_MAX);
+	scale_filter = (VideoDecoder::ScaleFilter)p_filter;
+	_update_playbacks();
+}
+
+int FFmpegVideoStream::get_scale_filter() const {
+	return scale_filter;
+}
+
+void FFmpegVideoStream::set_keyframes_only(bool p_keyframes_only) {
+	keyframes_only = p_keyframes_only;
+	_update_playbacks();
+}
+
+bool FFmpegVideoStream::is_keyframes_only() const {
+	return keyframes_only;
+}
+
+void FFmpegVideoStream::set_reverse(bool p_reverse) {
+	reverse = p_reverse;
+	_update_playbacks();
+}
+
+bool FFmpegVideoStream::is_reverse() const {
+	return reverse;
+}
+
+void FFmpegVideoStream::set_playback_speed(float p_speed) {
+	playback_speed = CLAMP(p_speed, 0.25f, 16.0f);
+	_update_playbacks();
+}
+
+float FFmpegVideoStream::get_playback_speed() const {
+	return playback_speed;
+}
+
+void FFmpegVideoStream::set_scrub_cache_size_mb(int p_size_mb) {
+	ERR_FAIL_COND(p_size_mb < 0);
+	scrub_cache_size_mb = p_size_mb;
+	_update_playbacks();
+}
+
+int FFmpegVideoStream::get_scrub_cache_size_mb() const {
+	return scrub_cache_size_mb;
+}
+
+void FFmpegVideoStream::set_scrub_mode(bool p_scrub_mode) {
+	scrub_mode = p_scrub_mode;
+	_update_playbacks();
+}
+
+bool FFmpegVideoStream::is_scrub_mode() const {
+	return scrub_mode;
+}
+
+void FFmpegVideoStream::set_audio_channel_mode(int p_mode) {
+	ERR_FAIL_INDEX(p_mode, FFmpegAudioResampler::CHANNEL_MODE_MAX);
+	audio_channel_mode = (FFmpegAudioResampler::ChannelMode)p_mode;
+}
+
+int FFmpegVideoStream::get_audio_channel_mode() const {
+	return audio_channel_mode;
+}
+
+void FFmpegVideoStream::_prune_playbacks() {
+	for (uint32_t i = 0; i < playbacks.size();) {
+		if (Object::cast_to<FFmpegVideoStreamPlayback>(ObjectDB::get_instance(playbacks[i])) == nullptr) {
+			playbacks.remove_at_unordered(i);
+		} else {
+			i++;
+		}
+	}
+}
+
+void FFmpegVideoStream::_configure_playback(FFmpegVideoStreamPlayback *p_playback) {
+	p_playback->set_conversion_slice_count(conversion_slice_count);
+	p_playback->set_decode_priority(decode_priority);
+	p_playback->set_target_size(target_size, fit_target_size);
+	p_playback->set_scale_filter(scale_filter);
+	p_playback->set_keyframes_only(keyframes_only);
+	p_playback->set_reverse(reverse);
+	p_playback->set_playback_speed(playback_speed);
+	p_playback->set_scrub_cache_size_mb(scrub_cache_size_mb);
+	p_playback->set_scrub_mode(scrub_mode);
+}
+
+void FFmpegVideoStream::_update_playbacks() {
+	_prune_playbacks();
+	for (const ObjectID &id : playbacks) {
+		_configure_playback(Object::cast_to<FFmpegVideoStreamPlayback>(ObjectDB::get_instance(id)));
+	}
+}
+
+void FFmpegVideoStream::_apply_playback_settings(const Ref<FFmpegVideoStreamPlayback> &p_playback) {
+	_configure_playback(p_playback.ptr());
+	_prune_playbacks();
+	playbacks.push_back(p_playback->get_instance_id());
+}
+
+void FFmpegVideoStream::print_codecs() {
+	FFmpegCodecRegistry::get_singleton()->print_codecs();
+}
+
+Ref<Shader> FFmpegVideoStream::_get_yuv_shader() {
+	if (!yuv_shader.is_valid()) {
+		yuv_shader.instantiate();
+		yuv_shader->set_code(yuv_shader_code);
+	}
+	return yuv_shader;
+}
@@ -34,6 +34,8 @@
 #ifdef GDEXTENSION
 
 // Headers for building as GDExtension plug-in.
+#include <godot_cpp/classes/shader.hpp>
+#include <godot_cpp/classes/shader_material.hpp>
 #include <godot_cpp/classes/video_stream.hpp>
 #include <godot_cpp/classes/video_stream_playback.hpp>
 #include <godot_cpp/godot.hpp>
@@ -46,10 +48,13 @@ using namespace godot;
 #else
 
 #include "core/object/ref_counted.h"
+#include "scene/resources/material.h"
+#include "scene/resources/shader.h"
 #include "scene/resources/video_stream.h"
 
 #endif
 
+#include "ffmpeg_decoder_registry.h"
 #include "video_decoder.h"
 
 // We have to use this function redirection system for GDExtension because the naming conventions
@@ -59,27 +64,63 @@ using namespace godot;
 class FFmpegVideoStreamPlayback : public VideoStreamPlayback {
 	GDCLASS(FFmpegVideoStreamPlayback, VideoStreamPlayback);
 	const int LENIENCE_BEFORE_SEEK = 2500;
+	// Drift between the video and the audio clock below this is left alone, it's less than a frame.
+	const double AV_SYNC_THRESHOLD = 10.0;
+	// Drift beyond this is fixed by jumping to the audio clock instead of easing towards it.
+	const double AV_RESYNC_THRESHOLD = 200.0;
+	// Share of the drift corrected every update.
+	const double AV_CORRECTION_RATE = 0.1;
+	// Media time in milliseconds the video is shown at, follows the audio clock while there is one.
 	double playback_position = 0.0f;
 
+	// Media time right after the last audio sample the player accepted, -1 until audio flows after a seek.
+	double audio_clock_end_time = -1.0;
+	// Estimate of the frames waiting in the player's audio buffer. It drains at the mix rate and is
+	// set back to the buffer's capacity whenever the player turns samples away.
+	double audio_sink_frames = 0.0;
+	double audio_sink_capacity = 0.0;
+	// Head audio frame and how many of its samples the player already took.
+	Ref<DecodedAudioFrame> audio_mix_frame;
+	int audio_mix_frame_offset = 0;
+	bool audio_clock_active = false;
+	double av_drift = 0.0;
+	double av_correction = 0.0;
+	int64_t av_resync_count = 0;
+
 	Ref<VideoDecoder> decoder;
-	List<Ref<DecodedFrame>> available_frames;
-	List<Ref<DecodedAudioFrame>> available_audio_frames;
+	// Set when decoder is shared with other playbacks of the same source.
+	Ref<FFmpegSharedDecoder> shared_decoder;
+	uint64_t shared_frame_serial = 0;
 	Ref<DecodedFrame> last_frame;
 #ifndef FFMPEG_MT_GPU_UPLOAD
 	Ref<ImageTexture> last_frame_texture;
 #endif
 	Ref<Image> last_frame_image;
 	Ref<ImageTexture> texture;
+	Ref<ImageTexture> chroma_texture;
+	Ref<ImageTexture> chroma_v_texture;
+	// Owned by this playback, the chroma planes and colour flags it's fed are this playback's own.
+	Ref<ShaderMaterial> yuv_material;
+	FFmpegAudioResampler::ChannelMode audio_channel_mode = FFmpegAudioResampler::CHANNEL_MODE_AUTO;
 	bool looping = false;
 	bool buffering = false;
 	int frames_processed = 0;
+	// Last seek reported through seek_completed.
+	uint32_t reported_seek_serial = 0;
 	void seek_into_sync();
 	double get_current_frame_time();
 	bool check_next_frame_valid(Ref<DecodedFrame> p_decoded_frame);
-	bool check_next_audio_frame_valid(Ref<DecodedAudioFrame> p_decoded_frame);
 	bool paused = false;
 	bool playing = false;
 
+	void _create_textures();
+	static void _update_texture(Ref<ImageTexture> &p_texture, const Ref<Image> &p_image);
+	void _update_yuv_textures();
+	bool _can_control_decoder() const;
+	void _mix_audio_frames();
+	void _sync_to_audio_clock();
+	void _reset_audio_clock();
+
 private:
 	bool is_paused_internal() const;
 	void update_internal(double p_delta);
@@ -96,12 +137,43 @@ private:
 
 protected:
 	void clear();
-	static void _bind_methods(){}; // Required by GDExtension, do not remove
+	static void _bind_methods(); // Required by GDExtension, do not remove
 
 public:
-	void load(Ref<FileAccess> p_file_access);
-	void load_from_url(const String &p_path);
-	
+	void load(Ref<FileAccess> p_file_access, VideoDecoder::OutputFormat p_output_format = VideoDecoder::OUTPUT_FORMAT_RGBA, bool p_live = false);
+	void load_from_url(const String &p_path, VideoDecoder::OutputFormat p_output_format = VideoDecoder::OUTPUT_FORMAT_RGBA, bool p_live = false);
+	// Subscribes to the decoder other playbacks of p_path with the same output already use, or starts one they can join.
+	// The output size and filter of a shared decoder are fixed once subscribed.
+	bool load_shared(const String &p_path, VideoDecoder::OutputFormat p_output_format = VideoDecoder::OUTPUT_FORMAT_RGBA, bool p_live = false, Vector2i p_target_size = Vector2i(), bool p_fit = true, VideoDecoder::ScaleFilter p_filter = VideoDecoder::SCALE_FILTER_FAST_BILINEAR);
+	int64_t get_dropped_frame_count() const;
+	// -1 until known, files get an exact count once their seek index is built.
+	int64_t get_frame_count() const;
+	// Audio clock minus video position in seconds, measured before the last correction. 0 without an audio clock.
+	double get_av_drift() const;
+	// Seconds the video position was eased by to follow the audio clock since playback started.
+	double get_av_correction() const;
+	// Times the video position jumped to the audio clock because it was too far off to ease.
+	int64_t get_av_resync_count() const;
+	// False while the video runs on the wall clock, e.g. without audio, in reverse or above 4x.
+	bool is_audio_clock_active() const;
+	// Creates this playback's YUV material from the stream's shader.
+	void set_yuv_shader(const Ref<Shader> &p_shader);
+	// In YUV mode the playback texture only holds the luma plane, this material must be assigned
+	// to the node drawing it (e.g. VideoStreamPlayer.material) to get RGB output.
+	Ref<ShaderMaterial> get_yuv_material() const;
+	// Only before loading, it decides how the decoder is set up.
+	void set_audio_channel_mode(FFmpegAudioResampler::ChannelMode p_mode);
+	void set_conversion_slice_count(int p_slice_count);
+	void set_decode_priority(int p_priority);
+	void set_target_size(Vector2i p_size, bool p_fit = true);
+	void set_scale_filter(int p_filter);
+	void set_keyframes_only(bool p_keyframes_only);
+	// Restarts decoding in the new direction from the current position.
+	void set_reverse(bool p_reverse);
+	void set_playback_speed(float p_speed);
+	void set_scrub_cache_size_mb(int p_size_mb);
+	void set_scrub_mode(bool p_scrub_mode);
+
 	STREAM_FUNC_REDIRECT_0_CONST(bool, is_paused);
 	STREAM_FUNC_REDIRECT_1(void, update, double, p_delta);
 	STREAM_FUNC_REDIRECT_0_CONST(bool, is_playing);
@@ -115,19 +187,63 @@ public:
 	STREAM_FUNC_REDIRECT_0_CONST(int, get_mix_rate);
 	STREAM_FUNC_REDIRECT_0_CONST(int, get_channels);
 	FFmpegVideoStreamPlayback();
+	~FFmpegVideoStreamPlayback();
 };
 
 class FFmpegVideoStream : public VideoStream {
 	GDCLASS(FFmpegVideoStream, VideoStream);
 
+	VideoDecoder::OutputFormat output_format = VideoDecoder::OUTPUT_FORMAT_RGBA;
+	int conversion_slice_count = 0;
+	bool live = false;
+	bool shared = false;
+	int decode_priority = FFmpegDecodeScheduler::PRIORITY_VISIBLE;
+	Vector2i target_size;
+	bool fit_target_size = true;
+	VideoDecoder::ScaleFilter scale_filter = VideoDecoder::SCALE_FILTER_FAST_BILINEAR;
+	bool keyframes_only = false;
+	bool reverse = false;
+	float playback_speed = 1.0f;
+	int scrub_cache_size_mb = 0;
+	bool scrub_mode = false;
+	FFmpegAudioResampler::ChannelMode audio_channel_mode = FFmpegAudioResampler::CHANNEL_MODE_AUTO;
+	// Playbacks instantiated from this stream, so setting changes reach the ones already playing.
+	LocalVector<ObjectID> playbacks;
+	// Shared by the materials of every playback, each of those has its own parameters.
+	Ref<Shader> yuv_shader;
+
+	void _prune_playbacks();
+	void _configure_playback(FFmpegVideoStreamPlayback *p_playback);
+	void _update_playbacks();
+	void _apply_playback_settings(const Ref<FFmpegVideoStreamPlayback> &p_playback);
+	Ref<Shader> _get_yuv_shader();
+
 protected:
-	static void _bind_methods(){}; // Required by GDExtension, do not remove
+	static void _bind_methods();
 	Ref<VideoStreamPlayback> instantiate_playback_internal() {
 		String file_path = get_file();
+		if (shared) {
+			Ref<FFmpegVideoStreamPlayback> pb;
+			pb.instantiate();
+			pb->set_audio_channel_mode(audio_channel_mode);
+			if (output_format == VideoDecoder::OUTPUT_FORMAT_YUV) {
+				pb->set_yuv_shader(_get_yuv_shader());
+			}
+			if (!pb->load_shared(file_path, output_format, live, target_size, fit_target_size, scale_filter)) {
+				return Ref<VideoStreamPlayback>();
+			}
+			_apply_playback_settings(pb);
+			return pb;
+		}
 		if(std::string::npos != file_path.to_lower().find("://")){
 			Ref<FFmpegVideoStreamPlayback> pb;
 			pb.instantiate();
-			pb->load_from_url(file_path);
+			pb->set_audio_channel_mode(audio_channel_mode);
+			if (output_format == VideoDecoder::OUTPUT_FORMAT_YUV) {
+				pb->set_yuv_shader(_get_yuv_shader());
+			}
+			pb->load_from_url(file_path, output_format, live);
+			_apply_playback_settings(pb);
 			return pb;
 		}else{
 			Ref<FileAccess> fa = FileAccess::open(file_path, FileAccess::READ);
@@ -136,12 +252,52 @@ protected:
 			}
 			Ref<FFmpegVideoStreamPlayback> pb;
 			pb.instantiate();
-			pb->load(fa);
+			pb->set_audio_channel_mode(audio_channel_mode);
+			if (output_format == VideoDecoder::OUTPUT_FORMAT_YUV) {
+				pb->set_yuv_shader(_get_yuv_shader());
+			}
+			pb->load(fa, output_format, live);
+			_apply_playback_settings(pb);
 			return pb;
 		}
 	}
 
 public:
+	void set_output_format(int p_output_format);
+	int get_output_format() const;
+	void set_conversion_slice_count(int p_slice_count);
+	int get_conversion_slice_count() const;
+	void set_live(bool p_live);
+	bool is_live() const;
+	void set_shared(bool p_shared);
+	bool is_shared() const;
+	// One of FFmpegDecodeScheduler::PRIORITY_OFFSCREEN, PRIORITY_VISIBLE or PRIORITY_FOCUSED.
+	void set_decode_priority(int p_priority);
+	int get_decode_priority() const;
+	// Frames are scaled down to this size while being converted, (0, 0) keeps the source resolution.
+	void set_target_size(Vector2i p_size);
+	Vector2i get_target_size() const;
+	void set_fit_target_size(bool p_fit);
+	bool is_fit_target_size() const;
+	void set_scale_filter(int p_filter);
+	int get_scale_filter() const;
+	void set_keyframes_only(bool p_keyframes_only);
+	bool is_keyframes_only() const;
+	void set_reverse(bool p_reverse);
+	bool is_reverse() const;
+	void set_playback_speed(float p_speed);
+	float get_playback_speed() const;
+	// Memory for recently decoded frames, seeking back onto one of them is instant. 0 disables it.
+	void set_scrub_cache_size_mb(int p_size_mb);
+	int get_scrub_cache_size_mb() const;
+	void set_scrub_mode(bool p_scrub_mode);
+	bool is_scrub_mode() const;
+	// Applies to playbacks instantiated after the change. Shared decoders keep the mode of the playback that opened them.
+	void set_audio_channel_mode(int p_mode);
+	int get_audio_channel_mode() const;
+	// Lists the decoders the linked FFmpeg build provides, for diagnosing missing codec support.
+	static void print_codecs();
+
 	STREAM_FUNC_REDIRECT_0(Ref<VideoStreamPlayback>, instantiate_playback);
 };
 
@@ -0,0 +1,118 @@
+/**************************************************************************/
+/*  bench_audio_mix.cpp                                                   */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+// Times the bulk copies in ffmpeg_audio_mix.h for typical audio callback sizes, against the per-frame
+// AudioFrame loop they replaced. Standalone, built from the module directory inside a Godot checkout:
+//
+//     g++ -O2 -std=c++17 -I../.. misc/bench/bench_audio_mix.cpp -o bench_audio_mix
+//
+// or against godot-cpp for the GDExtension build:
+//
+//     g++ -O2 -std=c++17 -DGDEXTENSION -Igodot-cpp/include -Igodot-cpp/gen/include misc/bench/bench_audio_mix.cpp -o bench_audio_mix
+
+#include "../../ffmpeg_audio_mix.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+const int CALLBACKS_PER_RUN = 2000;
+const int RUNS = 15;
+const uint32_t CALLBACK_SIZES[] = { 512, 1024, 4096 };
+
+static void mix_stereo_per_frame(AudioFrame *p_dst, const float *p_src, uint32_t p_frames) {
+	for (uint32_t i = 0; i < p_frames; i++) {
+		p_dst[i] = AudioFrame{ p_src[i * 2], p_src[i * 2 + 1] };
+	}
+}
+
+static void mix_mono_per_frame(AudioFrame *p_dst, const float *p_src, uint32_t p_frames) {
+	for (uint32_t i = 0; i < p_frames; i++) {
+		p_dst[i] = AudioFrame{ p_src[i], p_src[i] };
+	}
+}
+
+// Median time of one callback in microseconds. The source cycles through a buffer larger than the
+// callback like the decoder's ring does, the destination is reused like the AudioServer's mix buffer.
+template <class F>
+static double time_callback(F p_mix, const std::vector<float> &p_ring, uint32_t p_channels, uint32_t p_frames, std::vector<AudioFrame> &r_dst) {
+	uint32_t ring_frames = p_ring.size() / p_channels;
+	std::vector<double> runs;
+	volatile float sink = 0.0f;
+	for (int run = 0; run < RUNS; run++) {
+		uint32_t position = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < CALLBACKS_PER_RUN; i++) {
+			p_mix(r_dst.data(), p_ring.data() + position * p_channels, p_frames);
+			position = (position + p_frames) % (ring_frames - p_frames);
+		}
+		auto end = std::chrono::steady_clock::now();
+		// Keeps the compiler from dropping the copies.
+		sink = sink + r_dst[p_frames / 2].left;
+		runs.push_back(std::chrono::duration<double, std::micro>(end - start).count() / CALLBACKS_PER_RUN);
+	}
+	std::sort(runs.begin(), runs.end());
+	return runs[runs.size() / 2];
+}
+
+int main() {
+#if defined(FFMPEG_AUDIO_MIX_SSE2)
+	printf("SIMD path: SSE2\n");
+#elif defined(FFMPEG_AUDIO_MIX_NEON)
+	printf("SIMD path: NEON\n");
+#else
+	printf("SIMD path: none, scalar only\n");
+#endif
+	printf("%-8s %-8s %14s %14s\n", "layout", "frames", "bulk (us)", "per frame (us)");
+
+	// About a second at 48 kHz, so consecutive callbacks don't just hit the same cache lines.
+	const uint32_t ring_frames = 48000;
+	for (uint32_t channels = 1; channels <= 2; channels++) {
+		std::vector<float> ring(ring_frames * channels);
+		for (uint32_t i = 0; i < ring.size(); i++) {
+			ring[i] = (float)(i % 1000) / 1000.0f - 0.5f;
+		}
+		for (uint32_t frames : CALLBACK_SIZES) {
+			std::vector<AudioFrame> dst(frames);
+			double bulk;
+			double per_frame;
+			if (channels == 1) {
+				bulk = time_callback(ffmpeg_audio_mix_mono, ring, channels, frames, dst);
+				per_frame = time_callback(mix_mono_per_frame, ring, channels, frames, dst);
+			} else {
+				bulk = time_callback(ffmpeg_audio_mix_stereo, ring, channels, frames, dst);
+				per_frame = time_callback(mix_stereo_per_frame, ring, channels, frames, dst);
+			}
+			printf("%-8s %-8u %14.3f %14.3f\n", channels == 1 ? "mono" : "stereo", frames, bulk, per_frame);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,254 @@
+/**************************************************************************/
+/*  bench_convert_slices.cpp                                              */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             EIRTeam.FFmpeg                             */
+/*                         https://ph.eirteam.moe                         */
+/**************************************************************************/
+/* Copyright (c) 2023-present Álex Román (EIRTeam) & contributors.        */
+/*                                                                        */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+// Measures how frame conversion scales with the slice count VideoDecoder::_convert_frame splits it into.
+// Frames are laid out in bands the same way and every band gets its own SwsContext, so this times what
+// the decoder does without having to decode a file. Standalone, needs only the FFmpeg libraries:
+//
+//     g++ -O2 -std=c++17 misc/bench/bench_convert_slices.cpp $(pkg-config --cflags --libs libswscale libavutil) -pthread -o bench_convert_slices
+//     ./bench_convert_slices [max_slices] [frames]
+//
+// Converts YUV420P to RGBA at the source size, frames scaled to a target size are never sliced.
+
+extern "C" {
+#include "libavutil/frame.h"
+#include "libavutil/pixdesc.h"
+#include "libswscale/swscale.h"
+}
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Resolution {
+	const char *name;
+	int width;
+	int height;
+};
+
+const Resolution RESOLUTIONS[] = {
+	{ "1080p", 1920, 1080 },
+	{ "4K", 3840, 2160 },
+	{ "8K", 7680, 4320 },
+};
+
+struct ConversionSlice {
+	SwsContext *context = nullptr;
+	const uint8_t *src_data[4] = {};
+	int src_linesize[4] = {};
+	uint8_t *dst_data[4] = {};
+	int dst_linesize[4] = {};
+	int height = 0;
+	bool failed = false;
+};
+
+static void convert_slice(ConversionSlice &p_slice) {
+	int result = sws_scale(p_slice.context, p_slice.src_data, p_slice.src_linesize, 0, p_slice.height, p_slice.dst_data, p_slice.dst_linesize);
+	p_slice.failed = result < 0;
+}
+
+// Stands in for the WorkerThreadPool group task: worker i converts slice i + 1 while the calling thread
+// converts the first one, then waits for the rest.
+class SliceWorkers {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	ConversionSlice *slices = nullptr;
+	int slice_count = 0;
+	int pending = 0;
+	uint64_t generation = 0;
+	bool quit = false;
+
+	void _worker(int p_index) {
+		uint64_t seen_generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_condition.wait(lock, [&]() { return quit || generation != seen_generation; });
+				if (quit) {
+					return;
+				}
+				seen_generation = generation;
+				if (p_index + 1 >= slice_count) {
+					continue;
+				}
+			}
+			convert_slice(slices[p_index + 1]);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0) {
+				done_condition.notify_one();
+			}
+		}
+	}
+
+public:
+	void run(ConversionSlice *p_slices, int p_slice_count) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slices = p_slices;
+			slice_count = p_slice_count;
+			pending = p_slice_count - 1;
+			generation++;
+		}
+		start_condition.notify_all();
+		convert_slice(p_slices[0]);
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, [&]() { return pending == 0; });
+	}
+
+	SliceWorkers(int p_thread_count) {
+		for (int i = 0; i < p_thread_count; i++) {
+			threads.emplace_back(&SliceWorkers::_worker, this, i);
+		}
+	}
+
+	~SliceWorkers() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		start_condition.notify_all();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+	}
+};
+
+// Same band layout as _convert_frame, returns the number of slices actually used.
+static int layout_slices(const AVFrame *p_frame, AVPixelFormat p_target_format, int p_slice_count, uint8_t *p_dst, int p_dst_linesize, std::vector<SwsContext *> &r_contexts, std::vector<ConversionSlice> &r_slices) {
+	int height = p_frame->height;
+	const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get((AVPixelFormat)p_frame->format);
+	const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(p_target_format);
+	int row_alignment = 1 << std::max(src_desc->log2_chroma_h, dst_desc->log2_chroma_h);
+	int rows_per_slice = (height + p_slice_count - 1) / p_slice_count;
+	rows_per_slice = (rows_per_slice + row_alignment - 1) / row_alignment * row_alignment;
+	int slice_count = (height + rows_per_slice - 1) / rows_per_slice;
+
+	r_contexts.resize(std::max((int)r_contexts.size(), slice_count), nullptr);
+	r_slices.resize(slice_count);
+	for (int i = 0; i < slice_count; i++) {
+		ConversionSlice &slice = r_slices[i];
+		int slice_y = i * rows_per_slice;
+		slice.height = std::min(rows_per_slice, height - slice_y);
+		r_contexts[i] = sws_getCachedContext(r_contexts[i],
+				p_frame->width, slice.height, (AVPixelFormat)p_frame->format,
+				p_frame->width, slice.height, p_target_format,
+				SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+		if (r_contexts[i] == nullptr) {
+			return 0;
+		}
+		slice.context = r_contexts[i];
+		for (int plane = 0; plane < 4; plane++) {
+			bool chroma_plane = plane == 1 || plane == 2;
+			int src_plane_y = chroma_plane ? slice_y >> src_desc->log2_chroma_h : slice_y;
+			slice.src_data[plane] = p_frame->data[plane] ? p_frame->data[plane] + src_plane_y * p_frame->linesize[plane] : nullptr;
+			slice.src_linesize[plane] = p_frame->linesize[plane];
+			slice.dst_data[plane] = nullptr;
+			slice.dst_linesize[plane] = 0;
+		}
+		// RGBA is a single plane.
+		slice.dst_data[0] = p_dst + slice_y * p_dst_linesize;
+		slice.dst_linesize[0] = p_dst_linesize;
+	}
+	return slice_count;
+}
+
+int main(int argc, char **argv) {
+	int max_slices = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	int frame_count = argc > 2 ? atoi(argv[2]) : 60;
+	max_slices = std::max(max_slices, 1);
+	frame_count = std::max(frame_count, 1);
+
+	SliceWorkers workers(max_slices - 1);
+	printf("%-6s %-7s %12s %10s %9s\n", "size", "slices", "ms/frame", "frames/s", "speedup");
+
+	for (const Resolution &resolution : RESOLUTIONS) {
+		AVFrame *frame = av_frame_alloc();
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = resolution.width;
+		frame->height = resolution.height;
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			fprintf(stderr, "Failed to allocate a %s frame\n", resolution.name);
+			return 1;
+		}
+		// A gradient rather than flat planes, some conversions take shortcuts on uniform input.
+		for (int plane = 0; plane < 3; plane++) {
+			int plane_height = plane == 0 ? frame->height : frame->height / 2;
+			for (int y = 0; y < plane_height; y++) {
+				for (int x = 0; x < frame->linesize[plane]; x++) {
+					frame->data[plane][y * frame->linesize[plane] + x] = (uint8_t)(x + y * (plane + 1));
+				}
+			}
+		}
+		int dst_linesize = resolution.width * 4;
+		std::vector<uint8_t> dst((size_t)dst_linesize * resolution.height);
+		std::vector<SwsContext *> contexts;
+		std::vector<ConversionSlice> slices;
+
+		double single_slice_ms = 0.0;
+		for (int requested = 1; requested <= max_slices; requested++) {
+			int slice_count = layout_slices(frame, AV_PIX_FMT_RGBA, requested, dst.data(), dst_linesize, contexts, slices);
+			if (slice_count == 0) {
+				fprintf(stderr, "Failed to obtain SWS context\n");
+				return 1;
+			}
+			// The first conversion initializes the contexts' tables, it isn't timed.
+			workers.run(slices.data(), slice_count);
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < frame_count; i++) {
+				workers.run(slices.data(), slice_count);
+			}
+			auto end = std::chrono::steady_clock::now();
+			for (const ConversionSlice &slice : slices) {
+				if (slice.failed) {
+					fprintf(stderr, "Failed to scale frame\n");
+					return 1;
+				}
+			}
+			double ms = std::chrono::duration<double, std::milli>(end - start).count() / frame_count;
+			if (requested == 1) {
+				single_slice_ms = ms;
+			}
+			printf("%-6s %-7d %12.3f %10.1f %8.2fx\n", resolution.name, slice_count, ms, 1000.0 / ms, single_slice_ms / ms);
+		}
+
+		for (SwsContext *context : contexts) {
+			sws_freeContext(context);
+		}
+		av_frame_free(&frame);
+	}
+	return 0;
+}
@@ -37,6 +37,9 @@
 #include "core/string/print_string.h"
 #endif
 
+#include "ffmpeg_codec_registry.h"
+#include "ffmpeg_decode_scheduler.h"
+#include "ffmpeg_decoder_registry.h"
 #include "ffmpeg_video_stream.h"
 #include "video_stream_ffmpeg_loader.h"
 #include "ffmpeg_audio_stream.h"
@@ -44,39 +47,14 @@
 
 Ref<VideoStreamFFMpegLoader> video_ffmpeg_loader;
 Ref<AudioStreamFFMpegLoader> audio_ffmpeg_loader;
-
-static void print_codecs() {
-	const AVCodecDescriptor *desc = NULL;
-	char msg[512] = { 0 };
-	print_line("Supported video codecs:");
-	while ((desc = avcodec_descriptor_next(desc))) {
-		const AVCodec *codec = NULL;
-		void *i = NULL;
-		bool found = false;
-		while ((codec = av_codec_iterate(&i))) {
-			if (codec->id == desc->id && av_codec_is_decoder(codec)) {
-				if (!found && (avcodec_find_decoder(desc->id) || avcodec_find_encoder(desc->id))) {
-					snprintf(msg, sizeof(msg) - 1, "\t%s%s%s",
-							avcodec_find_decoder(desc->id) ? "decode " : "",
-							avcodec_find_encoder(desc->id) ? "encode " : "",
-							desc->name);
-					found = true;
-					print_line(msg);
-				}
-				if (strcmp(codec->name, desc->name) != 0) {
-					snprintf(msg, sizeof(msg) - 1, "\t  codec: %s", codec->name);
-					print_line(msg);
-				}
-			}
-		}
-	}
-}
+FFmpegCodecRegistry *codec_registry = nullptr;
+FFmpegDecodeScheduler *decode_scheduler = nullptr;
+FFmpegDecoderRegistry *decoder_registry = nullptr;
 
 void initialize_ffmpeg_module(ModuleInitializationLevel p_level) {
 	if (p_level != MODULE_INITIALIZATION_LEVEL_SCENE) {
 		return;
 	}
-	print_codecs();
 	GDREGISTER_ABSTRACT_CLASS(FFmpegVideoStreamPlayback);
 	GDREGISTER_ABSTRACT_CLASS(VideoStreamFFMpegLoader);
 	GDREGISTER_CLASS(FFmpegVideoStream);
@@ -85,6 +63,10 @@ void initialize_ffmpeg_module(ModuleInitializationLevel p_level) {
 	GDREGISTER_ABSTRACT_CLASS(AudioStreamFFMpegLoader);
 	GDREGISTER_CLASS(FFmpegAudioStream);
 
+	// Filled in on first use, so projects that never touch a video don't pay for walking FFmpeg's codec list.
+	codec_registry = memnew(FFmpegCodecRegistry);
+	decode_scheduler = memnew(FFmpegDecodeScheduler);
+	decoder_registry = memnew(FFmpegDecoderRegistry);
 	video_ffmpeg_loader.instantiate();
 	audio_ffmpeg_loader.instantiate();
 #ifdef GDEXTENSION
@@ -109,6 +91,12 @@ void uninitialize_ffmpeg_module(ModuleInitializationLevel p_level) {
 #endif
 	video_ffmpeg_loader.unref();
 	audio_ffmpeg_loader.unref();
+	memdelete(decoder_registry);
+	decoder_registry = nullptr;
+	memdelete(decode_scheduler);
+	decode_scheduler = nullptr;
+	memdelete(codec_registry);
+	codec_registry = nullptr;
 }
 
 #ifdef GDEXTENSION
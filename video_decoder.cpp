@@ -37,16 +37,53 @@
 #include "gdextension_build/gdex_print.h"
 #endif
 
+#ifdef GDEXTENSION
+#include <godot_cpp/classes/audio_server.hpp>
+#include <godot_cpp/classes/worker_thread_pool.hpp>
+#else
+#include "core/object/worker_thread_pool.h"
+#include "servers/audio_server.h"
+#endif
+
 extern "C" {
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
+#include "libavutil/pixdesc.h"
 }
 
-#include <chrono>
-
-using namespace std::chrono;
-
 const int MAX_PENDING_FRAMES = 3;
+// A single packet can decode into several audio frames, so the queue has room beyond what we keep buffered.
+const int MAX_QUEUED_AUDIO_FRAMES = 64;
+const int MAX_PENDING_AUDIO_FRAMES = MAX_QUEUED_AUDIO_FRAMES / 2;
+// Roughly a second of compressed data for typical streams, enough to keep audio flowing while a large
+// video frame decodes.
+const uint32_t MAX_QUEUED_VIDEO_PACKETS = 32;
+const uint32_t MAX_QUEUED_AUDIO_PACKETS = 64;
+const uint64_t STREAM_OPEN_TIMEOUT_MSEC = 10000;
+// Automatic slicing gives each conversion worker at least this many rows, 1080p gets 4 slices and 4K 8.
+const int MIN_ROWS_PER_CONVERSION_SLICE = 270;
+const int MAX_CONVERSION_SLICES = 16;
+// Live mode skips converting frames that already have a newer one queued, but never too many in a row so a
+// decoder that can't keep up still shows something.
+const int MAX_LIVE_FRAMES_SKIPPED_IN_ROW = 8;
+// Enough to cover the queued frames plus the ones held by the playback.
+const uint32_t MAX_POOLED_FRAMES = MAX_PENDING_FRAMES * 2 + 2;
+const uint32_t MAX_POOLED_IMAGES = MAX_POOLED_FRAMES * 3;
+// Inserting a frame into a full scrub cache can evict a few small ones to make room.
+const uint32_t MAX_POOLED_SCRUB_IMAGES = 4 * 3;
+// Frames after which the pools are expected to have reached their steady state size.
+const uint64_t POOL_WARMUP_FRAMES = MAX_POOLED_FRAMES * 4;
+// Most frames a reverse playback window outputs, longer GOPs are split into several windows. Two windows
+// are alive at once, one being output and the one before it being decoded.
+const uint32_t MAX_REVERSE_WINDOW_FRAMES = 30;
+const float MIN_PLAYBACK_SPEED = 0.25f;
+const float MAX_PLAYBACK_SPEED = 16.0f;
+// Faster than this only keyframes are decoded, and audio is muted.
+const float MAX_FULL_DECODE_SPEED = 4.0f;
+// From this speed on most frames are skipped anyway, so the ones nothing references aren't decoded at all.
+const float MIN_NONREF_SKIP_SPEED = 2.0f;
 
 bool is_hardware_pixel_format(AVPixelFormat p_fmt) {
 	switch (p_fmt) {
@@ -115,29 +152,21 @@ int64_t VideoDecoder::_stream_seek_callback(void *p_opaque, int64_t p_offset, in
 	return decoder->video_file->get_position();
 }
 
-// Ok I know this is ugly but this provides a timeout to the asynch connection
-auto ms = duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()).count();
-
-static int interrupt_cb(void *ctx) 
-{ 
-	bool* ok = reinterpret_cast<bool*>(ctx);
-	if(!*ok)
-	{
-		auto cur = duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()).count();
-		if (cur-ms > 10000)
-		{
-			return 1;
-		}
+int VideoDecoder::_interrupt_callback(void *p_opaque) {
+	VideoDecoder *decoder = (VideoDecoder *)p_opaque;
+	if (decoder->thread_abort.is_set()) {
+		return 1;
 	}
-	
-// do something 
-    return 0;
-} 
-
-static bool ok = false;
-static const AVIOInterruptCB int_cb = { interrupt_cb, NULL }; 
+	// Opening a stream has no timeout of its own, give up on unresponsive servers.
+	if (decoder->open_deadline_msec != 0 && OS::get_singleton()->get_ticks_msec() > decoder->open_deadline_msec) {
+		return 1;
+	}
+	// A blocking read shouldn't hold back a seek, the demuxer picks it up as soon as the read returns.
+	if (decoder->demuxer_started && decoder->pending_commands.get() > 0) {
+		return 1;
+	}
+	return 0;
+}
 
 void VideoDecoder::prepare_decoding() {
 	int open_input_res;
@@ -149,6 +178,8 @@ void VideoDecoder::prepare_decoding() {
 		format_context = avformat_alloc_context();
 		format_context->pb = io_context;
 		format_context->flags |= AVFMT_FLAG_GENPTS; // required for most HW decoders as they only read `pts`
+		format_context->interrupt_callback.callback = &VideoDecoder::_interrupt_callback;
+		format_context->interrupt_callback.opaque = this;
 		AVDictionary* opts = nullptr;
 		av_dict_set(&opts, "buffer_size", "655360", 0);
 		av_dict_set(&opts, "hwaccel", "auto", 0);
@@ -160,7 +191,8 @@ void VideoDecoder::prepare_decoding() {
 	}else if (!video_path.is_empty()){
 		avformat_network_init();
 		format_context = avformat_alloc_context();
-		format_context->flags |= AVFMT_FLAG_GENPTS | AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_DISCARD_CORRUPT | AVFMT_FLAG_NONBLOCK; 
+		// Reads block on the demuxer thread, the interrupt callback takes care of cancelling them.
+		format_context->flags |= AVFMT_FLAG_GENPTS | AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_DISCARD_CORRUPT;
 		AVDictionary* opts = nullptr;
 		av_dict_set(&opts, "buffer_size", "655360", 0);
 		av_dict_set(&opts, "hwaccel", "auto", 0);
@@ -174,17 +206,19 @@ void VideoDecoder::prepare_decoding() {
 		// This works better over VPN interestingly enough
 		av_dict_set(&opts, "rtsp_transport", "tcp", 0);
 		av_dict_set(&opts, "rtsp_flags", "prefer_tcp", 0);
+		if (live) {
+			// Don't hold packets back to fix up their order or timing, we only ever show the newest frame anyway.
+			av_dict_set(&opts, "max_delay", "0", 0);
+			av_dict_set(&opts, "reorder_queue_size", "0", 0);
+		}
 		//av_dict_set(&opts, "refcounted_frames", "1", 0);
 		print_line("Trying to open url:", video_path.ascii().get_data());
 
-		format_context->interrupt_callback = int_cb;
-		format_context->interrupt_callback.opaque = &ok;
-		ms = duration_cast<milliseconds>(
-				system_clock::now().time_since_epoch())
-					 .count();
-		ok = false;
+		format_context->interrupt_callback.callback = &VideoDecoder::_interrupt_callback;
+		format_context->interrupt_callback.opaque = this;
+		open_deadline_msec = OS::get_singleton()->get_ticks_msec() + STREAM_OPEN_TIMEOUT_MSEC;
 		open_input_res = avformat_open_input(&format_context, video_path.utf8().get_data(), nullptr, &opts);
-		ok = true;
+		open_deadline_msec = 0;
 		av_dict_free(&opts);
 	}
 
@@ -206,6 +240,9 @@ void VideoDecoder::prepare_decoding() {
 		duration = format_context->duration / (double)AV_TIME_BASE * 1000.0;
 	}
 
+	AVRational frame_rate = av_guess_frame_rate(format_context, video_stream, nullptr);
+	frame_duration = frame_rate.num > 0 ? 1000.0 * frame_rate.den / frame_rate.num : 0.0;
+
 	//@DEBUG
 	if (duration < 0) {
 		duration = 10000000;
@@ -219,6 +256,11 @@ void VideoDecoder::prepare_decoding() {
 }
 
 void VideoDecoder::recreate_codec_context() {
+	recreate_video_codec_context();
+	recreate_audio_codec_context();
+}
+
+void VideoDecoder::recreate_video_codec_context() {
 	if (video_stream == nullptr) {
 		return;
 	}
@@ -232,6 +274,8 @@ void VideoDecoder::recreate_codec_context() {
 		}
 		video_codec_context = avcodec_alloc_context3(info.codec->get_codec_ptr());
 		video_codec_context->pkt_timebase = video_stream->time_base;
+		// Recreated on the decode thread after a HW failure, keep the mode it was running in.
+		video_codec_context->skip_frame = video_stage.keyframes_only ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
 		
 		//DEBUG
 		//video_codec_context->has_b_frames = false;
@@ -250,7 +294,9 @@ void VideoDecoder::recreate_codec_context() {
 
 			print_line(vformat("Succesfully opened hardware video decoder context %s for codec %s", av_hwdevice_get_type_name(info.device_type), info.codec->get_codec_ptr()->name));
 		} else {
-			video_codec_context->thread_count = 0;
+			// The codec's own threads come on top of the scheduler workers, split the cores between the open streams.
+			FFmpegDecodeScheduler *scheduler = FFmpegDecodeScheduler::get_singleton();
+			video_codec_context->thread_count = scheduler != nullptr ? scheduler->get_codec_thread_count() : 0;
 		}
 
 		int open_codec_result = avcodec_open2(video_codec_context, info.codec->get_codec_ptr(), nullptr);
@@ -259,11 +305,15 @@ void VideoDecoder::recreate_codec_context() {
 		print_line("Succesfully initialized decoder:", info.codec->get_codec_ptr()->name);
 		break;
 	}
+}
+
+void VideoDecoder::recreate_audio_codec_context() {
 	if (!audio_stream) {
 		return;
 	}
-	codec_params = *audio_stream->codecpar;
-	const AVCodec *codec = avcodec_find_decoder(codec_params.codec_id);
+	AVCodecParameters codec_params = *audio_stream->codecpar;
+	Ref<FFmpegCodec> default_codec = FFmpegCodecRegistry::get_singleton()->get_default_decoder(codec_params.codec_id);
+	const AVCodec *codec = default_codec.is_valid() ? default_codec->get_codec_ptr() : nullptr;
 	if (codec) {
 		if (audio_codec_context != nullptr) {
 			avcodec_free_context(&audio_codec_context);
@@ -310,133 +360,744 @@ VideoDecoder::HardwareVideoDecoder VideoDecoder::from_av_hw_device_type(AVHWDevi
 	return VideoDecoder::NONE;
 }
 
-void VideoDecoder::_seek_command(double p_target_timestamp) {
-	avcodec_flush_buffers(video_codec_context);
-	av_seek_frame(format_context, video_stream->index, (long)(p_target_timestamp / video_time_base_in_seconds / 1000.0), AVSEEK_FLAG_BACKWARD);
+void VideoDecoder::_seek_command(double p_target_timestamp, uint32_t p_serial) {
+	// Decremented first so a newer seek can still interrupt the one below.
+	pending_commands.decrement();
+	_perform_seek(p_target_timestamp, p_serial);
+}
+
+bool VideoDecoder::_seek_with_index(int64_t p_target_pts) {
+	if (seek_index.is_null() || !seek_index->is_ready()) {
+		return false;
+	}
+	FFmpegSeekIndex::Keyframe keyframe;
+	if (!seek_index->find_keyframe(p_target_pts, keyframe)) {
+		return false;
+	}
+
+	// Same rule as ffplay, only demuxers that resync on their own (MPEG-TS/PS) cope with landing on an arbitrary offset.
+	const AVInputFormat *input_format = format_context->iformat;
+	bool seek_by_bytes = keyframe.pos >= 0 && !(input_format->flags & AVFMT_NO_BYTE_SEEK) && (input_format->flags & AVFMT_TS_DISCONT) && strcmp(input_format->name, "ogg") != 0;
+	if (seek_by_bytes && av_seek_frame(format_context, -1, keyframe.pos, AVSEEK_FLAG_BYTE) >= 0) {
+		return true;
+	}
+
+	// Everyone else seeks by timestamp, handing them the entries they would otherwise have to find by
+	// scanning the file first.
+	if (!demux_seek_index_applied) {
+		demux_seek_index_applied = true;
+		const LocalVector<FFmpegSeekIndex::DemuxerEntry> &entries = seek_index->get_demuxer_entries();
+		if (entries.size() > (uint32_t)avformat_index_get_entries_count(video_stream)) {
+			for (const FFmpegSeekIndex::DemuxerEntry &entry : entries) {
+				av_add_index_entry(video_stream, entry.pos, entry.timestamp, 0, 0, AVINDEX_KEYFRAME);
+			}
+		}
+	}
+	return av_seek_frame(format_context, video_stream->index, keyframe.pts, AVSEEK_FLAG_BACKWARD) >= 0;
+}
+
+void VideoDecoder::_seek_demuxer(int64_t p_target_pts) {
+	if (!_seek_with_index(p_target_pts)) {
+		av_seek_frame(format_context, video_stream->index, p_target_pts, AVSEEK_FLAG_BACKWARD);
+	}
+}
+
+void VideoDecoder::_perform_seek(double p_target_timestamp, uint32_t p_serial) {
+	demux_reverse = reverse.is_set();
+	demux_reverse_window_done = false;
+	if (demux_reverse) {
+		// The frame at the target is output first, playback moves back from there.
+		reverse_window_end = p_target_timestamp + 0.001;
+		_start_reverse_window();
+	} else {
+		_seek_demuxer((int64_t)(p_target_timestamp / video_time_base_in_seconds / 1000.0));
+	}
 	// No need to seek the audio stream separately since it is seeked automatically with the video stream
-	// due to being in the same file
-	if (has_audio) {
-		avcodec_flush_buffers(audio_codec_context);
+	// due to being in the same file.
+	// The codecs belong to the decode threads, they flush them when the first packet with the new serial arrives.
+	if (stalled_queue != nullptr) {
+		av_packet_unref(demux_packet);
+		stalled_queue = nullptr;
 	}
-	skip_output_until_time = p_target_timestamp;
+	demux_reached_end = false;
+	demux_serial = p_serial;
+	demux_seek_time = p_target_timestamp;
 	decoder_state = DecoderState::READY;
-	skip_current_outputs.clear();
 }
 
-void VideoDecoder::_thread_func(void *userdata) {
-	VideoDecoder *decoder = (VideoDecoder *)userdata;
-	AVPacket *packet = av_packet_alloc();
-	AVFrame *receive_frame = av_frame_alloc();
+bool VideoDecoder::_get_packet_time(const AVPacket *p_packet, double &r_time) const {
+	int64_t timestamp = p_packet->pts != AV_NOPTS_VALUE ? p_packet->pts : p_packet->dts;
+	if (timestamp == AV_NOPTS_VALUE) {
+		return false;
+	}
+	r_time = (timestamp - video_stream->start_time) * video_time_base_in_seconds * 1000.0;
+	return true;
+}
+
+void VideoDecoder::_start_reverse_window() {
+	reverse_window_times.clear();
+	reverse_window_has_keyframe = false;
+	reverse_window_keyframe_time = -Math_INF;
+	// The last pts before the window's end, the demuxer lands on the keyframe at or before it.
+	int64_t target_pts = video_stream->start_time + (int64_t)Math::ceil(reverse_window_end / 1000.0 / video_time_base_in_seconds) - 1;
+	_seek_demuxer(target_pts);
+}
+
+bool VideoDecoder::_is_past_reverse_window(const AVPacket *p_packet) const {
+	// Decode order never goes back and no frame is shown before it's decoded, so once dts reaches the window's
+	// end every frame still to come is shown after it.
+	if (p_packet->dts != AV_NOPTS_VALUE) {
+		return (p_packet->dts - video_stream->start_time) * video_time_base_in_seconds * 1000.0 >= reverse_window_end;
+	}
+	// Without dts, frames shown earlier can follow for as long as the codec reorders.
+	int delay = video_stream->codecpar->video_delay;
+	if (p_packet->pts == AV_NOPTS_VALUE || (delay > 0 && frame_duration <= 0.0)) {
+		return false;
+	}
+	double time = (p_packet->pts - video_stream->start_time) * video_time_base_in_seconds * 1000.0;
+	return time >= reverse_window_end + delay * frame_duration;
+}
+
+void VideoDecoder::_demux_reverse_packet() {
+	double time = 0.0;
+	bool has_time = _get_packet_time(demux_packet, time);
+	bool keyframe = demux_packet->flags & AV_PKT_FLAG_KEY;
+	if ((keyframe && has_time && time >= reverse_window_end) || _is_past_reverse_window(demux_packet)) {
+		// Nothing from here on is shown in the window, the codec is drained now instead of decoding up to
+		// the next keyframe.
+		av_packet_unref(demux_packet);
+		demux_reverse_window_done = true;
+		return;
+	}
+	if (keyframe && !reverse_window_has_keyframe) {
+		reverse_window_has_keyframe = true;
+		if (has_time) {
+			reverse_window_keyframe_time = time;
+		}
+	}
+	if (!reverse_window_has_keyframe) {
+		// The demuxer landed before the keyframe, these can't be decoded without what came before them.
+		av_packet_unref(demux_packet);
+		return;
+	}
+	if (has_time && time < reverse_window_end) {
+		reverse_window_times.push_back(time);
+	}
+	_queue_demuxed_packet(video_stage.packets);
+}
+
+void VideoDecoder::_finish_reverse_window() {
+	demux_reverse_window_done = false;
+	if (reverse_window_times.is_empty()) {
+		// Nothing left before the window's end, playback reached the start of the stream.
+		if (looping) {
+			reverse_window_end = get_duration() + frame_duration;
+			_start_reverse_window();
+			return;
+		}
+		video_stage.packets->push(nullptr, FFmpegPacketQueue::ENTRY_END_OF_STREAM, demux_serial, -1.0);
+		_wake_stage(video_stage);
+		decoder_state = DecoderState::END_OF_STREAM;
+		return;
+	}
+
+	// Long GOPs only output their last frames, the next window decodes the same GOP up to those.
+	reverse_window_times.sort();
+	uint32_t first_output = reverse_window_times.size() > MAX_REVERSE_WINDOW_FRAMES ? reverse_window_times.size() - MAX_REVERSE_WINDOW_FRAMES : 0;
+	// Open GOPs start with frames that need the GOP before them, those are left to the next window.
+	double window_start = MAX(reverse_window_times[first_output], reverse_window_keyframe_time);
+	video_stage.packets->push(nullptr, FFmpegPacketQueue::ENTRY_REVERSE_WINDOW_END, demux_serial, window_start, reverse_window_end);
+	_wake_stage(video_stage);
+
+	reverse_window_end = window_start;
+	_start_reverse_window();
+}
+
+void VideoDecoder::_output_reverse_window(DecodeStage &p_stage, const FFmpegPacketQueue::Entry &p_entry, AVFrame *p_receive_frame) {
+	ZoneScopedN("Video decoder reverse window");
+	// The codec is still holding on to the window's last frames.
+	_send_packet(p_stage, p_receive_frame, nullptr);
+	avcodec_flush_buffers(_get_codec_context(p_stage));
+
+	// Decoded in presentation order, _can_decode makes sure the previous window is out by now.
+	for (int64_t i = (int64_t)reverse_window_frames.size() - 1; i >= 0; i--) {
+		const Ref<DecodedFrame> &frame = reverse_window_frames[i];
+		if (frame->get_time() < p_entry.seek_time) {
+			return_frame(frame);
+		} else {
+			pending_output_frames.push_back(frame);
+		}
+	}
+	reverse_window_frames.clear();
+	pending_output_index = 0;
+	_emit_pending_frames();
+}
+
+void VideoDecoder::_emit_pending_frames() {
+	while (pending_output_index < pending_output_frames.size()) {
+		Ref<DecodedFrame> &frame = pending_output_frames[pending_output_index];
+		if (_is_output_stale(frame->get_serial())) {
+			return_frame(frame);
+		} else if (decoded_frames.push(frame)) {
+			last_decoded_frame_time.set(frame->get_time());
+		} else {
+			return;
+		}
+		frame.unref();
+		pending_output_index++;
+	}
+	pending_output_frames.clear();
+	pending_output_index = 0;
+}
+
+void VideoDecoder::_clear_pending_frames() {
+	for (const Ref<DecodedFrame> &frame : reverse_window_frames) {
+		return_frame(frame);
+	}
+	for (uint32_t i = pending_output_index; i < pending_output_frames.size(); i++) {
+		return_frame(pending_output_frames[i]);
+	}
+	reverse_window_frames.clear();
+	pending_output_frames.clear();
+	pending_output_index = 0;
+}
+
+bool VideoDecoder::_serve_seek_from_scrub_cache(double p_time, uint32_t p_serial) {
+	// Resuming after a hit decodes forwards from the served frame.
+	if (scrub_cache_budget.get() == 0 || live || reverse.is_set()) {
+		return false;
+	}
+	MutexLock lock(scrub_cache_mutex);
+	uint32_t index = _scrub_cache_upper_bound(p_time);
+	if (index == 0) {
+		return false;
+	}
+	ScrubCacheEntry &entry = scrub_cache[index - 1];
+	if (p_time >= entry.end_time && p_time != entry.time) {
+		return false;
+	}
+	ZoneScopedN("Video decoder scrub cache hit");
+	entry.last_used = ++scrub_cache_use_count;
+
+	Ref<DecodedFrame> frame = memnew(DecodedFrame(entry.time, entry.image));
+	frame->set_yuv_planes(entry.chroma_image, entry.chroma_v_image, entry.plane_layout, entry.full_range, entry.bt709);
+#ifdef FFMPEG_MT_GPU_UPLOAD
+	frame->set_texture(ImageTexture::create_from_image(entry.image));
+#endif
+	frame->serial = p_serial;
+	scrub_frame = frame;
+	scrub_resume_pending = true;
+	scrub_resume_time = entry.end_time;
+	// Keeps the demuxer from reading on at the old position, everything it produced there is stale now.
+	demux_held.set();
+
+	seek_landing_pts.set(entry.pts);
+	landed_seek_serial.set(p_serial);
+	return true;
+}
+
+void VideoDecoder::_resume_after_scrub_seek() {
+	scrub_resume_pending = false;
+	pending_commands.increment();
+	demux_held.clear();
+	_wake_all();
+	// Same serial as the seek the cache served, the frames from here on continue where it left off.
+	decoder_commands.push(this, &VideoDecoder::_seek_command, scrub_resume_time, seek_serial.get());
+}
+
+bool VideoDecoder::_is_filling_scrub_cache() const {
+	return scrub_mode.is_set() && scrub_cache_budget.get() > 0 && !live;
+}
 
+uint32_t VideoDecoder::_scrub_cache_upper_bound(double p_time) const {
+	// First entry after p_time.
+	uint32_t low = 0;
+	uint32_t high = scrub_cache.size();
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		if (scrub_cache[middle].time <= p_time) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+void VideoDecoder::_cache_scrub_frame(const Ref<DecodedFrame> &p_frame, int64_t p_pts, uint32_t p_serial) {
+	ZoneScopedN("Video decoder scrub cache insert");
+	uint64_t budget = scrub_cache_budget.get();
+	uint64_t size = 0;
+	const Ref<Image> planes[] = { p_frame->image, p_frame->chroma_image, p_frame->chroma_v_image };
+	for (const Ref<Image> &plane : planes) {
+		if (plane.is_valid()) {
+			size += plane->get_data_size();
+		}
+	}
+	if (size == 0 || size > budget) {
+		return;
+	}
+
+	MutexLock lock(scrub_cache_mutex);
+	if (p_frame->image->get_size() != scrub_cache_image_size) {
+		// Served frames must match freshly decoded ones, e.g. after the target size changed.
+		_clear_scrub_cache();
+		scrub_cache_image_size = p_frame->image->get_size();
+	}
+
+	uint32_t index = _scrub_cache_upper_bound(p_frame->time);
+	if (index > 0 && scrub_cache[index - 1].time == p_frame->time) {
+		index--;
+		_release_scrub_entry(scrub_cache[index]);
+		scrub_cache.remove_at(index);
+	}
+	// Evicted before copying, so the copies reuse the images of the frames they replace.
+	while (scrub_cache_size + size > budget) {
+		uint32_t oldest = 0;
+		for (uint32_t i = 1; i < scrub_cache.size(); i++) {
+			if (scrub_cache[i].last_used < scrub_cache[oldest].last_used) {
+				oldest = i;
+			}
+		}
+		_release_scrub_entry(scrub_cache[oldest]);
+		scrub_cache.remove_at(oldest);
+		if (oldest < index) {
+			index--;
+		}
+	}
+
+	scrub_cache.insert(index, ScrubCacheEntry());
+	ScrubCacheEntry &entry = scrub_cache[index];
+	entry.time = p_frame->time;
+	entry.end_time = p_frame->time + frame_duration;
+	entry.pts = p_pts;
+	entry.image = _copy_scrub_image(p_frame->image, entry.plane_handles[0]);
+	entry.chroma_image = _copy_scrub_image(p_frame->chroma_image, entry.plane_handles[1]);
+	entry.chroma_v_image = _copy_scrub_image(p_frame->chroma_v_image, entry.plane_handles[2]);
+	entry.plane_layout = p_frame->plane_layout;
+	entry.full_range = p_frame->full_range;
+	entry.bt709 = p_frame->bt709;
+	entry.size = size;
+	entry.last_used = ++scrub_cache_use_count;
+	scrub_cache_size += size;
+
+	// Frames decoded back to back cover the whole gap between them, whatever the frame rate does.
+	if (index > 0 && p_serial == scrub_cache_previous_serial && scrub_cache[index - 1].time == scrub_cache_previous_time) {
+		scrub_cache[index - 1].end_time = p_frame->time;
+	}
+	scrub_cache_previous_time = p_frame->time;
+	scrub_cache_previous_serial = p_serial;
+}
+
+Ref<Image> VideoDecoder::_copy_scrub_image(const Ref<Image> &p_image, FFmpegPoolHandle &r_handle) {
+	if (p_image.is_null()) {
+		r_handle = FFmpegPoolHandle();
+		return Ref<Image>();
+	}
+	uint64_t key = _get_image_key(p_image->get_width(), p_image->get_height(), p_image->get_format());
+	Ref<Image> image = scrub_image_pool.acquire(key, r_handle);
+	if (image.is_null()) {
 #ifdef GDEXTENSION
-	String video_decoding_str = vformat("Video decoding %d", OS::get_singleton()->get_thread_caller_id());
+		image = Image::create(p_image->get_width(), p_image->get_height(), false, p_image->get_format());
 #else
-	String video_decoding_str = vformat("Video decoding %d", Thread::get_caller_id());
+		image = Image::create_empty(p_image->get_width(), p_image->get_height(), false, p_image->get_format());
 #endif
-	CharString str = video_decoding_str.utf8();
+		r_handle = scrub_image_pool.insert(image, key);
+	}
+	memcpy(image->ptrw(), p_image->ptr(), p_image->get_data_size());
+	return image;
+}
+
+void VideoDecoder::_release_scrub_entry(ScrubCacheEntry &p_entry) {
+	// Frames served from the cache may still show these, the pool skips them until they're let go.
+	for (FFmpegPoolHandle &handle : p_entry.plane_handles) {
+		if (handle.is_valid()) {
+			scrub_image_pool.release(handle);
+		}
+	}
+	scrub_cache_size -= p_entry.size;
+}
+
+void VideoDecoder::_clear_scrub_cache() {
+	for (ScrubCacheEntry &entry : scrub_cache) {
+		_release_scrub_entry(entry);
+	}
+	scrub_cache.clear();
+	scrub_cache_size = 0;
+	scrub_cache_previous_time = -1.0;
+}
+
+bool VideoDecoder::_is_output_stale(uint32_t p_serial) const {
+	// A seek was requested after this output's packets were demuxed.
+	return p_serial != seek_serial.get();
+}
+
+bool VideoDecoder::_can_demux() const {
+	if (stalled_queue != nullptr) {
+		return stalled_queue->has_free_packet();
+	}
+	if (demux_reverse_window_done) {
+		return video_stage.packets->has_free_packet();
+	}
+	if (demux_reached_end) {
+		// Both decode stages need an end marker.
+		return video_stage.packets->has_free_packet() && (audio_stage.packets == nullptr || audio_stage.packets->has_free_packet());
+	}
+	return true;
+}
+
+bool VideoDecoder::_demuxer_has_work() const {
+	if (thread_abort.is_set() || pending_commands.get() > 0) {
+		return true;
+	}
+	if (demux_held.is_set()) {
+		return false;
+	}
+	return decoder_state != DecoderState::END_OF_STREAM && _can_demux();
+}
+
+bool VideoDecoder::_can_decode(const DecodeStage &p_stage) const {
+	if (p_stage.packets->is_empty()) {
+		return false;
+	}
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO) {
+		const FFmpegPacketQueue::Entry *next_entry = p_stage.packets->peek();
+		if (next_entry->end_time >= 0.0) {
+			// Reverse windows decode into a buffer of their own, only outputting one needs the previous one to be out.
+			return next_entry->type != FFmpegPacketQueue::ENTRY_REVERSE_WINDOW_END || pending_output_frames.is_empty();
+		}
+		// In live mode new frames replace the one waiting for the consumer, so there's always room.
+		return live || (pending_output_frames.is_empty() && !decoded_frames.is_full());
+	}
+	// A single packet can decode into several frames, leave room for them.
+	return pending_audio_frames.is_empty() && decoded_audio_frames.size() < MAX_PENDING_AUDIO_FRAMES;
+}
+
+template <class F>
+void VideoDecoder::_wait_until(F p_predicate) {
+	std::unique_lock<std::mutex> lock(wakeup_mutex);
+	idle_threads.increment();
+	// Pairs with the fence in _wake_demuxer, either we see the queue change or the other side sees us idle.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	wakeup_condition.wait(lock, [&]() { return thread_abort.is_set() || p_predicate(); });
+	idle_threads.decrement();
+}
+
+void VideoDecoder::_wake_all() {
+	{
+		std::lock_guard<std::mutex> lock(wakeup_mutex);
+		wakeup_condition.notify_all();
+	}
+	FFmpegDecodeScheduler *scheduler = FFmpegDecodeScheduler::get_singleton();
+	FFmpegDecodeTask *tasks[] = { demux_task, video_stage.task, audio_stage.task };
+	for (FFmpegDecodeTask *task : tasks) {
+		if (task != nullptr) {
+			scheduler->signal(task);
+		}
+	}
+}
+
+void VideoDecoder::_wake_demuxer() {
+	if (demux_task != nullptr) {
+		FFmpegDecodeScheduler::get_singleton()->signal(demux_task);
+		return;
+	}
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (idle_threads.get() > 0) {
+		std::lock_guard<std::mutex> lock(wakeup_mutex);
+		wakeup_condition.notify_all();
+	}
+}
+
+void VideoDecoder::_wake_stage(const DecodeStage &p_stage) {
+	if (p_stage.task != nullptr) {
+		FFmpegDecodeScheduler::get_singleton()->signal(p_stage.task);
+	}
+}
+
+void VideoDecoder::_thread_func(void *userdata) {
+	VideoDecoder *decoder = (VideoDecoder *)userdata;
+
 	while (!decoder->thread_abort.is_set()) {
-		switch (decoder->decoder_state) {
-			case READY:
-			case RUNNING: {
-				decoder->decoded_frames_mutex.lock();
-				bool needs_frame = decoder->decoded_frames.size() < MAX_PENDING_FRAMES;
-				decoder->decoded_frames_mutex.unlock();
-				decoder->audio_buffer_mutex.lock();
-				bool needs_audio_frame = decoder->decoded_audio_frames.size() < MAX_PENDING_FRAMES;
-				decoder->audio_buffer_mutex.unlock();
-
-				if (needs_frame||needs_audio_frame) {
-					FrameMarkStart(video_decoding);
-					decoder->_decode_next_frame(packet, receive_frame);
-					FrameMarkEnd(video_decoding);
-				} else {
-					decoder->decoder_state = DecoderState::READY;
-					OS::get_singleton()->delay_usec(1000);
-				}
+		switch (decoder->_demux_step()) {
+			case FFmpegDecodeTask::STEP_IDLE: {
+				decoder->_wait_until([decoder]() { return decoder->_demuxer_has_work(); });
 			} break;
-			case END_OF_STREAM: {
-				// While at the end of the stream, avoid attempting to read further as this comes with a non-negligible overhead.
-				// A Seek() operation will trigger a state change, allowing decoding to potentially start again.
-				OS::get_singleton()->delay_usec(50000);
+			case FFmpegDecodeTask::STEP_RETRY_LATER: {
+				OS::get_singleton()->delay_usec(1000);
 			} break;
 			default: {
-				ERR_PRINT("Invalid decoder state");
 			} break;
 		}
-		decoder->decoder_commands.flush_if_pending();
 	}
 
-	av_packet_free(&packet);
-	av_frame_free(&receive_frame);
-
 	if (decoder->decoder_state != DecoderState::FAULTED) {
 		decoder->decoder_state = DecoderState::STOPPED;
 	}
 }
 
-void VideoDecoder::_decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_frame) {
-	ZoneScopedN("Video decoder decode next frame");
-	int read_frame_result = 0;
+FFmpegDecodeTask::StepResult VideoDecoder::_demux_task_func(void *p_userdata) {
+	return ((VideoDecoder *)p_userdata)->_demux_step();
+}
+
+FFmpegDecodeTask::StepResult VideoDecoder::_decode_task_func(void *p_userdata) {
+	DecodeStage *stage = (DecodeStage *)p_userdata;
+	return stage->decoder->_decode_step(*stage);
+}
 
-	if (p_packet->buf == nullptr) {
-		read_frame_result = av_read_frame(format_context, p_packet);
+FFmpegDecodeTask::StepResult VideoDecoder::_demux_step() {
+	decoder_commands.flush_if_pending();
+	if (thread_abort.is_set()) {
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+	if (pending_commands.get() > 0) {
+		// A seek is on its way into the command queue, keep going until it lands.
+		return FFmpegDecodeTask::STEP_CONTINUE;
 	}
+	if (demux_held.is_set()) {
+		// Waiting for playback to move past a frame served from the scrub cache.
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+	// While at the end of the stream, avoid attempting to read further as this comes with a non-negligible overhead.
+	// A Seek() operation will trigger a state change, allowing decoding to potentially start again.
+	if (decoder_state == DecoderState::END_OF_STREAM) {
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+	if (!_can_demux()) {
+		decoder_state = DecoderState::READY;
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+	return _demux_next_packet() ? FFmpegDecodeTask::STEP_CONTINUE : FFmpegDecodeTask::STEP_RETRY_LATER;
+}
 
-	if (read_frame_result >= 0) {
-		decoder_state = DecoderState::RUNNING;
+FFmpegDecodeTask::StepResult VideoDecoder::_decode_step(DecodeStage &p_stage) {
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO && !pending_output_frames.is_empty() && !thread_abort.is_set()) {
+		// The consumer made room for more of the reverse window or the frames a drain left behind.
+		_emit_pending_frames();
+	}
+	if (p_stage.media_type == AVMEDIA_TYPE_AUDIO && !pending_audio_frames.is_empty() && !thread_abort.is_set()) {
+		_emit_pending_audio_frames();
+	}
+	if (thread_abort.is_set() || !_can_decode(p_stage)) {
+		return FFmpegDecodeTask::STEP_IDLE;
+	}
+	FFmpegPacketQueue::Entry entry;
+	p_stage.packets->pop(entry);
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO) {
+		FrameMarkStart(video_decoding);
+		_decode_entry(p_stage, entry, p_stage.receive_frame);
+		FrameMarkEnd(video_decoding);
+	} else {
+		FrameMarkStart(audio_decoding);
+		_decode_entry(p_stage, entry, p_stage.receive_frame);
+		FrameMarkEnd(audio_decoding);
+	}
+	p_stage.packets->recycle(entry);
+	// The demuxer may be waiting for a free packet.
+	_wake_demuxer();
+	return FFmpegDecodeTask::STEP_CONTINUE;
+}
 
-		bool unref_packet = true;
+bool VideoDecoder::_demux_next_packet() {
+	ZoneScopedN("Video decoder demux");
+	if (stalled_queue != nullptr) {
+		FFmpegPacketQueue *queue = stalled_queue;
+		stalled_queue = nullptr;
+		_queue_demuxed_packet(queue);
+		return true;
+	}
 
-		if (p_packet->stream_index == video_stream->index || p_packet->stream_index == audio_stream->index) {
-			AVCodecContext *codec_ctx = video_codec_context;
-			if (has_audio && p_packet->stream_index == audio_stream->index) {
-				codec_ctx = audio_codec_context;
-			}
-			int send_packet_result = _send_packet(codec_ctx, p_receive_frame, p_packet);
+	if (demux_reverse_window_done) {
+		_finish_reverse_window();
+		return true;
+	}
 
-			if (send_packet_result == -EAGAIN) {
-				unref_packet = false;
-			}
+	if (demux_reached_end) {
+		FFmpegPacketQueue::EntryType type = looping ? FFmpegPacketQueue::ENTRY_LOOP : FFmpegPacketQueue::ENTRY_END_OF_STREAM;
+		video_stage.packets->push(nullptr, type, demux_serial, demux_seek_time);
+		if (audio_stage.packets != nullptr) {
+			audio_stage.packets->push(nullptr, type, demux_serial, demux_seek_time);
+		}
+		_wake_stage(video_stage);
+		_wake_stage(audio_stage);
+		demux_reached_end = false;
+		if (looping) {
+			// Keep the serial, frames from the previous loop are still valid for the consumer.
+			_perform_seek(0, demux_serial);
+		} else {
+			decoder_state = DecoderState::END_OF_STREAM;
 		}
+		return true;
+	}
+
+	int read_frame_result = av_read_frame(format_context, demux_packet);
+
+	if (read_frame_result >= 0) {
+		decoder_state = DecoderState::RUNNING;
 
-		if (unref_packet) {
-			av_packet_unref(p_packet);
+		if (demux_packet->stream_index == video_stream->index) {
+			if (demux_reverse) {
+				_demux_reverse_packet();
+			} else if (_should_drop_video_packet(demux_packet)) {
+				av_packet_unref(demux_packet);
+			} else {
+				_queue_demuxed_packet(video_stage.packets);
+			}
+		} else if (audio_stage.packets != nullptr && !demux_reverse && demux_packet->stream_index == audio_stream->index) {
+			_queue_demuxed_packet(audio_stage.packets);
+		} else {
+			av_packet_unref(demux_packet);
 		}
 	} else if (read_frame_result == AVERROR_EOF) {
-		_send_packet(video_codec_context, p_receive_frame, nullptr);
-		if (has_audio) {
-			_send_packet(audio_codec_context, p_receive_frame, nullptr);
-		}
-		if (looping) {
-			seek(0);
+		if (demux_reverse) {
+			demux_reverse_window_done = true;
 		} else {
-			decoder_state = DecoderState::END_OF_STREAM;
+			demux_reached_end = true;
 		}
+	} else if (read_frame_result == AVERROR_EXIT) {
+		// Interrupted by a pending command or shutdown, both are handled by the next step.
 	} else if (read_frame_result == -EAGAIN) {
+		// Only demuxers that don't honor blocking reads get here.
 		decoder_state = DecoderState::READY;
-		OS::get_singleton()->delay_usec(1000);
+		return false;
 	} else {
 		print_line(vformat("Failed to read data into avcodec packet: %s", ffmpeg_video_get_error_message(read_frame_result)));
 	}
+	return true;
+}
+
+void VideoDecoder::_queue_demuxed_packet(FFmpegPacketQueue *p_queue) {
+	double seek_time = demux_reverse ? -1.0 : demux_seek_time;
+	double end_time = demux_reverse ? reverse_window_end : -1.0;
+	if (!p_queue->push(demux_packet, FFmpegPacketQueue::ENTRY_PACKET, demux_serial, seek_time, end_time)) {
+		// Keep the packet around until the decode stage frees a slot.
+		stalled_queue = p_queue;
+		return;
+	}
+	_wake_stage(p_queue == video_stage.packets ? video_stage : audio_stage);
+}
+
+bool VideoDecoder::_wants_keyframes_only() const {
+	return keyframes_only.is_set() || playback_speed.get() > MAX_FULL_DECODE_SPEED;
+}
+
+bool VideoDecoder::_should_drop_video_packet(const AVPacket *p_packet) {
+	bool keyframes_only_now = _wants_keyframes_only();
+	if (keyframes_only_now != demux_keyframes_only) {
+		demux_keyframes_only = keyframes_only_now;
+		demux_waiting_for_keyframe = !keyframes_only_now;
+	}
+	if (p_packet->flags & AV_PKT_FLAG_KEY) {
+		demux_waiting_for_keyframe = false;
+		return false;
+	}
+	return demux_keyframes_only || demux_waiting_for_keyframe;
+}
+
+AVCodecContext *VideoDecoder::_get_codec_context(const DecodeStage &p_stage) const {
+	return p_stage.media_type == AVMEDIA_TYPE_VIDEO ? video_codec_context : audio_codec_context;
+}
+
+void VideoDecoder::_decode_entry(DecodeStage &p_stage, const FFmpegPacketQueue::Entry &p_entry, AVFrame *p_receive_frame) {
+	ZoneScopedN("Video decoder decode entry");
+	if (_is_output_stale(p_entry.serial)) {
+		// Demuxed before a seek that hasn't reached the demuxer yet.
+		return;
+	}
+
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO && video_codec_needs_recreate) {
+		video_codec_needs_recreate = false;
+		recreate_video_codec_context();
+	}
+
+	AVCodecContext *codec_context = _get_codec_context(p_stage);
+	if (codec_context == nullptr) {
+		return;
+	}
+
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO && p_stage.keyframes_only != _wants_keyframes_only()) {
+		// The demuxer already filters packets, this makes the codec skip whatever still gets through.
+		p_stage.keyframes_only = !p_stage.keyframes_only;
+		codec_context->skip_frame = p_stage.keyframes_only ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+	}
+
+	if (p_entry.serial != p_stage.serial) {
+		// First packet after a seek.
+		avcodec_flush_buffers(codec_context);
+		p_stage.serial = p_entry.serial;
+		p_stage.skip_output_until_time = p_entry.seek_time;
+		if (p_stage.media_type == AVMEDIA_TYPE_VIDEO) {
+			_clear_pending_frames();
+			speed_next_output_time = -1.0;
+		} else {
+			// The filter and the resampler still hold audio from before the seek.
+			_free_audio_tempo_graph();
+			audio_resampler.reset();
+			pending_audio_frames.clear();
+			pending_audio_index = 0;
+		}
+	}
+
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO) {
+		p_stage.reverse_end_time = p_entry.end_time;
+	}
+	if (p_entry.type == FFmpegPacketQueue::ENTRY_REVERSE_WINDOW_END) {
+		_output_reverse_window(p_stage, p_entry, p_receive_frame);
+		return;
+	}
+
+	if (p_entry.type != FFmpegPacketQueue::ENTRY_PACKET) {
+		// Drain the frames the codec is still holding on to, it has to be flushed before it accepts new packets.
+		_send_packet(p_stage, p_receive_frame, nullptr);
+		avcodec_flush_buffers(codec_context);
+		p_stage.skip_output_until_time = -1.0;
+		if (p_stage.media_type == AVMEDIA_TYPE_AUDIO) {
+			_free_audio_tempo_graph();
+		}
+		return;
+	}
+
+	if (p_stage.media_type == AVMEDIA_TYPE_VIDEO && !p_stage.keyframes_only) {
+		// Frames before the seek target are never shown, the ones nothing references don't even need decoding.
+		// The codec copies this per packet, so everything from the target on is decoded in full again.
+		AVDiscard skip_frame = AVDISCARD_DEFAULT;
+		if (p_stage.skip_output_until_time >= 0.0 && p_entry.packet->pts != AV_NOPTS_VALUE && !_is_filling_scrub_cache()) {
+			double packet_time = (p_entry.packet->pts - video_stream->start_time) * video_time_base_in_seconds * 1000.0;
+			if (packet_time < p_stage.skip_output_until_time) {
+				skip_frame = AVDISCARD_NONREF;
+			}
+		}
+		if (playback_speed.get() >= MIN_NONREF_SKIP_SPEED && p_stage.reverse_end_time < 0.0 && !_is_filling_scrub_cache()) {
+			skip_frame = AVDISCARD_NONREF;
+		}
+		codec_context->skip_frame = skip_frame;
+	}
+
+	int send_packet_result;
+	do {
+		// EAGAIN means the codec had output pending, which _send_packet has read by now.
+		send_packet_result = _send_packet(p_stage, p_receive_frame, p_entry.packet);
+	} while (send_packet_result == -EAGAIN && !thread_abort.is_set());
 }
 
-int VideoDecoder::_send_packet(AVCodecContext *p_codec_context, AVFrame *p_receive_frame, AVPacket *p_packet) {
+int VideoDecoder::_send_packet(DecodeStage &p_stage, AVFrame *p_receive_frame, AVPacket *p_packet) {
 	ZoneScopedN("Video/audio decoder send packet");
+	AVCodecContext *codec_context = _get_codec_context(p_stage);
 	// send the packet for decoding.
 	int send_packet_result;
 	{
 		ZoneNamedN(__avcodec_send_packet, "avcodec_send_packet", true);
-		send_packet_result = avcodec_send_packet(p_codec_context, p_packet);
+		send_packet_result = avcodec_send_packet(codec_context, p_packet);
 	}
 	// Note: EAGAIN can be returned if there's too many pending frames, which we have to read,
 	// otherwise we would get stuck in an infinite loop.
 	if (send_packet_result == 0 || send_packet_result == -EAGAIN) {
-		if (p_codec_context == video_codec_context) {
+		if (p_stage.media_type == AVMEDIA_TYPE_VIDEO) {
 			_read_decoded_frames(p_receive_frame);
 		} else {
 			_read_decoded_audio_frames(p_receive_frame);
 		}
-	} else if (format_context->streams[p_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+	} else if (p_stage.media_type == AVMEDIA_TYPE_VIDEO) {
 		print_line(vformat("Failed to send avcodec packet: %s", ffmpeg_video_get_error_message(send_packet_result)));
 		_try_disable_hw_decoding(send_packet_result);
 	}
@@ -457,14 +1118,13 @@ void VideoDecoder::_try_disable_hw_decoding(int p_error_code) {
 	} else {
 		print_line("Disabling hardware decoding of the video due to an unexpected error");
 	}
-	decoder_commands.push(this, &VideoDecoder::recreate_codec_context);
+	// The codec is in use right now, recreate it before decoding the next packet.
+	video_codec_needs_recreate = true;
 }
 
 int created_texture = 0;
 
 void VideoDecoder::_read_decoded_frames(AVFrame *p_received_frame) {
-	Ref<Image> image;
-	PackedByteArray unwrapped_frame;
 	while (true) {
 		ZoneScopedN("Video decoder read decoded frame");
 		int receive_frame_result = avcodec_receive_frame(video_codec_context, p_received_frame);
@@ -483,66 +1143,112 @@ void VideoDecoder::_read_decoded_frames(AVFrame *p_received_frame) {
 		int64_t frame_timestamp = p_received_frame->best_effort_timestamp != AV_NOPTS_VALUE ? p_received_frame->best_effort_timestamp : p_received_frame->pts;
 		double frame_time = (frame_timestamp - video_stream->start_time) * video_time_base_in_seconds * 1000.0;
 
-		if (skip_output_until_time > frame_time || skip_current_outputs.is_set()) {
+		bool reverse_window = video_stage.reverse_end_time >= 0.0;
+		if (reverse_window && frame_time >= video_stage.reverse_end_time) {
+			// Already output by the window after this one.
 			continue;
 		}
 
-		Ref<FFmpegFrame> frame;
-		if (is_hardware_pixel_format((AVPixelFormat)p_received_frame->format)) {
-			Ref<FFmpegFrame> hw_transfer_frame;
-			if (hw_transfer_frames.size() > 0) {
-				hw_transfer_frame = hw_transfer_frames[0];
-				hw_transfer_frames.pop_front();
+		// A keyframe before the seek target is the closest thing to it there will be in keyframes only mode.
+		bool before_seek_target = video_stage.skip_output_until_time > frame_time && !video_stage.keyframes_only;
+		// Scrub mode converts the frames leading up to the target too, they only go to the scrub cache.
+		bool cache_only = before_seek_target && _is_filling_scrub_cache();
+		if ((before_seek_target && !cache_only) || _is_output_stale(video_stage.serial)) {
+			continue;
+		}
+		if (!before_seek_target && video_stage.skip_output_until_time >= 0.0) {
+			// First frame shown since the seek.
+			video_stage.skip_output_until_time = -1.0;
+			seek_landing_pts.set(frame_timestamp);
+			landed_seek_serial.set(video_stage.serial);
+		}
+
+		if (live && !video_stage.packets->is_empty() && live_frames_skipped_in_row < MAX_LIVE_FRAMES_SKIPPED_IN_ROW) {
+			// A newer frame is already on its way, don't bother converting this one.
+			live_frames_skipped_in_row++;
+			dropped_frame_count.increment();
+			av_frame_unref(p_received_frame);
+			continue;
+		}
+		live_frames_skipped_in_row = 0;
+
+		float speed = playback_speed.get();
+		if (speed > 1.0f && !reverse_window && !cache_only && !live) {
+			// Only one frame per displayed frame interval is shown, the rest are dropped before the
+			// hardware transfer and conversion, which keeps fast playback as cheap as 1x.
+			if (frame_time < speed_next_output_time) {
+				av_frame_unref(p_received_frame);
+				continue;
 			}
+			speed_next_output_time = frame_time + frame_duration * (speed - 0.5);
+		}
 
+		AVFrame *frame = p_received_frame;
+		FFmpegPoolHandle hw_transfer_handle;
+		if (is_hardware_pixel_format((AVPixelFormat)p_received_frame->format)) {
+			Ref<FFmpegFrame> hw_transfer_frame = hw_transfer_frame_pool.acquire(0, hw_transfer_handle);
 			if (!hw_transfer_frame.is_valid()) {
-				hw_transfer_frame = Ref<FFmpegFrame>(memnew(FFmpegFrame(Ref<VideoDecoder>(this), (FFmpegFrame::return_frame_callback_t)&VideoDecoder::_hw_transfer_frame_return)));
+				hw_transfer_frame = Ref<FFmpegFrame>(memnew(FFmpegFrame));
+				hw_transfer_handle = hw_transfer_frame_pool.insert(hw_transfer_frame, 0);
+				_count_pool_allocation();
 			}
 
+			// Note: the transfer frame keeps its buffers between uses, av_hwframe_transfer_data writes into them.
 			int transfer_result = av_hwframe_transfer_data(hw_transfer_frame->get_frame(), p_received_frame, 0);
+			av_frame_unref(p_received_frame);
 
 			if (transfer_result < 0) {
 				print_line("Failed to transfer frame from HW decoder:", ffmpeg_video_get_error_message(transfer_result));
+				hw_transfer_frame_pool.release(hw_transfer_handle);
 				_try_disable_hw_decoding(transfer_result);
 				continue;
 			}
 
-			frame = hw_transfer_frame;
-		} else {
-			// copy data to a new AVFrame so that `receiveFrame` can be reused.
-			frame = Ref<FFmpegFrame>(memnew(FFmpegFrame()));
-			av_frame_move_ref(frame->get_frame(), p_received_frame);
+			frame = hw_transfer_frame->get_frame();
 		}
 
-		last_decoded_frame_time.set(frame_time);
+		if (!cache_only && !reverse_window) {
+			last_decoded_frame_time.set(frame_time);
+		}
 
-		// Note: this is the pixel format that the video texture expects internally
-		frame = _ensure_frame_pixel_format(frame, AVPixelFormat::AV_PIX_FMT_RGBA);
-		if (!frame.is_valid()) {
-			continue;
+		Vector2i output_size = _get_output_size(frame->width, frame->height);
+		if (output_size != pool_frame_size) {
+			// A new frame size invalidates every pooled image, give the pools a new warm-up period.
+			pool_frame_size = output_size;
+			frames_since_pool_warmup = 0;
 		}
 
-		ZoneNamedN(image_unwrap, "Image unwrap", true);
-		// Unwrap the image
-		int width = frame->get_frame()->width;
-		int height = frame->get_frame()->height;
-		{
-			ZoneNamedN(image_unwrap_copy, "Image unwrap copy", true);
-
-			int frame_size = frame->get_frame()->buf[0]->size; // Change this if we ever allow RGBA
-			unwrapped_frame.resize(frame_size);
-			uint8_t *unwrapped_frame_ptrw = unwrapped_frame.ptrw();
-			{
-				ZoneNamedN(image_unwrap_memcopy, "memcpy", true);
-				for (int y = 0; y < height; y++) {
-					memcpy(unwrapped_frame_ptrw, frame->get_frame()->data[0] + y * frame->get_frame()->linesize[0], width * 4);
-					unwrapped_frame_ptrw += width * 4;
-				}
-			}
-			unwrapped_frame.resize(width * height * 4);
-			image = Image::create_from_data(width, height, false, Image::FORMAT_RGBA8, unwrapped_frame);
+		Ref<DecodedFrame> decoded_frame;
+#ifdef FFMPEG_MT_GPU_UPLOAD
+		decoded_frame = _unwrap_rgba_frame(frame, frame_time, output_size);
+#else
+		if (output_format == OUTPUT_FORMAT_YUV) {
+			decoded_frame = _unwrap_yuv_frame(frame, frame_time, output_size);
+		} else {
+			decoded_frame = _unwrap_rgba_frame(frame, frame_time, output_size);
+		}
+#endif
+		// The frame is copied into pooled images at this point, so it can be released right away.
+		if (hw_transfer_handle.is_valid()) {
+			hw_transfer_frame_pool.release(hw_transfer_handle);
+		} else {
+			av_frame_unref(p_received_frame);
+		}
+		frames_since_pool_warmup++;
+
+		if (!decoded_frame.is_valid()) {
+			continue;
+		}
+		// Keyframes only output has gaps, it must not pass for the frames in between.
+		if (scrub_cache_budget.get() > 0 && !live && !video_stage.keyframes_only) {
+			_cache_scrub_frame(decoded_frame, frame_timestamp, video_stage.serial);
+		}
+		if (cache_only) {
+			return_frame(decoded_frame);
+			continue;
 		}
 #ifdef FFMPEG_MT_GPU_UPLOAD
+		Ref<Image> image = decoded_frame->get_image();
 		Ref<ImageTexture> tex;
 		available_textures_mutex.lock();
 		if (available_textures.size() > 0) {
@@ -560,17 +1266,171 @@ void VideoDecoder::_read_decoded_frames(AVFrame *p_received_frame) {
 				tex->update(image);
 			}
 		}
-		decoded_frames_mutex.lock();
-		decoded_frames.push_back(memnew(DecodedFrame(frame_time, tex)));
-		decoded_frames_mutex.unlock();
-#else
-		decoded_frames_mutex.lock();
-		if (!skip_current_outputs.is_set()) {
-			decoded_frames.push_back(memnew(DecodedFrame(frame_time, image)));
+		_release_planes(decoded_frame);
+		decoded_frame->set_texture(tex);
+#endif
+		decoded_frame->serial = video_stage.serial;
+		if (_is_output_stale(video_stage.serial)) {
+			return_frame(decoded_frame);
+		} else if (reverse_window) {
+			if (reverse_window_frames.size() >= MAX_REVERSE_WINDOW_FRAMES) {
+				// Only the last frames of a long GOP are output by this window, see _finish_reverse_window().
+				return_frame(reverse_window_frames[0]);
+				reverse_window_frames.remove_at(0);
+			}
+			reverse_window_frames.push_back(decoded_frame);
+		} else if (live) {
+			_publish_live_frame(decoded_frame);
+		} else if (!pending_output_frames.is_empty() || !decoded_frames.push(decoded_frame)) {
+			// Handed out by _emit_pending_frames() once the consumer makes room.
+			pending_output_frames.push_back(decoded_frame);
 		}
-		decoded_frames_mutex.unlock();
+	}
+}
+
+void VideoDecoder::_copy_plane(const uint8_t *p_src, int p_src_linesize, uint8_t *p_dst, int p_row_size, int p_height) {
+	ZoneScopedN("Image plane copy");
+	if (p_src_linesize == p_row_size) {
+		memcpy(p_dst, p_src, p_row_size * p_height);
+		return;
+	}
+	for (int y = 0; y < p_height; y++) {
+		memcpy(p_dst, p_src + y * p_src_linesize, p_row_size);
+		p_dst += p_row_size;
+	}
+}
+
+void VideoDecoder::_count_pool_allocation() {
+	if (frames_since_pool_warmup < POOL_WARMUP_FRAMES) {
+		return;
+	}
+	steady_state_allocation_count.increment();
+#ifdef DEBUG_ENABLED
+	WARN_PRINT_ONCE("FFmpeg video frame pools had to allocate after warm-up, steady state playback is not allocation-free.");
 #endif
+}
+
+uint64_t VideoDecoder::_get_image_key(int p_width, int p_height, Image::Format p_format) {
+	return ((uint64_t)p_width << 40) | ((uint64_t)p_height << 16) | (uint64_t)p_format;
+}
+
+Ref<Image> VideoDecoder::_acquire_image(int p_width, int p_height, Image::Format p_format, FFmpegPoolHandle &r_handle) {
+	uint64_t key = _get_image_key(p_width, p_height, p_format);
+	Ref<Image> image = image_pool.acquire(key, r_handle);
+	if (image.is_valid()) {
+		return image;
 	}
+#ifdef GDEXTENSION
+	image = Image::create(p_width, p_height, false, p_format);
+#else
+	image = Image::create_empty(p_width, p_height, false, p_format);
+#endif
+	r_handle = image_pool.insert(image, key);
+	_count_pool_allocation();
+	return image;
+}
+
+Ref<DecodedFrame> VideoDecoder::_acquire_decoded_frame(double p_frame_time) {
+	FFmpegPoolHandle handle;
+	Ref<DecodedFrame> decoded_frame = decoded_frame_pool.acquire(0, handle);
+	if (!decoded_frame.is_valid()) {
+		decoded_frame = Ref<DecodedFrame>(memnew(DecodedFrame(p_frame_time, Ref<Image>())));
+		handle = decoded_frame_pool.insert(decoded_frame, 0);
+		_count_pool_allocation();
+	}
+	decoded_frame->pool_handle = handle;
+	decoded_frame->set_time(p_frame_time);
+	return decoded_frame;
+}
+
+void VideoDecoder::_release_planes(const Ref<DecodedFrame> &p_frame) {
+	for (FFmpegPoolHandle &handle : p_frame->plane_handles) {
+		if (handle.is_valid()) {
+			image_pool.release(handle);
+			handle = FFmpegPoolHandle();
+		}
+	}
+	// Pooled images are only reused once the pool holds the last reference, so the frame must let go of them.
+	p_frame->image.unref();
+	p_frame->chroma_image.unref();
+	p_frame->chroma_v_image.unref();
+	p_frame->plane_layout = DecodedFrame::PLANE_LAYOUT_RGBA;
+}
+
+Ref<DecodedFrame> VideoDecoder::_unwrap_rgba_frame(AVFrame *p_frame, double p_frame_time, Vector2i p_output_size) {
+	ZoneScopedN("Image unwrap");
+	_normalize_pixel_format(p_frame);
+	bool scaled = p_output_size != Vector2i(p_frame->width, p_frame->height);
+	int width = p_output_size.x;
+	int height = p_output_size.y;
+
+	Ref<DecodedFrame> decoded_frame = _acquire_decoded_frame(p_frame_time);
+	// Note: this is the pixel format that the video texture expects internally
+	Ref<Image> image = _acquire_image(width, height, Image::FORMAT_RGBA8, decoded_frame->plane_handles[0]);
+	decoded_frame->set_image(image);
+
+	uint8_t *image_ptrw = image->ptrw();
+	bool converted = true;
+	if (p_frame->format == AV_PIX_FMT_RGBA && !scaled) {
+		_copy_plane(p_frame->data[0], p_frame->linesize[0], image_ptrw, width * 4, height);
+	} else {
+		uint8_t *dst_data[4] = { image_ptrw, nullptr, nullptr, nullptr };
+		int dst_linesize[4] = { width * 4, 0, 0, 0 };
+		converted = _convert_frame(p_frame, AV_PIX_FMT_RGBA, p_output_size, dst_data, dst_linesize);
+	}
+
+	if (!converted) {
+		return_frame(decoded_frame);
+		return Ref<DecodedFrame>();
+	}
+	return decoded_frame;
+}
+
+Ref<DecodedFrame> VideoDecoder::_unwrap_yuv_frame(AVFrame *p_frame, double p_frame_time, Vector2i p_output_size) {
+	ZoneScopedN("Image unwrap YUV");
+	// Range has to be read before _normalize_pixel_format drops the J variants.
+	bool full_range = p_frame->color_range == AVCOL_RANGE_JPEG || p_frame->format == AV_PIX_FMT_YUVJ420P;
+	bool bt709 = p_frame->colorspace == AVCOL_SPC_BT709 || (p_frame->colorspace == AVCOL_SPC_UNSPECIFIED && p_frame->height >= 720);
+	_normalize_pixel_format(p_frame);
+
+	// NV12 is what most HW decoders hand out, everything else that isn't already YUV420P goes through swscale.
+	// Scaled frames always do, and come out as YUV420P.
+	bool scaled = p_output_size != Vector2i(p_frame->width, p_frame->height);
+	bool nv12 = p_frame->format == AV_PIX_FMT_NV12 && !scaled;
+	int width = p_output_size.x;
+	int height = p_output_size.y;
+	int chroma_width = (width + 1) / 2;
+	int chroma_height = (height + 1) / 2;
+
+	Ref<DecodedFrame> decoded_frame = _acquire_decoded_frame(p_frame_time);
+	Ref<Image> luma_image = _acquire_image(width, height, Image::FORMAT_R8, decoded_frame->plane_handles[0]);
+	Ref<Image> chroma_image = _acquire_image(chroma_width, chroma_height, nv12 ? Image::FORMAT_RG8 : Image::FORMAT_R8, decoded_frame->plane_handles[1]);
+	Ref<Image> chroma_v_image;
+	if (!nv12) {
+		chroma_v_image = _acquire_image(chroma_width, chroma_height, Image::FORMAT_R8, decoded_frame->plane_handles[2]);
+	}
+	decoded_frame->set_image(luma_image);
+	decoded_frame->set_yuv_planes(chroma_image, chroma_v_image, nv12 ? DecodedFrame::PLANE_LAYOUT_NV12 : DecodedFrame::PLANE_LAYOUT_YUV420P, full_range, bt709);
+
+	bool converted = true;
+	if (nv12) {
+		_copy_plane(p_frame->data[0], p_frame->linesize[0], luma_image->ptrw(), width, height);
+		_copy_plane(p_frame->data[1], p_frame->linesize[1], chroma_image->ptrw(), chroma_width * 2, chroma_height);
+	} else if (p_frame->format == AV_PIX_FMT_YUV420P && !scaled) {
+		_copy_plane(p_frame->data[0], p_frame->linesize[0], luma_image->ptrw(), width, height);
+		_copy_plane(p_frame->data[1], p_frame->linesize[1], chroma_image->ptrw(), chroma_width, chroma_height);
+		_copy_plane(p_frame->data[2], p_frame->linesize[2], chroma_v_image->ptrw(), chroma_width, chroma_height);
+	} else {
+		uint8_t *dst_data[4] = { luma_image->ptrw(), chroma_image->ptrw(), chroma_v_image->ptrw(), nullptr };
+		int dst_linesize[4] = { width, chroma_width, chroma_width, 0 };
+		converted = _convert_frame(p_frame, AV_PIX_FMT_YUV420P, p_output_size, dst_data, dst_linesize);
+	}
+
+	if (!converted) {
+		return_frame(decoded_frame);
+		return Ref<DecodedFrame>();
+	}
+	return decoded_frame;
 }
 
 void VideoDecoder::_read_decoded_audio_frames(AVFrame *p_received_frame) {
@@ -593,193 +1453,348 @@ void VideoDecoder::_read_decoded_audio_frames(AVFrame *p_received_frame) {
 		int64_t frame_timestamp = p_received_frame->best_effort_timestamp != AV_NOPTS_VALUE ? p_received_frame->best_effort_timestamp : p_received_frame->pts;
 		double frame_time = (frame_timestamp - audio_stream->start_time) * audio_time_base_in_seconds * 1000.0;
 
-		if (skip_output_until_time > frame_time || skip_current_outputs.is_set()) {
+		if (audio_stage.skip_output_until_time > frame_time || _is_output_stale(audio_stage.serial)) {
 			continue;
 		}
 
-		AVFrame *frame = _ensure_frame_audio_format(p_received_frame, AV_SAMPLE_FMT_FLT);
+		float tempo = playback_speed.get();
+		if (tempo > MAX_FULL_DECODE_SPEED) {
+			// Too fast to be listenable, and the video is keyframes only by now anyway.
+			av_frame_unref(p_received_frame);
+			continue;
+		}
+
+		AVFrame *frame = audio_resampler.convert(p_received_frame);
+		av_frame_unref(p_received_frame);
 
 		if (!frame) {
-			av_frame_unref(p_received_frame);
 			return;
 		}
 
-		ERR_FAIL_COND_MSG(av_sample_fmt_is_planar((AVSampleFormat)frame->format), "Audio format should never be planar, bug?");
+		if (tempo != audio_tempo) {
+			// Samples still buffered in the old graph are dropped, a speed change is audible anyway.
+			_free_audio_tempo_graph();
+			if (tempo != 1.0f && !_build_audio_tempo_graph(frame, tempo)) {
+				// Not retried until the next seek, the audio stays muted until then.
+				audio_tempo = tempo;
+			}
+		}
 
-		int data_size = av_samples_get_buffer_size(nullptr, frame->ch_layout.nb_channels, frame->nb_samples, (AVSampleFormat)frame->format, 1);
-		Ref<DecodedAudioFrame> audio_frame = memnew(DecodedAudioFrame(frame_time));
-		audio_frame->set_time(frame_time);
-		audio_frame->sample_data.resize(data_size / sizeof(float));
-		// memset(audio_frame->sample_data.ptrw(), 0, data_size);
-		memcpy(audio_frame->sample_data.ptrw(), frame->data[0], data_size);
-		audio_buffer_mutex.lock();
-		if (!skip_current_outputs.is_set()) {
-			decoded_audio_frames.push_back(audio_frame);
+		if (audio_tempo == 1.0f) {
+			_push_audio_frame(frame, frame_time);
+		} else if (audio_tempo_graph != nullptr) {
+			ZoneNamedN(__audio_tempo, "Audio tempo filter", true);
+			if (audio_tempo_next_time < 0.0) {
+				audio_tempo_next_time = frame_time;
+			}
+			frame->pts = audio_tempo_input_samples;
+			audio_tempo_input_samples += frame->nb_samples;
+			int add_frame_result = av_buffersrc_add_frame_flags(audio_tempo_source, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+			if (add_frame_result < 0) {
+				print_line(vformat("Failed to feed the audio tempo filter: %s", ffmpeg_video_get_error_message(add_frame_result)));
+			}
+			while (av_buffersink_get_frame(audio_tempo_sink, audio_tempo_frame) >= 0) {
+				_push_audio_frame(audio_tempo_frame, audio_tempo_next_time);
+				// Every output second covers `tempo` seconds of the media.
+				audio_tempo_next_time += audio_tempo_frame->nb_samples * 1000.0 * audio_tempo / audio_tempo_frame->sample_rate;
+				av_frame_unref(audio_tempo_frame);
+			}
 		}
-		audio_buffer_mutex.unlock();
 
-		av_frame_unref(p_received_frame);
-		if (frame != p_received_frame) {
-			av_frame_free(&frame);
+	}
+}
+
+void VideoDecoder::_push_audio_frame(const AVFrame *p_frame, double p_frame_time) {
+	if (_is_output_stale(audio_stage.serial)) {
+		return;
+	}
+	int data_size = av_samples_get_buffer_size(nullptr, p_frame->ch_layout.nb_channels, p_frame->nb_samples, (AVSampleFormat)p_frame->format, 1);
+	Ref<DecodedAudioFrame> audio_frame = memnew(DecodedAudioFrame(p_frame_time));
+	audio_frame->set_time(p_frame_time);
+	audio_frame->serial = audio_stage.serial;
+	audio_frame->sample_data.resize(data_size / sizeof(float));
+	memcpy(audio_frame->sample_data.ptrw(), p_frame->data[0], data_size);
+	if (!pending_audio_frames.is_empty() || !decoded_audio_frames.push(audio_frame)) {
+		// No more packets are decoded until these are out, see _can_decode().
+		pending_audio_frames.push_back(audio_frame);
+	}
+}
+
+void VideoDecoder::_emit_pending_audio_frames() {
+	while (pending_audio_index < pending_audio_frames.size()) {
+		Ref<DecodedAudioFrame> &frame = pending_audio_frames[pending_audio_index];
+		if (!_is_output_stale(frame->serial) && !decoded_audio_frames.push(frame)) {
+			return;
 		}
+		frame.unref();
+		pending_audio_index++;
 	}
+	pending_audio_frames.clear();
+	pending_audio_index = 0;
 }
 
-void VideoDecoder::_hw_transfer_frame_return(Ref<VideoDecoder> p_decoder, Ref<FFmpegFrame> p_hw_frame) {
-	p_decoder->hw_transfer_frames.push_back(p_hw_frame);
+bool VideoDecoder::_build_audio_tempo_graph(const AVFrame *p_frame, float p_tempo) {
+	ZoneScopedN("Audio tempo filter create");
+	audio_tempo_graph = avfilter_graph_alloc();
+	ERR_FAIL_NULL_V(audio_tempo_graph, false);
+	if (audio_tempo_frame == nullptr) {
+		audio_tempo_frame = av_frame_alloc();
+	}
+
+	char channel_layout[64];
+	av_channel_layout_describe(&p_frame->ch_layout, channel_layout, sizeof(channel_layout));
+	String source_args = vformat("time_base=1/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+			p_frame->sample_rate, p_frame->sample_rate, av_get_sample_fmt_name((AVSampleFormat)p_frame->format), channel_layout);
+	int result = avfilter_graph_create_filter(&audio_tempo_source, avfilter_get_by_name("abuffer"), "in", source_args.utf8().get_data(), nullptr, audio_tempo_graph);
+	if (result >= 0) {
+		result = avfilter_graph_create_filter(&audio_tempo_sink, avfilter_get_by_name("abuffersink"), "out", nullptr, nullptr, audio_tempo_graph);
+	}
+
+	// Older atempo versions only take 0.5-2 per instance, the rest of the range is covered by chaining them.
+	AVFilterContext *previous = audio_tempo_source;
+	float remaining_tempo = p_tempo;
+	int instance = 0;
+	while (result >= 0) {
+		float instance_tempo = CLAMP(remaining_tempo, 0.5f, 2.0f);
+		remaining_tempo /= instance_tempo;
+		AVFilterContext *atempo = nullptr;
+		String name = vformat("atempo%d", instance++);
+		String args = vformat("tempo=%f", instance_tempo);
+		result = avfilter_graph_create_filter(&atempo, avfilter_get_by_name("atempo"), name.utf8().get_data(), args.utf8().get_data(), nullptr, audio_tempo_graph);
+		if (result >= 0) {
+			result = avfilter_link(previous, 0, atempo, 0);
+		}
+		previous = atempo;
+		if (Math::is_equal_approx(remaining_tempo, 1.0f)) {
+			break;
+		}
+	}
+	if (result >= 0) {
+		result = avfilter_link(previous, 0, audio_tempo_sink, 0);
+	}
+	if (result >= 0) {
+		result = avfilter_graph_config(audio_tempo_graph, nullptr);
+	}
+
+	if (result < 0) {
+		print_line(vformat("Failed to create the audio tempo filter: %s", ffmpeg_video_get_error_message(result)));
+		_free_audio_tempo_graph();
+		return false;
+	}
+	audio_tempo = p_tempo;
+	return true;
 }
 
-void VideoDecoder::_scaler_frame_return(Ref<VideoDecoder> p_decoder, Ref<FFmpegFrame> p_scaler_frame) {
-	p_decoder->scaler_frames.push_back(p_scaler_frame);
+void VideoDecoder::_free_audio_tempo_graph() {
+	if (audio_tempo_graph != nullptr) {
+		// Frees the filters it contains too.
+		avfilter_graph_free(&audio_tempo_graph);
+	}
+	audio_tempo_source = nullptr;
+	audio_tempo_sink = nullptr;
+	audio_tempo = 1.0f;
+	audio_tempo_input_samples = 0;
+	audio_tempo_next_time = -1.0;
 }
 
-Ref<FFmpegFrame> VideoDecoder::_ensure_frame_pixel_format(Ref<FFmpegFrame> p_frame, AVPixelFormat p_target_pixel_format) {
-	ZoneScopedN("Video decoder rescale");
-	AVPixelFormat pixFormat;
-	switch (p_frame->get_frame()->format) {
+void VideoDecoder::_normalize_pixel_format(AVFrame *p_frame) {
+	switch (p_frame->format) {
 		case AV_PIX_FMT_YUVJ420P:
-			p_frame->get_frame()->format = AV_PIX_FMT_YUV420P;
+			p_frame->format = AV_PIX_FMT_YUV420P;
 			break;
 		case AV_PIX_FMT_YUVJ422P:
-			p_frame->get_frame()->format = AV_PIX_FMT_YUV422P;
+			p_frame->format = AV_PIX_FMT_YUV422P;
 			break;
 		case AV_PIX_FMT_YUVJ444P:
-			p_frame->get_frame()->format = AV_PIX_FMT_YUV444P;
+			p_frame->format = AV_PIX_FMT_YUV444P;
 			break;
 		case AV_PIX_FMT_YUVJ440P:
-			p_frame->get_frame()->format = AV_PIX_FMT_YUV440P;
+			p_frame->format = AV_PIX_FMT_YUV440P;
 			break;
 		default:
 			break;
 	}
-	
-	if (p_frame->get_frame()->format == p_target_pixel_format) {
-		return p_frame;
-	}
-
-	int width = p_frame->get_frame()->width;
-	int height = p_frame->get_frame()->height;
-
-	sws_context = sws_getCachedContext(
-			sws_context,
-			width, height, (AVPixelFormat)p_frame->get_frame()->format,
-			width, height, p_target_pixel_format,
-			1, nullptr, nullptr, nullptr);
+}
 
-	Ref<FFmpegFrame> scaler_frame;
-	{
-		if (scaler_frames.size() > 0) {
-			scaler_frame = scaler_frames[0];
-			scaler_frames.pop_front();
-		}
+int VideoDecoder::_get_effective_slice_count(int p_height) const {
+	int slice_count = conversion_slice_count.get();
+	if (slice_count == 0) {
+		// Small frames aren't worth the dispatch overhead.
+		slice_count = MIN(OS::get_singleton()->get_processor_count(), p_height / MIN_ROWS_PER_CONVERSION_SLICE);
 	}
+	return CLAMP(slice_count, 1, MAX_CONVERSION_SLICES);
+}
 
-	if (!scaler_frame.is_valid()) {
-		scaler_frame = Ref<FFmpegFrame>(memnew(FFmpegFrame(Ref<VideoDecoder>(this), (FFmpegFrame::return_frame_callback_t)&VideoDecoder::_scaler_frame_return)));
+void VideoDecoder::_convert_slice(ConversionSlice &p_slice) {
+	ZoneScopedN("Video decoder rescale slice");
+	int scaler_result = sws_scale(
+			p_slice.context,
+			p_slice.src_data, p_slice.src_linesize, 0, p_slice.height,
+			p_slice.dst_data, p_slice.dst_linesize);
+	p_slice.failed = scaler_result < 0;
+	if (p_slice.failed) {
+		print_line("Failed to scale frame:", ffmpeg_video_get_error_message(scaler_result));
 	}
+}
 
-	// (re)initialize the scaler frame if needed.
-	if (scaler_frame->get_frame()->format != p_target_pixel_format || scaler_frame->get_frame()->width != width || scaler_frame->get_frame()->height != height) {
-		av_frame_unref(scaler_frame->get_frame());
-
-		// Note: this field determines the scaler's output pix format.
-		scaler_frame->get_frame()->format = p_target_pixel_format;
-		scaler_frame->get_frame()->width = width;
-		scaler_frame->get_frame()->height = height;
-
-		int get_buffer_result = av_frame_get_buffer(scaler_frame->get_frame(), 0);
+void VideoDecoder::_convert_slice_task(void *p_userdata, uint32_t p_index) {
+	ConversionSlice *slices = (ConversionSlice *)p_userdata;
+	_convert_slice(slices[p_index]);
+}
 
-		if (get_buffer_result < 0) {
-			print_line("Failed to allocate SWS frame buffer:", ffmpeg_video_get_error_message(get_buffer_result));
-			p_frame->do_return();
-			return Ref<FFmpegFrame>();
-		}
+int VideoDecoder::_get_sws_flags() const {
+	switch (scale_filter.get()) {
+		case SCALE_FILTER_BILINEAR:
+			return SWS_BILINEAR;
+		case SCALE_FILTER_AREA:
+			return SWS_AREA;
+		case SCALE_FILTER_BICUBIC:
+			return SWS_BICUBIC;
+		case SCALE_FILTER_LANCZOS:
+			return SWS_LANCZOS;
+		default:
+			return SWS_FAST_BILINEAR;
 	}
+}
 
-	int scaler_result = sws_scale(
-			sws_context,
-			p_frame->get_frame()->data, p_frame->get_frame()->linesize, 0, height,
-			scaler_frame->get_frame()->data, scaler_frame->get_frame()->linesize);
-
-	// return the original frame regardless of the scaler result.
-	p_frame->do_return();
-
-	if (scaler_result < 0) {
-		print_line("Failed to scale frame:", ffmpeg_video_get_error_message(scaler_result));
-		return Ref<FFmpegFrame>();
+Vector2i VideoDecoder::_get_output_size(int p_width, int p_height) const {
+	uint64_t packed_size = target_size.get();
+	int target_width = packed_size >> 32;
+	int target_height = packed_size & 0xFFFFFFFF;
+	if (target_width <= 0 || target_height <= 0 || (target_width >= p_width && target_height >= p_height)) {
+		return Vector2i(p_width, p_height);
 	}
 
-	return scaler_frame;
+	Vector2i output_size;
+	if (fit_target_size.is_set()) {
+		double scale = MIN((double)target_width / p_width, (double)target_height / p_height);
+		output_size = Vector2i((int)Math::round(p_width * scale), (int)Math::round(p_height * scale));
+	} else {
+		output_size = Vector2i(MIN(target_width, p_width), MIN(target_height, p_height));
+	}
+	// Kept even so the chroma planes of YUV output line up with the luma plane.
+	output_size.x = MAX(2, output_size.x & ~1);
+	output_size.y = MAX(2, output_size.y & ~1);
+	return output_size;
 }
 
-AVFrame *VideoDecoder::_ensure_frame_audio_format(AVFrame *p_frame, AVSampleFormat p_target_audio_format) {
-	ZoneScopedN("Audio decoder rescale");
-	if (p_frame->format == p_target_audio_format) {
-		return p_frame;
+bool VideoDecoder::_convert_frame(AVFrame *p_frame, AVPixelFormat p_target_pixel_format, Vector2i p_dst_size, uint8_t *const p_dst_data[4], const int p_dst_linesize[4]) {
+	ZoneScopedN("Video decoder rescale");
+	int width = p_frame->width;
+	int height = p_frame->height;
+	int dst_width = p_dst_size.x;
+	int dst_height = p_dst_size.y;
+	int sws_flags = _get_sws_flags();
+
+	const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get((AVPixelFormat)p_frame->format);
+	const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(p_target_pixel_format);
+	ERR_FAIL_NULL_V(src_desc, false);
+	ERR_FAIL_NULL_V(dst_desc, false);
+
+	// Each slice is converted by its own SwsContext as an independent image, so slices have to start on a
+	// row where the chroma planes of both formats start a new row as well. Scaling is done in one piece,
+	// the filter taps of a band would never see the rows of its neighbours and leave seams between them.
+	int row_alignment = 1 << MAX(src_desc->log2_chroma_h, dst_desc->log2_chroma_h);
+	int slice_count = dst_width == width && dst_height == height ? _get_effective_slice_count(dst_height) : 1;
+	int rows_per_slice = (dst_height + slice_count - 1) / slice_count;
+	rows_per_slice = (rows_per_slice + row_alignment - 1) / row_alignment * row_alignment;
+	slice_count = (dst_height + rows_per_slice - 1) / rows_per_slice;
+
+	while (sws_contexts.size() < (uint32_t)slice_count) {
+		sws_contexts.push_back(nullptr);
+		conversion_slices.push_back(ConversionSlice());
 	}
-	AVChannelLayout outChannelLayout;
-	outChannelLayout.order = AV_CHANNEL_ORDER_NATIVE;
-	outChannelLayout.nb_channels= (2);
-	outChannelLayout.u.mask = { AV_CH_LAYOUT_STEREO };
-	outChannelLayout.opaque = NULL; 
 
-	int obtain_swr_ctx_result = swr_alloc_set_opts2(
-			&swr_context,
-			&outChannelLayout, p_target_audio_format, audio_codec_context->sample_rate,
-			&audio_codec_context->ch_layout, audio_codec_context->sample_fmt, audio_codec_context->sample_rate,
-			0, nullptr);
+	for (int i = 0; i < slice_count; i++) {
+		ConversionSlice &slice = conversion_slices[i];
+		int dst_y = i * rows_per_slice;
+		int dst_slice_height = MIN(rows_per_slice, dst_height - dst_y);
+		int slice_y = (int64_t)dst_y * height / dst_height / row_alignment * row_alignment;
+		int slice_end = i == slice_count - 1 ? height : (int64_t)(dst_y + dst_slice_height) * height / dst_height / row_alignment * row_alignment;
+		slice.height = slice_end - slice_y;
+
+		sws_contexts[i] = sws_getCachedContext(
+				sws_contexts[i],
+				width, slice.height, (AVPixelFormat)p_frame->format,
+				dst_width, dst_slice_height, p_target_pixel_format,
+				sws_flags, nullptr, nullptr, nullptr);
+
+		if (sws_contexts[i] == nullptr) {
+			print_line("Failed to obtain SWS context");
+			return false;
+		}
 
-	if (obtain_swr_ctx_result < 0) {
-		print_line("Failed to obtain SWR context");
-		return nullptr;
+		slice.context = sws_contexts[i];
+		slice.failed = false;
+		for (int plane = 0; plane < 4; plane++) {
+			// Planes 1 and 2 are the (possibly subsampled) chroma planes, alpha is always full height.
+			bool chroma_plane = plane == 1 || plane == 2;
+			int src_plane_y = chroma_plane ? slice_y >> src_desc->log2_chroma_h : slice_y;
+			int dst_plane_y = chroma_plane ? dst_y >> dst_desc->log2_chroma_h : dst_y;
+			slice.src_data[plane] = p_frame->data[plane] ? p_frame->data[plane] + src_plane_y * p_frame->linesize[plane] : nullptr;
+			slice.src_linesize[plane] = p_frame->linesize[plane];
+			slice.dst_data[plane] = p_dst_data[plane] ? p_dst_data[plane] + dst_plane_y * p_dst_linesize[plane] : nullptr;
+			slice.dst_linesize[plane] = p_dst_linesize[plane];
+		}
 	}
-	AVFrame *out_frame;
 
-	out_frame = av_frame_alloc();
-	out_frame->format = p_target_audio_format;
-	out_frame->ch_layout = outChannelLayout;
-	out_frame->sample_rate = audio_codec_context->sample_rate;
-	out_frame->nb_samples = p_frame->nb_samples;
-
-	int get_buffer_result = av_frame_get_buffer(out_frame, 0);
-
-	if (get_buffer_result < 0) {
-		print_line("Failed to allocate SWR frame buffer:", ffmpeg_video_get_error_message(get_buffer_result));
-		av_frame_unref(out_frame);
-		return nullptr;
+	// The destination is the backing store of a pooled Image, so this is the only write per pixel.
+	if (slice_count == 1) {
+		_convert_slice(conversion_slices[0]);
+		return !conversion_slices[0].failed;
 	}
 
-	int converter_result = swr_convert_frame(swr_context, out_frame, p_frame);
+	// The worker pool takes every slice but the first, which this thread converts while it waits.
+#ifdef GDEXTENSION
+	String description = "FFmpeg frame conversion";
+	int64_t group_id = internal::gdextension_interface_worker_thread_pool_add_native_group_task(
+			WorkerThreadPool::get_singleton()->_owner, &VideoDecoder::_convert_slice_task, conversion_slices.ptr() + 1, slice_count - 1, -1, true, description._native_ptr());
+#else
+	int64_t group_id = WorkerThreadPool::get_singleton()->add_native_group_task(
+			&VideoDecoder::_convert_slice_task, conversion_slices.ptr() + 1, slice_count - 1, -1, true, "FFmpeg frame conversion");
+#endif
+	_convert_slice(conversion_slices[0]);
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_id);
 
-	if (converter_result < 0) {
-		print_line("Failed to convert audio frame:", ffmpeg_video_get_error_message(converter_result));
-		av_frame_unref(out_frame);
-		return nullptr;
+	for (int i = 0; i < slice_count; i++) {
+		if (conversion_slices[i].failed) {
+			return false;
+		}
 	}
-
-	return out_frame;
+	return true;
 }
 
 void VideoDecoder::seek(double p_time, bool p_wait) {
-	decoded_frames_mutex.lock();
-	audio_buffer_mutex.lock();
-
-	decoded_frames.clear();
-	decoded_audio_frames.clear();
-
+	// Frames already queued are not touched here, the consumer drops them once it sees the new serial.
+	// This keeps the queues strictly single producer/single consumer no matter which thread seeks.
+	uint32_t serial = seek_serial.increment();
 	last_decoded_frame_time.set(p_time);
-	skip_current_outputs.set();
-	decoded_frames_mutex.unlock();
-	audio_buffer_mutex.unlock();
+	scrub_frame.unref();
+	scrub_resume_pending = false;
+	if (_serve_seek_from_scrub_cache(p_time, serial)) {
+		return;
+	}
+	demux_held.clear();
+	// Counted before pushing so the demuxer thread can't go back to sleep between the push and
+	// push_and_sync blocking, it stays awake until the command has run.
+	pending_commands.increment();
+	_wake_all();
 	if (p_wait) {
-		decoder_commands.push_and_sync(this, &VideoDecoder::_seek_command, p_time);
+		decoder_commands.push_and_sync(this, &VideoDecoder::_seek_command, p_time, serial);
 	} else {
-		decoder_commands.push(this, &VideoDecoder::_seek_command, p_time);
+		decoder_commands.push(this, &VideoDecoder::_seek_command, p_time, serial);
 	}
 }
 
 void VideoDecoder::start_decoding() {
-	ERR_FAIL_COND_MSG(thread != nullptr, "Cannot start decoding once already started");
+	ERR_FAIL_COND_MSG(demuxer_started, "Cannot start decoding once already started");
+	FFmpegDecodeScheduler *scheduler = FFmpegDecodeScheduler::get_singleton();
+	ERR_FAIL_NULL_MSG(scheduler, "The decode scheduler must be running before decoding can start.");
+	if (!registered_with_scheduler) {
+		// Before the codecs are opened, they size their thread pools from the number of decoders.
+		scheduler->register_video_decoder();
+		registered_with_scheduler = true;
+	}
 	if (format_context == nullptr) {
 		prepare_decoding();
 		recreate_codec_context();
@@ -790,7 +1805,42 @@ void VideoDecoder::start_decoding() {
 		}
 	}
 
-	thread = memnew(std::thread(_thread_func, this));
+	video_stage.media_type = AVMEDIA_TYPE_VIDEO;
+	video_stage.packets = memnew(FFmpegPacketQueue(MAX_QUEUED_VIDEO_PACKETS));
+	if (has_audio) {
+		audio_stage.media_type = AVMEDIA_TYPE_AUDIO;
+		audio_stage.packets = memnew(FFmpegPacketQueue(MAX_QUEUED_AUDIO_PACKETS));
+	}
+	demuxer_started = true;
+	demux_packet = av_packet_alloc();
+	if (has_audio) {
+		// Decoded straight to the rate the engine mixes at, so the player's resampler has nothing to do.
+		bool allow_surround = AudioServer::get_singleton()->get_speaker_mode() >= AudioServer::SPEAKER_SURROUND_51;
+		AVChannelLayout output_layout;
+		FFmpegAudioResampler::get_output_layout(audio_codec_context->ch_layout, audio_channel_mode, allow_surround, output_layout);
+		audio_resampler.set_output((int)AudioServer::get_singleton()->get_mix_rate(), output_layout);
+		av_channel_layout_uninit(&output_layout);
+	}
+
+	DecodeStage *stages[] = { &video_stage, &audio_stage };
+	for (DecodeStage *stage : stages) {
+		if (stage->packets == nullptr) {
+			continue;
+		}
+		int stage_priority = stage->media_type == AVMEDIA_TYPE_AUDIO ? FFmpegDecodeScheduler::PRIORITY_AUDIO : priority;
+		stage->decoder = this;
+		stage->receive_frame = av_frame_alloc();
+		stage->task = memnew(FFmpegDecodeTask(_decode_task_func, stage, stage_priority));
+		scheduler->signal(stage->task);
+	}
+
+	if (video_file.is_valid()) {
+		seek_index = FFmpegSeekIndex::open(video_file->get_path(), video_file->get_length(), video_stream->index);
+		demux_task = memnew(FFmpegDecodeTask(_demux_task_func, this, FFmpegDecodeScheduler::PRIORITY_AUDIO));
+		scheduler->signal(demux_task);
+	} else {
+		thread = memnew(std::thread(_thread_func, this));
+	}
 }
 
 int get_hw_video_decoder_score(AVHWDeviceType p_device_type) {
@@ -830,19 +1880,7 @@ Vector<VideoDecoder::AvailableDecoderInfo> VideoDecoder::get_available_decoders(
 
 	Ref<FFmpegCodec> first_codec;
 
-	void *iterator = NULL;
-	while (true) {
-		const AVCodec *av_codec = av_codec_iterate(&iterator);
-
-		if (av_codec == NULL) {
-			break;
-		}
-
-		if (av_codec->id != p_codec_id || !av_codec_is_decoder(av_codec)) {
-			continue;
-		}
-
-		Ref<FFmpegCodec> codec = memnew(FFmpegCodec(av_codec));
+	for (const Ref<FFmpegCodec> &codec : FFmpegCodecRegistry::get_singleton()->get_decoders(p_codec_id)) {
 		if (!first_codec.is_valid()) {
 			first_codec = codec;
 		}
@@ -874,30 +1912,135 @@ Vector<VideoDecoder::AvailableDecoderInfo> VideoDecoder::get_available_decoders(
 	return codecs;
 }
 
-void VideoDecoder::return_frames(Vector<Ref<DecodedFrame>> p_frames) {
-	for (Ref<DecodedFrame> frame : p_frames) {
-		return_frame(frame);
+void VideoDecoder::return_frame(Ref<DecodedFrame> p_frame) {
+	if (!p_frame.is_valid() || !p_frame->pool_handle.is_valid()) {
+		// Served from the scrub cache, the cache owns its images.
+		return;
 	}
+	if (!decoded_frame_pool.release(p_frame->pool_handle)) {
+		// Returned twice, e.g. by a seek followed by the consumer dropping its frames.
+		return;
+	}
+#ifdef FFMPEG_MT_GPU_UPLOAD
+	{
+		MutexLock lock(available_textures_mutex);
+		available_textures.push_back(p_frame->get_texture());
+	}
+	p_frame->set_texture(Ref<ImageTexture>());
+#endif
+	_release_planes(p_frame);
 }
 
-void VideoDecoder::return_frame(Ref<DecodedFrame> p_frame) {
-	MutexLock lock(available_textures_mutex);
-	available_textures.push_back(p_frame->get_texture());
+void VideoDecoder::_publish_live_frame(const Ref<DecodedFrame> &p_frame) {
+	// The slot owns a reference of its own, taken over by whoever exchanges the frame out.
+	p_frame->reference();
+	DecodedFrame *replaced_frame = live_frame.exchange(p_frame.ptr());
+	if (replaced_frame == nullptr) {
+		return;
+	}
+	Ref<DecodedFrame> replaced_frame_ref = Ref<DecodedFrame>(replaced_frame);
+	replaced_frame->unreference();
+	dropped_frame_count.increment();
+	return_frame(replaced_frame_ref);
 }
 
-Vector<Ref<DecodedFrame>> VideoDecoder::get_decoded_frames() {
-	Vector<Ref<DecodedFrame>> frames;
-	MutexLock lock(decoded_frames_mutex);
-	frames = decoded_frames.duplicate();
-	decoded_frames.clear();
-	return frames;
+bool VideoDecoder::_take_live_frame(Ref<DecodedFrame> &r_frame) {
+	DecodedFrame *frame = live_frame.exchange(nullptr);
+	if (frame == nullptr) {
+		return false;
+	}
+	r_frame = Ref<DecodedFrame>(frame);
+	frame->unreference();
+	return true;
 }
 
-Vector<Ref<DecodedAudioFrame>> VideoDecoder::get_decoded_audio_frames() {
-	MutexLock lock(audio_buffer_mutex);
-	Vector<Ref<DecodedAudioFrame>> frames = decoded_audio_frames.duplicate();
-	decoded_audio_frames.clear();
-	return frames;
+bool VideoDecoder::_peek_live_frame(Ref<DecodedFrame> &r_frame) {
+	Ref<DecodedFrame> newer_frame;
+	if (_take_live_frame(newer_frame)) {
+		if (live_peeked_frame.is_valid()) {
+			dropped_frame_count.increment();
+			return_frame(live_peeked_frame);
+		}
+		live_peeked_frame = newer_frame;
+	}
+	if (live_peeked_frame.is_valid() && live_peeked_frame->get_serial() != seek_serial.get()) {
+		return_frame(live_peeked_frame);
+		live_peeked_frame.unref();
+	}
+	if (live_peeked_frame.is_null()) {
+		return false;
+	}
+	r_frame = live_peeked_frame;
+	return true;
+}
+
+bool VideoDecoder::peek_decoded_frame(Ref<DecodedFrame> &r_frame) {
+	if (live) {
+		return _peek_live_frame(r_frame);
+	}
+	if (scrub_frame.is_valid()) {
+		r_frame = scrub_frame;
+		return true;
+	}
+	if (scrub_resume_pending) {
+		// Playback wants the frame after the one served from the scrub cache.
+		_resume_after_scrub_seek();
+	}
+	uint32_t serial = seek_serial.get();
+	Ref<DecodedFrame> *frame;
+	while ((frame = decoded_frames.peek()) != nullptr) {
+		if ((*frame)->get_serial() == serial) {
+			r_frame = *frame;
+			return true;
+		}
+		// Decoded before the latest seek.
+		Ref<DecodedFrame> stale_frame;
+		decoded_frames.pop(stale_frame);
+		return_frame(stale_frame);
+		_wake_stage(video_stage);
+	}
+	return false;
+}
+
+bool VideoDecoder::pop_decoded_frame(Ref<DecodedFrame> &r_frame) {
+	if (!peek_decoded_frame(r_frame)) {
+		return false;
+	}
+	if (live) {
+		live_peeked_frame.unref();
+		return true;
+	}
+	if (scrub_frame.is_valid()) {
+		scrub_frame.unref();
+		return true;
+	}
+	decoded_frames.pop(r_frame);
+	_wake_stage(video_stage);
+	return true;
+}
+
+bool VideoDecoder::peek_decoded_audio_frame(Ref<DecodedAudioFrame> &r_frame) {
+	uint32_t serial = seek_serial.get();
+	Ref<DecodedAudioFrame> *frame;
+	while ((frame = decoded_audio_frames.peek()) != nullptr) {
+		if ((*frame)->serial == serial) {
+			r_frame = *frame;
+			return true;
+		}
+		Ref<DecodedAudioFrame> stale_frame;
+		decoded_audio_frames.pop(stale_frame);
+		_wake_stage(audio_stage);
+	}
+	return false;
+}
+
+bool VideoDecoder::pop_decoded_audio_frame(Ref<DecodedAudioFrame> &r_frame) {
+	if (!peek_decoded_audio_frame(r_frame)) {
+		return false;
+	}
+	decoded_audio_frames.pop(r_frame);
+	_wake_stage(audio_stage);
+	return true;
 }
 
 VideoDecoder::DecoderState VideoDecoder::get_decoder_state() const {
@@ -913,9 +2056,63 @@ bool VideoDecoder::is_running() const {
 }
 
 double VideoDecoder::get_duration() const {
+	if (seek_index.is_valid() && seek_index->get_end_pts() != AV_NOPTS_VALUE) {
+		// Relative to the stream's start like every other time here, transport streams rarely start at 0.
+		return (seek_index->get_end_pts() - video_stream->start_time) * video_time_base_in_seconds * 1000.0;
+	}
 	return duration;
 }
 
+void VideoDecoder::set_reverse(bool p_reverse) {
+	reverse.set_to(p_reverse);
+	// Two windows worth of frames are alive at once while playing backwards.
+	uint32_t max_pooled_frames = p_reverse ? MAX_POOLED_FRAMES + MAX_REVERSE_WINDOW_FRAMES * 2 : MAX_POOLED_FRAMES;
+	decoded_frame_pool.set_max_free_objects(max_pooled_frames);
+	image_pool.set_max_free_objects(max_pooled_frames * 3);
+}
+
+bool VideoDecoder::is_reverse() const {
+	return reverse.is_set();
+}
+
+void VideoDecoder::set_scrub_cache_budget(uint64_t p_bytes) {
+	scrub_cache_budget.set(p_bytes);
+	if (p_bytes == 0) {
+		MutexLock lock(scrub_cache_mutex);
+		_clear_scrub_cache();
+	}
+}
+
+uint64_t VideoDecoder::get_scrub_cache_budget() const {
+	return scrub_cache_budget.get();
+}
+
+void VideoDecoder::set_scrub_mode(bool p_scrub_mode) {
+	scrub_mode.set_to(p_scrub_mode);
+}
+
+bool VideoDecoder::is_scrub_mode() const {
+	return scrub_mode.is_set();
+}
+
+uint32_t VideoDecoder::get_landed_seek_serial() const {
+	return landed_seek_serial.get();
+}
+
+double VideoDecoder::get_seek_landing_time() const {
+	return (seek_landing_pts.get() - video_stream->start_time) * video_time_base_in_seconds * 1000.0;
+}
+
+int64_t VideoDecoder::get_frame_count() const {
+	if (seek_index.is_valid() && seek_index->is_ready()) {
+		return seek_index->get_frame_count();
+	}
+	if (video_stream != nullptr && video_stream->nb_frames > 0) {
+		return video_stream->nb_frames;
+	}
+	return -1;
+}
+
 Vector2i VideoDecoder::get_size() const {
 	if (video_codec_context) {
 		return Vector2i(video_codec_context->width, video_codec_context->height);
@@ -923,38 +2120,195 @@ Vector2i VideoDecoder::get_size() const {
 	return Vector2i();
 }
 
+Vector2i VideoDecoder::get_output_size() const {
+	Vector2i size = get_size();
+	if (size == Vector2i()) {
+		return size;
+	}
+	return _get_output_size(size.x, size.y);
+}
+
 int VideoDecoder::get_audio_mix_rate() const {
 	if (audio_stream) {
-		return audio_codec_context->sample_rate;
+		return audio_resampler.get_output_sample_rate();
 	}
 	return 0;
 }
 
 int VideoDecoder::get_audio_channel_count() const {
 	if (audio_stream) {
-		// return audio_codec_context->ch_layout.nb_channels;
-		return 2;
+		return audio_resampler.get_output_channel_count();
 	}
 	return 0;
 }
 
+void VideoDecoder::set_audio_channel_mode(FFmpegAudioResampler::ChannelMode p_mode) {
+	ERR_FAIL_INDEX(p_mode, FFmpegAudioResampler::CHANNEL_MODE_MAX);
+	ERR_FAIL_COND_MSG(demuxer_started, "The audio channel mode can't be changed once decoding started.");
+	audio_channel_mode = p_mode;
+}
+
+void VideoDecoder::set_output_format(OutputFormat p_output_format) {
+	ERR_FAIL_COND_MSG(demuxer_started, "Output format must be set before decoding starts.");
+#ifdef FFMPEG_MT_GPU_UPLOAD
+	ERR_FAIL_COND_MSG(p_output_format != OUTPUT_FORMAT_RGBA, "YUV output is not supported together with FFMPEG_MT_GPU_UPLOAD.");
+#endif
+	output_format = p_output_format;
+}
+
+VideoDecoder::OutputFormat VideoDecoder::get_output_format() const {
+	return output_format;
+}
+
+void VideoDecoder::set_live(bool p_live) {
+	ERR_FAIL_COND_MSG(demuxer_started, "Live mode must be set before decoding starts.");
+	live = p_live;
+}
+
+bool VideoDecoder::is_live() const {
+	return live;
+}
+
+void VideoDecoder::set_priority(int p_priority) {
+	ERR_FAIL_INDEX(p_priority, FFmpegDecodeScheduler::PRIORITY_MAX);
+	priority = p_priority;
+	if (video_stage.task != nullptr) {
+		video_stage.task->set_priority(p_priority);
+	}
+}
+
+int VideoDecoder::get_priority() const {
+	return priority;
+}
+
+uint64_t VideoDecoder::get_dropped_frame_count() const {
+	return dropped_frame_count.get();
+}
+
+void VideoDecoder::set_conversion_slice_count(int p_slice_count) {
+	ERR_FAIL_COND(p_slice_count < 0);
+	conversion_slice_count.set(p_slice_count);
+}
+
+void VideoDecoder::set_target_size(Vector2i p_size, bool p_fit) {
+	ERR_FAIL_COND(p_size.x < 0 || p_size.y < 0);
+	fit_target_size.set_to(p_fit);
+	target_size.set(((uint64_t)p_size.x << 32) | (uint32_t)p_size.y);
+}
+
+Vector2i VideoDecoder::get_target_size() const {
+	uint64_t packed_size = target_size.get();
+	return Vector2i(packed_size >> 32, packed_size & 0xFFFFFFFF);
+}
+
+bool VideoDecoder::is_fit_target_size() const {
+	return fit_target_size.is_set();
+}
+
+void VideoDecoder::set_keyframes_only(bool p_keyframes_only) {
+	keyframes_only.set_to(p_keyframes_only);
+}
+
+bool VideoDecoder::is_keyframes_only() const {
+	return keyframes_only.is_set();
+}
+
+void VideoDecoder::set_playback_speed(float p_speed) {
+	playback_speed.set(CLAMP(p_speed, MIN_PLAYBACK_SPEED, MAX_PLAYBACK_SPEED));
+}
+
+float VideoDecoder::get_playback_speed() const {
+	return playback_speed.get();
+}
+
+void VideoDecoder::set_scale_filter(ScaleFilter p_filter) {
+	ERR_FAIL_INDEX(p_filter, SCALE_FILTER_MAX);
+	// Cached SwsContexts are recreated on the next frame since the flags no longer match.
+	scale_filter.set(p_filter);
+}
+
+VideoDecoder::ScaleFilter VideoDecoder::get_scale_filter() const {
+	return (ScaleFilter)scale_filter.get();
+}
+
+int VideoDecoder::get_conversion_slice_count() const {
+	return conversion_slice_count.get();
+}
+
+uint64_t VideoDecoder::get_pool_allocation_count() const {
+	return hw_transfer_frame_pool.get_allocation_count() + decoded_frame_pool.get_allocation_count() + image_pool.get_allocation_count();
+}
+
+uint64_t VideoDecoder::get_steady_state_allocation_count() const {
+	return steady_state_allocation_count.get();
+}
+
 VideoDecoder::VideoDecoder(Ref<FileAccess> p_file) :
-		decoder_commands(true) {
+		decoded_audio_frames(MAX_QUEUED_AUDIO_FRAMES),
+		decoder_commands(true),
+		scrub_image_pool(MAX_POOLED_SCRUB_IMAGES),
+		hw_transfer_frame_pool(MAX_POOLED_FRAMES),
+		decoded_frame_pool(MAX_POOLED_FRAMES),
+		image_pool(MAX_POOLED_IMAGES),
+		decoded_frames(MAX_PENDING_FRAMES) {
 	video_file = p_file;
+	playback_speed.set(1.0f);
 }
 
 VideoDecoder::VideoDecoder(const String &p_path) :
-		decoder_commands(true) {
+		decoded_audio_frames(MAX_QUEUED_AUDIO_FRAMES),
+		decoder_commands(true),
+		scrub_image_pool(MAX_POOLED_SCRUB_IMAGES),
+		hw_transfer_frame_pool(MAX_POOLED_FRAMES),
+		decoded_frame_pool(MAX_POOLED_FRAMES),
+		image_pool(MAX_POOLED_IMAGES),
+		decoded_frames(MAX_PENDING_FRAMES) {
 	video_path = p_path;
+	playback_speed.set(1.0f);
 }
 
 
 VideoDecoder::~VideoDecoder() {
+	thread_abort.set_to(true);
+	_wake_all();
 	if (thread != nullptr) {
-		thread_abort.set_to(true);
 		thread->join();
 		memdelete(thread);
 	}
+	FFmpegDecodeScheduler *scheduler = FFmpegDecodeScheduler::get_singleton();
+	FFmpegDecodeTask *tasks[] = { demux_task, video_stage.task, audio_stage.task };
+	for (FFmpegDecodeTask *task : tasks) {
+		if (task != nullptr) {
+			scheduler->cancel(task);
+			memdelete(task);
+		}
+	}
+	if (registered_with_scheduler) {
+		scheduler->unregister_video_decoder();
+	}
+
+	if (demux_packet != nullptr) {
+		av_packet_free(&demux_packet);
+	}
+	if (video_stage.receive_frame != nullptr) {
+		av_frame_free(&video_stage.receive_frame);
+	}
+	if (audio_stage.receive_frame != nullptr) {
+		av_frame_free(&audio_stage.receive_frame);
+	}
+
+	if (video_stage.packets != nullptr) {
+		memdelete(video_stage.packets);
+	}
+
+	DecodedFrame *pending_live_frame = live_frame.exchange(nullptr);
+	if (pending_live_frame != nullptr && pending_live_frame->unreference()) {
+		memdelete(pending_live_frame);
+	}
+
+	if (audio_stage.packets != nullptr) {
+		memdelete(audio_stage.packets);
+	}
 
 	if (format_context != nullptr && input_opened) {
 		avformat_close_input(&format_context);
@@ -968,12 +2322,15 @@ VideoDecoder::~VideoDecoder() {
 		avcodec_free_context(&audio_codec_context);
 	}
 
-	if (sws_context != nullptr) {
-		sws_freeContext(sws_context);
+	for (uint32_t i = 0; i < sws_contexts.size(); i++) {
+		if (sws_contexts[i] != nullptr) {
+			sws_freeContext(sws_contexts[i]);
+		}
 	}
 
-	if (swr_context != nullptr) {
-		swr_free(&swr_context);
+	_free_audio_tempo_graph();
+	if (audio_tempo_frame != nullptr) {
+		av_frame_free(&audio_tempo_frame);
 	}
 
 	if (io_context != nullptr) {
@@ -1000,3 +2357,11 @@ double DecodedFrame::get_time() const { return time; }
 
 void DecodedFrame::set_time(double p_time) { time = p_time; }
 
+void DecodedFrame::set_yuv_planes(const Ref<Image> &p_chroma_image, const Ref<Image> &p_chroma_v_image, PlaneLayout p_plane_layout, bool p_full_range, bool p_bt709) {
+	chroma_image = p_chroma_image;
+	chroma_v_image = p_chroma_v_image;
+	plane_layout = p_plane_layout;
+	full_range = p_full_range;
+	bt709 = p_bt709;
+}
+
@@ -55,29 +55,67 @@ using namespace godot;
 
 #endif
 
+#include "ffmpeg_audio_resampler.h"
 #include "ffmpeg_codec.h"
+#include "ffmpeg_codec_registry.h"
+#include "ffmpeg_decode_scheduler.h"
 #include "ffmpeg_frame.h"
+#include "ffmpeg_object_pool.h"
+#include "ffmpeg_packet_queue.h"
+#include "ffmpeg_seek_index.h"
+#include "ffmpeg_spsc_queue.h"
 #include "audio_decoder.h"
 extern "C" {
+#include "libavfilter/avfilter.h"
 #include "libavformat/avformat.h"
 #include "libswresample/swresample.h"
 #include "libswscale/swscale.h"
 }
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
 class DecodedFrame : public RefCounted {
+	friend class VideoDecoder;
+
+public:
+	enum PlaneLayout {
+		PLANE_LAYOUT_RGBA,
+		PLANE_LAYOUT_YUV420P, // image is Y, chroma_image is U and chroma_v_image is V, all R8
+		PLANE_LAYOUT_NV12, // image is Y (R8), chroma_image is interleaved UV (RG8)
+	};
+
+private:
 	double time;
 	Ref<ImageTexture> texture;
 	Ref<Image> image;
+	Ref<Image> chroma_image;
+	Ref<Image> chroma_v_image;
+	PlaneLayout plane_layout = PLANE_LAYOUT_RGBA;
+	bool full_range = false;
+	bool bt709 = true;
+	FFmpegPoolHandle pool_handle;
+	FFmpegPoolHandle plane_handles[3];
+	uint32_t serial = 0;
 
 public:
 	Ref<ImageTexture> get_texture() const;
 	void set_texture(const Ref<ImageTexture> &p_texture);
 	Ref<Image> get_image() const { return image; };
+	void set_image(const Ref<Image> &p_image) { image = p_image; };
+	Ref<Image> get_chroma_image() const { return chroma_image; };
+	Ref<Image> get_chroma_v_image() const { return chroma_v_image; };
+	PlaneLayout get_plane_layout() const { return plane_layout; };
+	bool is_full_range() const { return full_range; };
+	bool is_bt709() const { return bt709; };
+	void set_yuv_planes(const Ref<Image> &p_chroma_image, const Ref<Image> &p_chroma_v_image, PlaneLayout p_plane_layout, bool p_full_range, bool p_bt709);
 
 	double get_time() const;
 	void set_time(double p_time);
+	// Seek serial the frame was decoded under, frames from before the latest seek are discarded.
+	uint32_t get_serial() const { return serial; };
 
 	DecodedFrame(double p_time, Ref<ImageTexture> p_texture);
 	DecodedFrame(double p_time, Ref<Image> p_image);
@@ -103,15 +141,98 @@ public:
 		END_OF_STREAM,
 		STOPPED
 	};
+	enum OutputFormat {
+		OUTPUT_FORMAT_RGBA,
+		// Frames keep their native YUV420P/NV12 planes, color conversion is done on the GPU.
+		OUTPUT_FORMAT_YUV,
+	};
+	// Filters used when frames are scaled down to the target size, from fastest to sharpest.
+	enum ScaleFilter {
+		SCALE_FILTER_FAST_BILINEAR,
+		SCALE_FILTER_BILINEAR,
+		// Averages every source pixel, the best choice for large reductions such as thumbnails.
+		SCALE_FILTER_AREA,
+		SCALE_FILTER_BICUBIC,
+		SCALE_FILTER_LANCZOS,
+		SCALE_FILTER_MAX,
+	};
 
 private:
-	Vector<Ref<DecodedAudioFrame>> decoded_audio_frames;
+	// Each decode stage runs as its own task on the decode scheduler, fed by the demuxer through its packet queue.
+	struct DecodeStage {
+		VideoDecoder *decoder = nullptr;
+		AVMediaType media_type = AVMEDIA_TYPE_UNKNOWN;
+		FFmpegPacketQueue *packets = nullptr;
+		FFmpegDecodeTask *task = nullptr;
+		AVFrame *receive_frame = nullptr;
+		// Serial of the packets being decoded, output from other serials is dropped.
+		uint32_t serial = 0;
+		double skip_output_until_time = -1.0;
+		// Mode the codec was last configured for, video only.
+		bool keyframes_only = false;
+		// End of the reverse playback window being decoded, -1 when playing forwards.
+		double reverse_end_time = -1.0;
+	};
+
+	// A horizontal band of a frame being converted, each one has its own SwsContext so they can run in parallel.
+	struct ConversionSlice {
+		SwsContext *context = nullptr;
+		const uint8_t *src_data[4] = {};
+		int src_linesize[4] = {};
+		uint8_t *dst_data[4] = {};
+		int dst_linesize[4] = {};
+		// Source rows, the same as the output rows unless the frame is scaled, which is never sliced.
+		int height = 0;
+		bool failed = false;
+	};
+
+	// A converted frame kept around for scrubbing. Its planes are copies from scrub_image_pool, the decoded
+	// frame's own images go back to image_pool as usual.
+	struct ScrubCacheEntry {
+		double time = 0.0;
+		// Time of the frame decoded right after this one, seeks up to it land on this frame.
+		double end_time = 0.0;
+		int64_t pts = 0;
+		Ref<Image> image;
+		Ref<Image> chroma_image;
+		Ref<Image> chroma_v_image;
+		FFmpegPoolHandle plane_handles[3];
+		DecodedFrame::PlaneLayout plane_layout = DecodedFrame::PLANE_LAYOUT_RGBA;
+		bool full_range = false;
+		bool bt709 = true;
+		uint64_t size = 0;
+		uint64_t last_used = 0;
+	};
 
-	Mutex audio_buffer_mutex;
+	FFmpegSPSCQueue<Ref<DecodedAudioFrame>> decoded_audio_frames;
+	// Audio that didn't fit into decoded_audio_frames, slowed down playback turns a packet into several
+	// times its frames. Handed out before the next packet is decoded.
+	LocalVector<Ref<DecodedAudioFrame>> pending_audio_frames;
+	uint32_t pending_audio_index = 0;
 
-	SwsContext *sws_context = nullptr;
-	SwrContext *swr_context = nullptr;
-	DecoderState decoder_state = DecoderState::READY;
+	LocalVector<SwsContext *> sws_contexts;
+	LocalVector<ConversionSlice> conversion_slices;
+	// 0 picks the slice count from the frame height and the number of cores.
+	SafeNumeric<uint32_t> conversion_slice_count;
+	// Width in the high half and height in the low half so both change together, 0 keeps the source size.
+	SafeNumeric<uint64_t> target_size;
+	SafeFlag fit_target_size;
+	SafeNumeric<uint32_t> scale_filter;
+	SafeFlag keyframes_only;
+	// Frames that can't be shown at this rate aren't converted, audio is time-stretched to it.
+	SafeNumeric<float> playback_speed;
+	double speed_next_output_time = -1.0;
+	// atempo filter graph of the audio stage, only built while not playing at 1x.
+	AVFilterGraph *audio_tempo_graph = nullptr;
+	AVFilterContext *audio_tempo_source = nullptr;
+	AVFilterContext *audio_tempo_sink = nullptr;
+	AVFrame *audio_tempo_frame = nullptr;
+	float audio_tempo = 1.0f;
+	int64_t audio_tempo_input_samples = 0;
+	double audio_tempo_next_time = -1.0;
+	FFmpegAudioResampler audio_resampler;
+	FFmpegAudioResampler::ChannelMode audio_channel_mode = FFmpegAudioResampler::CHANNEL_MODE_AUTO;
+	std::atomic<DecoderState> decoder_state = { DecoderState::READY };
 	mutable CommandQueueMT decoder_commands;
 	AVStream *video_stream = nullptr;
 	AVStream *audio_stream = nullptr;
@@ -125,44 +246,179 @@ private:
 	double video_time_base_in_seconds;
 	double audio_time_base_in_seconds;
 	double duration;
-	double skip_output_until_time = -1.0;
-	SafeFlag skip_current_outputs;
+	// Nominal, only used where the next frame's time isn't known.
+	double frame_duration = 0.0;
+	// Bumped by every seek request, demux_serial is the one the demuxer has caught up with.
+	SafeNumeric<uint32_t> seek_serial;
+	uint32_t demux_serial = 0;
+	double demux_seek_time = -1.0;
+	AVPacket *demux_packet = nullptr;
+	// Set when the queue for the last demuxed packet was full, it is retried before reading any further.
+	FFmpegPacketQueue *stalled_queue = nullptr;
+	bool demux_reached_end = false;
+	// Keyframes only mode as last seen by the demuxer. When going back to full decoding, packets are still
+	// dropped until the next keyframe since they reference frames the codec never saw.
+	bool demux_keyframes_only = false;
+	bool demux_waiting_for_keyframe = false;
+	// Built in the background for files, seeks fall back to the demuxer's own seeking until it's ready.
+	Ref<FFmpegSeekIndex> seek_index;
+	bool demux_seek_index_applied = false;
+	// Opening a network stream gives up after this point, 0 once opened.
+	uint64_t open_deadline_msec = 0;
+	bool demuxer_started = false;
+	DecodeStage video_stage;
+	DecodeStage audio_stage;
+	bool video_codec_needs_recreate = false;
 	SafeNumeric<float> last_decoded_frame_time;
+	// Set when the first frame after a seek is output, the pts is written first.
+	SafeNumeric<int64_t> seek_landing_pts;
+	SafeNumeric<uint32_t> landed_seek_serial;
+	// Sorted by time, filled by the video decode stage and read by seeks.
+	Mutex scrub_cache_mutex;
+	LocalVector<ScrubCacheEntry> scrub_cache;
+	FFmpegObjectPool<Image> scrub_image_pool;
+	uint64_t scrub_cache_size = 0;
+	uint64_t scrub_cache_use_count = 0;
+	Vector2i scrub_cache_image_size;
+	double scrub_cache_previous_time = -1.0;
+	uint32_t scrub_cache_previous_serial = 0;
+	SafeNumeric<uint64_t> scrub_cache_budget;
+	SafeFlag scrub_mode;
+	// Consumer side of a seek served from the scrub cache. The demuxer is held where it was until
+	// playback moves past the served frame, then it seeks to resume_time.
+	Ref<DecodedFrame> scrub_frame;
+	bool scrub_resume_pending = false;
+	double scrub_resume_time = 0.0;
+	SafeFlag demux_held;
+	// Reverse playback. The demuxer reads the file in windows that each end where the one after them
+	// starts. A window is decoded forwards into reverse_window_frames, then handed out backwards from
+	// pending_output_frames while the window before it decodes.
+	SafeFlag reverse;
+	bool demux_reverse = false;
+	bool demux_reverse_window_done = false;
+	double reverse_window_end = 0.0;
+	bool reverse_window_has_keyframe = false;
+	double reverse_window_keyframe_time = 0.0;
+	LocalVector<double> reverse_window_times;
+	LocalVector<Ref<DecodedFrame>> reverse_window_frames;
+	// Frames waiting for room in decoded_frames. Besides reverse windows, a single packet or a drain
+	// can decode into more frames than there are free slots, these are parked here instead of dropped.
+	LocalVector<Ref<DecodedFrame>> pending_output_frames;
+	uint32_t pending_output_index = 0;
 	Ref<FileAccess> video_file;
 	String video_path;
 	BitField<HardwareVideoDecoder> target_hw_video_decoders = HardwareVideoDecoder::ANY;
 	Mutex available_textures_mutex;
 	List<Ref<ImageTexture>> available_textures;
-	Mutex hw_transfer_frames_mutex;
-	List<Ref<FFmpegFrame>> hw_transfer_frames;
-	Mutex scaler_frames_mutex;
-	List<Ref<FFmpegFrame>> scaler_frames;
-	Mutex decoded_frames_mutex;
-	Vector<Ref<DecodedFrame>> decoded_frames;
+	FFmpegObjectPool<FFmpegFrame> hw_transfer_frame_pool;
+	FFmpegObjectPool<DecodedFrame> decoded_frame_pool;
+	FFmpegObjectPool<Image> image_pool;
+	uint64_t frames_since_pool_warmup = 0;
+	Vector2i pool_frame_size;
+	SafeNumeric<uint64_t> steady_state_allocation_count;
+	FFmpegSPSCQueue<Ref<DecodedFrame>> decoded_frames;
+	// Files are demuxed by a scheduler task. Network reads block until data arrives, so network
+	// streams get a thread of their own instead of holding up a worker.
+	FFmpegDecodeTask *demux_task = nullptr;
 	std::thread *thread = nullptr;
 	SafeFlag thread_abort;
+	int priority = FFmpegDecodeScheduler::PRIORITY_VISIBLE;
+	bool registered_with_scheduler = false;
+	// The network demuxer thread sleeps on this whenever it has nothing to do. Queue activity,
+	// seeks and shutdown wake it up.
+	std::mutex wakeup_mutex;
+	std::condition_variable wakeup_condition;
+	SafeNumeric<uint32_t> idle_threads;
+	SafeNumeric<uint32_t> pending_commands;
 
 	bool looping = false;
+	OutputFormat output_format = OUTPUT_FORMAT_RGBA;
+	// Live mode hands frames over through a single slot instead of decoded_frames, a new frame replaces
+	// the one the consumer hasn't picked up yet so latency can't build up.
+	bool live = false;
+	std::atomic<DecodedFrame *> live_frame = { nullptr };
+	Ref<DecodedFrame> live_peeked_frame;
+	int live_frames_skipped_in_row = 0;
+	SafeNumeric<uint64_t> dropped_frame_count;
 
 	static int _read_packet_callback(void *p_opaque, uint8_t *p_buf, int p_buf_size);
 	static int64_t _stream_seek_callback(void *p_opaque, int64_t p_offset, int p_whence);
+	static int _interrupt_callback(void *p_opaque);
 	void prepare_decoding();
 	void recreate_codec_context();
+	void recreate_video_codec_context();
+	void recreate_audio_codec_context();
 	static HardwareVideoDecoder from_av_hw_device_type(AVHWDeviceType p_device_type);
 
-	void _seek_command(double p_target_timestamp);
+	void _seek_command(double p_target_timestamp, uint32_t p_serial);
+	void _perform_seek(double p_target_timestamp, uint32_t p_serial);
+	bool _seek_with_index(int64_t p_target_pts);
+	void _seek_demuxer(int64_t p_target_pts);
+	bool _get_packet_time(const AVPacket *p_packet, double &r_time) const;
+	void _start_reverse_window();
+	// The packet and everything demuxed after it can only be shown after the reverse window.
+	bool _is_past_reverse_window(const AVPacket *p_packet) const;
+	void _demux_reverse_packet();
+	void _finish_reverse_window();
+	void _output_reverse_window(DecodeStage &p_stage, const FFmpegPacketQueue::Entry &p_entry, AVFrame *p_receive_frame);
+	void _emit_pending_frames();
+	void _clear_pending_frames();
+	bool _serve_seek_from_scrub_cache(double p_time, uint32_t p_serial);
+	void _resume_after_scrub_seek();
+	bool _is_filling_scrub_cache() const;
+	uint32_t _scrub_cache_upper_bound(double p_time) const;
+	void _cache_scrub_frame(const Ref<DecodedFrame> &p_frame, int64_t p_pts, uint32_t p_serial);
+	Ref<Image> _copy_scrub_image(const Ref<Image> &p_image, FFmpegPoolHandle &r_handle);
+	void _release_scrub_entry(ScrubCacheEntry &p_entry);
+	void _clear_scrub_cache();
+	bool _is_output_stale(uint32_t p_serial) const;
+	bool _can_demux() const;
+	bool _demuxer_has_work() const;
+	bool _can_decode(const DecodeStage &p_stage) const;
+	template <class F>
+	void _wait_until(F p_predicate);
+	void _wake_all();
+	void _wake_demuxer();
+	void _wake_stage(const DecodeStage &p_stage);
 	static void _thread_func(void *userdata);
-	void _decode_next_frame(AVPacket *p_packet, AVFrame *p_receive_frame);
-	int _send_packet(AVCodecContext *p_codec_context, AVFrame *p_receive_frame, AVPacket *p_packet);
+	static FFmpegDecodeTask::StepResult _demux_task_func(void *p_userdata);
+	static FFmpegDecodeTask::StepResult _decode_task_func(void *p_userdata);
+	FFmpegDecodeTask::StepResult _demux_step();
+	FFmpegDecodeTask::StepResult _decode_step(DecodeStage &p_stage);
+	bool _demux_next_packet();
+	void _queue_demuxed_packet(FFmpegPacketQueue *p_queue);
+	bool _should_drop_video_packet(const AVPacket *p_packet);
+	bool _wants_keyframes_only() const;
+	bool _build_audio_tempo_graph(const AVFrame *p_frame, float p_tempo);
+	void _free_audio_tempo_graph();
+	void _push_audio_frame(const AVFrame *p_frame, double p_frame_time);
+	void _emit_pending_audio_frames();
+	void _decode_entry(DecodeStage &p_stage, const FFmpegPacketQueue::Entry &p_entry, AVFrame *p_receive_frame);
+	AVCodecContext *_get_codec_context(const DecodeStage &p_stage) const;
+	int _send_packet(DecodeStage &p_stage, AVFrame *p_receive_frame, AVPacket *p_packet);
 	void _try_disable_hw_decoding(int p_error_code);
 	void _read_decoded_frames(AVFrame *p_received_frame);
 	void _read_decoded_audio_frames(AVFrame *p_received_frame);
 
-	static void _hw_transfer_frame_return(Ref<VideoDecoder> p_decoder, Ref<FFmpegFrame> p_hw_frame);
-	static void _scaler_frame_return(Ref<VideoDecoder> p_decoder, Ref<FFmpegFrame> p_hw_frame);
 
-	Ref<FFmpegFrame> _ensure_frame_pixel_format(Ref<FFmpegFrame> p_frame, AVPixelFormat p_target_pixel_format);
-	AVFrame *_ensure_frame_audio_format(AVFrame *p_frame, AVSampleFormat p_target_audio_format);
+	static void _normalize_pixel_format(AVFrame *p_frame);
+	int _get_effective_slice_count(int p_height) const;
+	static void _convert_slice(ConversionSlice &p_slice);
+	static void _convert_slice_task(void *p_userdata, uint32_t p_index);
+	int _get_sws_flags() const;
+	Vector2i _get_output_size(int p_width, int p_height) const;
+	bool _convert_frame(AVFrame *p_frame, AVPixelFormat p_target_pixel_format, Vector2i p_dst_size, uint8_t *const p_dst_data[4], const int p_dst_linesize[4]);
+	static void _copy_plane(const uint8_t *p_src, int p_src_linesize, uint8_t *p_dst, int p_row_size, int p_height);
+	void _count_pool_allocation();
+	static uint64_t _get_image_key(int p_width, int p_height, Image::Format p_format);
+	Ref<Image> _acquire_image(int p_width, int p_height, Image::Format p_format, FFmpegPoolHandle &r_handle);
+	Ref<DecodedFrame> _acquire_decoded_frame(double p_frame_time);
+	void _release_planes(const Ref<DecodedFrame> &p_frame);
+	Ref<DecodedFrame> _unwrap_rgba_frame(AVFrame *p_frame, double p_frame_time, Vector2i p_output_size);
+	Ref<DecodedFrame> _unwrap_yuv_frame(AVFrame *p_frame, double p_frame_time, Vector2i p_output_size);
+	void _publish_live_frame(const Ref<DecodedFrame> &p_frame);
+	bool _take_live_frame(Ref<DecodedFrame> &r_frame);
+	bool _peek_live_frame(Ref<DecodedFrame> &r_frame);
 
 public:
 	struct AvailableDecoderInfo {
@@ -172,17 +428,74 @@ public:
 	void seek(double p_time, bool p_wait = false);
 	void start_decoding();
 	Vector<AvailableDecoderInfo> get_available_decoders(const AVInputFormat *p_format, AVCodecID p_codec_id, BitField<HardwareVideoDecoder> p_target_decoders);
-	void return_frames(Vector<Ref<DecodedFrame>> p_frames);
 	void return_frame(Ref<DecodedFrame> p_frame);
-	Vector<Ref<DecodedFrame>> get_decoded_frames();
-	Vector<Ref<DecodedAudioFrame>> get_decoded_audio_frames();
+	// Consumer side of the frame queues, never blocks nor allocates. Must always be called from the same thread.
+	bool peek_decoded_frame(Ref<DecodedFrame> &r_frame);
+	bool pop_decoded_frame(Ref<DecodedFrame> &r_frame);
+	bool peek_decoded_audio_frame(Ref<DecodedAudioFrame> &r_frame);
+	bool pop_decoded_audio_frame(Ref<DecodedAudioFrame> &r_frame);
 	DecoderState get_decoder_state() const;
 	double get_last_decoded_frame_time() const;
+	// Serial of the latest seek whose first frame has been output, and that frame's exact time.
+	uint32_t get_landed_seek_serial() const;
+	double get_seek_landing_time() const;
 	bool is_running() const;
+	// Exact once the seek index is ready, until then it's whatever the container claims.
 	double get_duration() const;
+	// Number of frames in the video stream, -1 if unknown.
+	int64_t get_frame_count() const;
 	Vector2i get_size() const;
+	// The AudioServer's mix rate once decoding started, whatever the source's rate.
 	int get_audio_mix_rate() const;
+	// Must be set before decoding starts. In auto mode 5.1 and bigger sources keep 5.1 when the
+	// AudioServer runs a surround speaker mode.
+	void set_audio_channel_mode(FFmpegAudioResampler::ChannelMode p_mode);
 	int get_audio_channel_count() const;
+	void set_output_format(OutputFormat p_output_format);
+	OutputFormat get_output_format() const;
+	// Number of slices frame conversion is split into, each converted on its own worker. 0 means automatic.
+	// Frames scaled to a target size are always converted in one piece.
+	void set_conversion_slice_count(int p_slice_count);
+	int get_conversion_slice_count() const;
+	// Frames are scaled down to p_size while being converted, a zero size keeps the source resolution.
+	// With p_fit the aspect ratio is kept and the frame fits inside p_size. Frames are never scaled up.
+	void set_target_size(Vector2i p_size, bool p_fit = true);
+	Vector2i get_target_size() const;
+	bool is_fit_target_size() const;
+	void set_scale_filter(ScaleFilter p_filter);
+	ScaleFilter get_scale_filter() const;
+	// Size of the frames handed out, the source size after applying the target size.
+	Vector2i get_output_size() const;
+	// Only decode keyframes, for previews that can live with one frame per GOP. Can be toggled while decoding.
+	void set_keyframes_only(bool p_keyframes_only);
+	bool is_keyframes_only() const;
+	// Keep only the newest frame and minimize demuxer buffering, meant for live streams such as RTSP cameras.
+	void set_live(bool p_live);
+	bool is_live() const;
+	// Frames decoded but never shown because a newer one replaced them (live mode only).
+	uint64_t get_dropped_frame_count() const;
+	// 0.25x to 16x. Above 4x only keyframes are decoded and audio is muted, below that the audio's pitch is kept.
+	void set_playback_speed(float p_speed);
+	float get_playback_speed() const;
+	// Plays the video backwards, one window of at most a GOP at a time. Takes effect with the next seek,
+	// audio is not played in reverse.
+	void set_reverse(bool p_reverse);
+	bool is_reverse() const;
+	// Memory in bytes for keeping recently converted frames, seeks landing on one of them are served
+	// without decoding anything. 0 disables the cache. With the cache enabled, seek() must be called
+	// from the consumer thread since cache hits hand the frame to it directly.
+	void set_scrub_cache_budget(uint64_t p_bytes);
+	uint64_t get_scrub_cache_budget() const;
+	// Also caches the frames between the keyframe and the target of a seek, so the cache fills in
+	// both directions around the playhead while scrubbing.
+	void set_scrub_mode(bool p_scrub_mode);
+	bool is_scrub_mode() const;
+	// One of FFmpegDecodeScheduler::Priority, the audio stage always runs at PRIORITY_AUDIO.
+	void set_priority(int p_priority);
+	int get_priority() const;
+	// Debug counters: total objects allocated by the frame pools, and how many of those happened after warm-up.
+	uint64_t get_pool_allocation_count() const;
+	uint64_t get_steady_state_allocation_count() const;
 
 	VideoDecoder(Ref<FileAccess> p_file);
 	VideoDecoder(const String &p_path);